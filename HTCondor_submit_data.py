@@ -1,5 +1,6 @@
 #!/usr/bin/env python
 
+import json
 import os
 import optparse
 import subprocess
@@ -15,7 +16,9 @@ parser.add_option('-c', '--ncpu', dest='numberofcpu', help='number of cpu reques
 parser.add_option('-n', '--njobs', dest='numberofjobs', help='number of jobs to be submitted (integer)', default='1', type='int')
 parser.add_option('-s', '--subfiles', dest='subfiles', help='HTCondor submission file', default='HTcondor_sub_data_', type='string')
 parser.add_option('-u', '--uncertanties', dest='uncertanties', help='Systematic uncertainties number', default='0', type='int')
+parser.add_option('--multisys', dest='multisys', help='Comma-separated systematics evaluated in one pass (e.g. 0,1,2,3), overrides -u', default='', type='string')
 parser.add_option('--split', dest='split', help='Split files into multiple parts', action='store_true', default=False)
+parser.add_option('--plan', dest='plan', help='Plan from plan_jobs.py: one job per work unit, overrides -i, -n and --split', default='', type='string')
 
 (opt, args) = parser.parse_args()
 
@@ -27,22 +30,41 @@ nJobs = opt.numberofjobs
 subFiles = opt.subfiles
 uncerSys = opt.uncertanties
 splitFiles = opt.split
+multiSys = opt.multisys
+planFile = opt.plan
+
+# run_mode 0 and the systematics list are only passed in multi-systematic mode
+extraArgs = f" 0 {multiSys}" if multiSys else ""
+
+units = []
+if planFile:
+    if not os.path.exists(planFile):
+        sys.exit(f"Error: Plan {planFile} does not exist.")
+    with open(planFile) as fplan:
+        plan = json.load(fplan)
+    units = plan["units"]
+    # The cost model of the plan assumed this many mixed events, so the jobs use it too
+    planMix = int(plan["n_mix_events"])
+    print(f"Work units from {planFile}: {len(units)}, n_mix_events {planMix}")
 
 ''' Read list of files '''
-if not os.path.exists(inFiles + '.txt'):
+if planFile:
+    Lines = []
+elif not os.path.exists(inFiles + '.txt'):
     sys.exit(f"Error: Input file list {inFiles}.txt does not exist.")
 
-listOfFiles = open(inFiles + '.txt', 'r')
-Lines = listOfFiles.readlines()
-print(f"Number of files: {len(Lines)}")
-print(f"Number of jobs: {nJobs}")
+else:
+    listOfFiles = open(inFiles + '.txt', 'r')
+    Lines = listOfFiles.readlines()
+    print(f"Number of files: {len(Lines)}")
+    print(f"Number of jobs: {nJobs}")
 
-# Calculate ratio to split files across jobs
-ratio = len(Lines) / nJobs if nJobs != 0 else len(Lines)
-if ratio < 1:
-    sys.exit("Number of jobs greater than number of files, please reduce the number of jobs.")
-ratioint = int(ratio)
-print(f"Files per job: {ratio} --> closest integer: {ratioint}")
+    # Calculate ratio to split files across jobs
+    ratio = len(Lines) / nJobs if nJobs != 0 else len(Lines)
+    if ratio < 1:
+        sys.exit("Number of jobs greater than number of files, please reduce the number of jobs.")
+    ratioint = int(ratio)
+    print(f"Files per job: {ratio} --> closest integer: {ratioint}")
 
 ''' Start the write submission file '''
 fsubfile = open(subFiles + ".sub", "w")
@@ -54,13 +76,25 @@ requirements = ((OpSysAndVer =?= "AlmaLinux9") && (CERNEnvironment =?= "qa"))
 RequestCpus = {nCpu}
 '''
 
+# With a plan, one job per work unit on the unit list (its #entries line selects the range)
+if planFile:
+    for unit in units:
+        i = unit["unit"]
+        temp = f'''
+log        = cond/{subFiles}_unit_{i}.log
+output     = cond/{subFiles}_unit_{i}.out
+error      = cond/{subFiles}_unit_{i}.err
+arguments = {unit["list"]} {outFiles}_job_{i} 0 0 0 {planMix} 5 2.0 0 0 0 {uncerSys} {nCpu}{extraArgs}
+queue
+'''
+        command_lines += temp
 # If splitting is not enabled, submit one job with all files
-if not splitFiles:
+elif not splitFiles:
     temp = f'''
 log        = cond/{subFiles}.log
 output     = cond/{subFiles}.out
 error      = cond/{subFiles}.err
-arguments = {inFiles}.txt {outFiles} 0 0 0 10 5 2.0 0 0 0 {uncerSys}
+arguments = {inFiles}.txt {outFiles} 0 0 0 10 5 2.0 0 0 0 {uncerSys} {nCpu}{extraArgs}
 queue
 '''
     command_lines += temp
@@ -80,7 +114,7 @@ else:
 log        = cond/{subFiles}_part_{i}.log
 output     = cond/{subFiles}_part_{i}.out
 error      = cond/{subFiles}_part_{i}.err
-arguments = {inFiles}_part{i}.txt {outFiles}_job_{i} 0 0 0 10 5 2.0 0 0 0 {uncerSys}
+arguments = {inFiles}_part{i}.txt {outFiles}_job_{i} 0 0 0 10 5 2.0 0 0 0 {uncerSys} {nCpu}{extraArgs}
 queue
 '''
         command_lines += temp
@@ -8,12 +8,102 @@
 #include "TH1.h"
 #include "THnSparse.h"
 #include "Math/Vector4D.h"
+#include "functions_definition.h"
+#include "event_store.h"
 
-// Use this if you apply ΔpT and cosθ pair rejection
-bool splitcomb(ROOT::Math::PtEtaPhiMVector p1, ROOT::Math::PtEtaPhiMVector p2, double coscut, double dptcut);
+/**
+ * Body of the store-based MixEvents, specialized for the analysis mode
+ * @tparam Mode HBTPairMode (3D, Gamow weight, split-pair cut)
+ */
+template<typename Mode>
+void MixEventsT(
+    bool use_centrality,
+    int centrality_or_ntrkoff_int,
+    int nEvt_to_mix,
+    const HBT::Mixing::EventStore& store,
+    float vzcut,
+    THnSparseD* histo_SS,
+    THnSparseD* histo_SS3D,
+    THnSparseD* histo_OS,
+    THnSparseD* histo_OS3D,
+    int systematic,
+    TH1I* NeventsAss)
+{
+    const HBT::Kernel::PairCuts cuts = HBTPairCuts(Mode::splitCut);
+    const HBT::Kernel::TrackSoA& arena = store.Arena();
+    const int coulombSyst = CoulombSystematicIndex(systematic);
+    const int n_events = store.NumEvents();
+
+    for (int trg = 0; trg < n_events; ++trg) {
+        const HBT::Mixing::EventMeta& ev = store.Meta(trg);
+        const int ev_cent = use_centrality ? ev.centrality : ev.multiplicity;
+        int n_associated = 0;
+
+        for (int ass = trg + 1; ass < n_events && n_associated < nEvt_to_mix; ++ass) {
+            const HBT::Mixing::EventMeta& partner = store.Meta(ass);
+            const int partner_cent = use_centrality ? partner.centrality : partner.multiplicity;
+            if (std::abs(ev_cent - partner_cent) > centrality_or_ntrkoff_int) continue;
+            if (std::abs(ev.vz - partner.vz) > vzcut) continue;
+            ++n_associated;
+
+            HBT::Kernel::ForEachMixedPairT<Mode::do3D, Mode::splitCut>(
+                arena, ev.begin, ev.end, arena, partner.begin, partner.end, cuts,
+                [&](int i, int j, const HBT::Kernel::PairBlock& b, int k) {
+                    double weight = arena.weight[i] * arena.weight[j];
+                    bool isSameSign = (arena.charge[i] * arena.charge[j] > 0);
+                    if constexpr (Mode::coulomb) {
+                        weight *= HBT::Coulomb::DefaultGamowTable().Weight(b.qinv[k], isSameSign, coulombSyst);
+                    }
+                    double x1D[3] = {b.qinv[k], b.kt[k], double(ev_cent)};
+                    (isSameSign ? histo_SS : histo_OS)->Fill(x1D, weight);
+                    if constexpr (Mode::do3D) {
+                        double x3D[5] = {b.qout[k], b.qside[k], b.qlong[k], b.kt[k], double(ev_cent)};
+                        (isSameSign ? histo_SS3D : histo_OS3D)->Fill(x3D, weight);
+                    }
+                });
+        }
+        if (NeventsAss) NeventsAss->Fill(n_associated);
+    }
+}
+
+/**
+ * Zero-copy mixing over a read-only event store
+ * Each event is mixed with up to nEvt_to_mix later events of the store that
+ * lie within centrality_or_ntrkoff_int (hiBin or Ntrkoff) and vzcut.
+ * @param store Events to mix (one contiguous track arena plus per-event ranges)
+ * @param docostdptcut Apply split-pair rejection
+ * @param do_hbt3d Also fill the 3D histograms
+ * @param dogamovcorrection Apply Gamow weights (Coulomb variation from systematic)
+ * @param NeventsAss Filled with the number of partners found per event
+ */
+inline void MixEvents(
+    bool use_centrality,
+    int centrality_or_ntrkoff_int,
+    int nEvt_to_mix,
+    const HBT::Mixing::EventStore& store,
+    float vzcut,
+    THnSparseD* histo_SS,
+    THnSparseD* histo_SS3D,
+    THnSparseD* histo_OS,
+    THnSparseD* histo_OS3D,
+    bool docostdptcut,
+    bool do_hbt3d,
+    bool dogamovcorrection,
+    int systematic,
+    TH1I* NeventsAss)
+{
+    DispatchPairMode(do_hbt3d, dogamovcorrection, docostdptcut, [&](auto mode) {
+        MixEventsT<decltype(mode)>(use_centrality, centrality_or_ntrkoff_int, nEvt_to_mix, store, vzcut,
+                                   histo_SS, histo_SS3D, histo_OS, histo_OS3D, systematic, NeventsAss);
+    });
+}
 
-// Main mixing function for HBT and correlation analysis
-void MixEvents(
+/**
+ * Main mixing function for HBT and correlation analysis
+ * @note Thin adapter: copies the inputs once into an EventStore and calls the
+ *       store-based MixEvents. Prefer passing an EventStore directly.
+ */
+inline void MixEvents(
     bool use_centrality,
     int centrality_or_ntrkoff_int,
     int nEvt_to_mix,
@@ -33,6 +123,18 @@ void MixEvents(
     bool dogamovcorrection,
     int systematic,
     TH1I* NeventsAss
-);
+) {
+    HBT::Mixing::EventStore store;
+    std::size_t n_tracks = 0;
+    for (const auto& tracks : Track_Vector) n_tracks += tracks.size();
+    store.Reserve(Track_Vector.size(), n_tracks);
+    for (std::size_t e = 0; e < Track_Vector.size(); ++e) {
+        store.AddEvent(ev_centrality[e], ev_multiplicity[e], vtx_z_vec[e],
+                       Track_Vector[e], Track_Chg_Vector[e], Track_Eff_Vector[e]);
+    }
+    MixEvents(use_centrality, centrality_or_ntrkoff_int, nEvt_to_mix, store, vzcut,
+              histo_SS, histo_SS3D, histo_OS, histo_OS3D,
+              docostdptcut, do_hbt3d, dogamovcorrection, systematic, NeventsAss);
+}
 
 #endif // MIXEVENTSHBT_H
@@ -0,0 +1,266 @@
+#ifndef HBT_CHECKPOINT_H
+#define HBT_CHECKPOINT_H
+
+#include "call_libraries.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <type_traits>
+#include <unistd.h>
+
+/**
+ * @file checkpoint.h
+ * @brief Atomic binary checkpoints of the event-loop state
+ *
+ * Layout (native endianness, read back on the same kind of machine):
+ *   CheckpointHeader
+ *   body, as written by LoopOutput::Save (raw doubles and counters)
+ * The file is written to <path>.tmp, flushed, fsync'ed and renamed over
+ * <path>, so a job killed while writing keeps the previous checkpoint.
+ * The header carries a fingerprint of the run configuration; a checkpoint
+ * from a different configuration is refused instead of being merged.
+ */
+
+namespace HBT {
+    namespace Checkpoint {
+
+        // Format ==============================================================
+        constexpr char MAGIC[8] = {'H', 'B', 'T', 'C', 'K', 'P', 'T', '1'};
+        constexpr std::uint32_t VERSION = 1;
+
+        struct CheckpointHeader {
+            char magic[8];
+            std::uint32_t version = VERSION;
+            std::uint32_t reserved = 0;
+            std::uint64_t fingerprint = 0;   // Fingerprint of the run configuration
+            std::int64_t n_chunks = 0;
+            std::int64_t chunks_done = 0;    // Chunks merged into the saved output
+            std::int64_t next_entry = 0;     // First chain entry not merged yet
+        };
+
+        /**
+         * @brief 64-bit FNV-1a hash, stable across compilers and runs
+         */
+        class Fingerprint {
+        public:
+            void AddBytes(const void* data, std::size_t n) {
+                const unsigned char* p = static_cast<const unsigned char*>(data);
+                for (std::size_t i = 0; i < n; ++i) {
+                    hash_ ^= p[i];
+                    hash_ *= 1099511628211ULL;
+                }
+            }
+
+            template<typename T>
+            void Add(const T& value) {
+                static_assert(std::is_arithmetic<T>::value, "Fingerprint::Add takes numbers");
+                AddBytes(&value, sizeof(T));
+            }
+
+            void AddString(const std::string& s) {
+                Add<std::uint64_t>(s.size());
+                AddBytes(s.data(), s.size());
+            }
+
+            std::uint64_t Value() const { return hash_; }
+
+        private:
+            std::uint64_t hash_ = 14695981039346656037ULL;
+        };
+
+        // Streams =============================================================
+
+        class BinaryWriter {
+        public:
+            explicit BinaryWriter(std::FILE* file) : file_(file) {}
+
+            template<typename T>
+            void Write(const T& value) {
+                static_assert(std::is_trivially_copyable<T>::value, "raw write of a non-trivial type");
+                Put(&value, sizeof(T));
+            }
+
+            template<typename T, typename A>
+            void WriteVector(const std::vector<T, A>& v) {
+                static_assert(std::is_trivially_copyable<T>::value, "raw write of a non-trivial type");
+                Write<std::uint64_t>(v.size());
+                if (!v.empty()) Put(v.data(), v.size() * sizeof(T));
+            }
+
+            bool Ok() const { return ok_; }
+
+        private:
+            void Put(const void* data, std::size_t n) {
+                if (ok_ && std::fwrite(data, 1, n, file_) != n) ok_ = false;
+            }
+
+            std::FILE* file_;
+            bool ok_ = true;
+        };
+
+        class BinaryReader {
+        public:
+            explicit BinaryReader(std::FILE* file) : file_(file) {}
+
+            /**
+             * @throws std::runtime_error on a short read
+             */
+            template<typename T>
+            void Read(T& value) {
+                static_assert(std::is_trivially_copyable<T>::value, "raw read of a non-trivial type");
+                Get(&value, sizeof(T));
+            }
+
+            /**
+             * @param expected Required element count, or -1 for any
+             * @throws std::runtime_error on a short read or a size mismatch (other binning)
+             */
+            template<typename T, typename A>
+            void ReadVector(std::vector<T, A>& v, long long expected = -1) {
+                std::uint64_t n = 0;
+                Read(n);
+                if (expected >= 0 && n != std::uint64_t(expected)) {
+                    throw std::runtime_error("Checkpoint array size differs from this binning");
+                }
+                v.resize(n);
+                if (n) Get(v.data(), n * sizeof(T));
+            }
+
+        private:
+            void Get(void* data, std::size_t n) {
+                if (std::fread(data, 1, n, file_) != n) throw std::runtime_error("Truncated checkpoint");
+            }
+
+            std::FILE* file_;
+        };
+
+        /**
+         * @brief Writer interface that only counts bytes, to size a buffer for a Save
+         */
+        class ByteCounter {
+        public:
+            template<typename T>
+            void Write(const T&) { bytes_ += sizeof(T); }
+
+            template<typename T, typename A>
+            void WriteVector(const std::vector<T, A>& v) { bytes_ += sizeof(std::uint64_t) + v.size() * sizeof(T); }
+
+            bool Ok() const { return true; }
+            std::size_t Bytes() const { return bytes_; }
+
+        private:
+            std::size_t bytes_ = 0;
+        };
+
+        // ROOT Histograms =====================================================
+
+        /**
+         * @brief Bin contents, errors and statistics of a 1D-3D histogram
+         */
+        template<typename Out>
+        void SaveTH1(Out& out, const TH1& h) {
+            std::vector<double> content(h.GetNcells()), error2;
+            for (int i = 0; i < h.GetNcells(); ++i) content[i] = h.GetBinContent(i);
+            if (h.GetSumw2N() > 0) error2.assign(h.GetSumw2()->fArray, h.GetSumw2()->fArray + h.GetSumw2N());
+            std::vector<double> stats(TH1::kNstat, 0.0);
+            h.GetStats(stats.data());
+            out.WriteVector(content);
+            out.WriteVector(error2);
+            out.WriteVector(stats);
+            out.Write(h.GetEntries());
+        }
+
+        /**
+         * @brief Restores a histogram written by SaveTH1 into one of the same binning
+         */
+        template<typename In>
+        void LoadTH1(In& in, TH1& h) {
+            std::vector<double> content, error2, stats;
+            double entries = 0;
+            in.ReadVector(content, h.GetNcells());
+            in.ReadVector(error2);
+            in.ReadVector(stats, TH1::kNstat);
+            in.Read(entries);
+            h.Reset();
+            for (int i = 0; i < h.GetNcells(); ++i) h.SetBinContent(i, content[i]);
+            if (!error2.empty()) {
+                if (h.GetSumw2N() == 0) h.Sumw2();
+                std::copy(error2.begin(), error2.end(), h.GetSumw2()->fArray);
+            }
+            h.PutStats(stats.data());
+            h.SetEntries(entries);
+        }
+
+        // Files ===============================================================
+
+        /**
+         * @brief Local scratch for checkpoints: $_CONDOR_SCRATCH_DIR, $TMPDIR or "."
+         */
+        inline std::string ScratchDirectory() {
+            for (const char* var : {"_CONDOR_SCRATCH_DIR", "TMPDIR"}) {
+                const char* dir = std::getenv(var);
+                if (dir && *dir) return dir;
+            }
+            return ".";
+        }
+
+        /**
+         * @brief Writes header and body atomically to path
+         * @param body Called as body(BinaryWriter&)
+         * @throws std::runtime_error on I/O errors; the previous checkpoint is kept
+         */
+        template<typename BodyFn>
+        void WriteCheckpoint(const std::string& path, CheckpointHeader header, BodyFn&& body) {
+            const std::string tmp = path + ".tmp";
+            std::FILE* file = std::fopen(tmp.c_str(), "wb");
+            if (!file) throw std::runtime_error("Could not create checkpoint: " + tmp);
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.version = VERSION;
+            BinaryWriter out(file);
+            out.Write(header);
+            body(out);
+            bool ok = out.Ok() && std::fflush(file) == 0 && ::fsync(fileno(file)) == 0;
+            ok = (std::fclose(file) == 0) && ok;
+            if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+                std::remove(tmp.c_str());
+                throw std::runtime_error("Could not write checkpoint: " + path);
+            }
+        }
+
+        /**
+         * @brief Reads a checkpoint if one exists
+         * @param body Called as body(BinaryReader&) after the header is checked
+         * @return false if there is no checkpoint at path
+         * @throws std::runtime_error if the file is corrupt or from another configuration
+         */
+        template<typename BodyFn>
+        bool ReadCheckpoint(const std::string& path, std::uint64_t fingerprint,
+                            CheckpointHeader& header, BodyFn&& body) {
+            std::FILE* file = std::fopen(path.c_str(), "rb");
+            if (!file) return false;
+            try {
+                BinaryReader in(file);
+                in.Read(header);
+                if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.version != VERSION) {
+                    throw std::runtime_error("Not a checkpoint of this version: " + path);
+                }
+                if (header.fingerprint != fingerprint) {
+                    throw std::runtime_error("Checkpoint " + path + " was written with a different configuration");
+                }
+                body(in);
+            } catch (...) {
+                std::fclose(file);
+                throw;
+            }
+            std::fclose(file);
+            return true;
+        }
+
+    } // namespace Checkpoint
+} // namespace HBT
+
+#endif // HBT_CHECKPOINT_H
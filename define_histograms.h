@@ -1,3 +1,6 @@
+#ifndef DEFINE_HISTOGRAMS_H
+#define DEFINE_HISTOGRAMS_H
+
 #include "call_libraries.h"  // call libraries from ROOT and C++
 #include "MixEventsHBT.h"    // Mixing events header file
 
@@ -57,3 +60,15 @@ int	bins_trk[5]      =   { 200   ,  24  ,   30				      , 3   , nCentBins};
 double xmin_trk[5]   =   { 0.0   , -2.4 ,   -TMath::Pi()  		  , -1.5, CentBins[0]};
 double xmax_trk[5]   =   { 50.0  ,  2.4 ,   TMath::Pi()  		  ,  1.5, CentBins[nCentBins]};
 
+// Pair histograms (same-event and mixed, SS and OS)
+// Axis : 0 -> qinv, 1 -> pair kT, 2 -> centrality bin
+int	bins_hbt[3]      =   { nQBins ,  nKtBins   ,  nCentBins};
+double xmin_hbt[3]   =   { minQ   ,  KtBins[0] ,  CentBins[0]};
+double xmax_hbt[3]   =   { maxQ   ,  KtBins[nKtBins] ,  CentBins[nCentBins]};
+
+// Axis : 0 -> q_out, 1 -> q_side, 2 -> q_long, 3 -> pair kT, 4 -> centrality bin
+int	bins_hbt3D[5]    =   { nQBins3D ,  nQBins3D ,  nQBins3D ,  nKtBins   ,  nCentBins};
+double xmin_hbt3D[5] =   { minQ3D   ,  minQ3D   ,  minQ3D   ,  KtBins[0] ,  CentBins[0]};
+double xmax_hbt3D[5] =   { maxQ3D   ,  maxQ3D   ,  maxQ3D   ,  KtBins[nKtBins] ,  CentBins[nCentBins]};
+
+#endif // DEFINE_HISTOGRAMS_H
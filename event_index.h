@@ -0,0 +1,323 @@
+#ifndef HBT_EVENT_INDEX_H
+#define HBT_EVENT_INDEX_H
+
+#include "read_tree.h"
+#include "checkpoint.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+
+/**
+ * @file event_index.h
+ * @brief Per-file sidecar with the event-level quantities of every entry
+ *
+ * Event selection and the mixing bucket need only vz, hiBin and the skim
+ * filter bits, so these are written once per forest file (with the raw nTrk,
+ * for cost estimates) into a small sidecar. With the index the event
+ * loop evaluates the event cuts before touching the forest and reads
+ * branches only for the surviving entries. The header carries the stamp
+ * of the forest it was built from (entries, size, TFile UUID), so a
+ * sidecar left behind by a rewritten forest is refused.
+ *
+ * Layout (native endianness):
+ *   FileHeader
+ *   char     source[source_bytes]   (path as written in the input list)
+ *   float    vz[n_entries]
+ *   int32_t  hiBin[n_entries]
+ *   int32_t  nTrk[n_entries]
+ *   uint8_t  flags[n_entries]       (bit f: HBT_EVENT_FILTERS[f] fired,
+ *                                    ENTRY_READABLE: HltTree has the entry;
+ *                                    a short trackTree reads as no tracks,
+ *                                    as without the index)
+ */
+
+namespace HBT {
+    namespace Index {
+
+        // Format ==============================================================
+        constexpr char MAGIC[8] = {'H', 'B', 'T', 'I', 'D', 'X', '0', '1'};
+        constexpr std::uint32_t VERSION = 2;   // 2: forest stamp in the header
+        constexpr std::uint8_t ENTRY_READABLE = 0x80;
+
+        struct FileHeader {
+            char magic[8];
+            std::uint32_t version = VERSION;
+            std::uint32_t n_filters = 0;
+            std::uint64_t n_entries = 0;
+            std::uint64_t source_bytes = 0;
+            std::int64_t source_size = 0;   // Forest size in bytes
+            char source_uuid[40] = {};      // Forest TFile UUID as text, zero-padded
+        };
+
+        /**
+         * @brief What identifies the content of a forest file
+         */
+        struct FileStamp {
+            Long64_t entries = 0;   // HiTree entries
+            Long64_t bytes = 0;
+            std::string uuid;       // TFile UUID, new for every rewrite of the file
+        };
+
+        inline FileStamp StampOf(TFile& file) {
+            FileStamp stamp;
+            TTree* event_tree = dynamic_cast<TTree*>(file.Get("hiEvtAnalyzer/HiTree"));
+            if (event_tree) stamp.entries = event_tree->GetEntries();
+            stamp.bytes = file.GetSize();
+            stamp.uuid = file.GetUUID().AsString();
+            return stamp;
+        }
+
+        /**
+         * @brief Stamp of a forest; only the file header and the HiTree key are read
+         * @throws std::runtime_error if the file cannot be opened
+         */
+        inline FileStamp ReadFileStamp(const std::string& path) {
+            std::unique_ptr<TFile> file(TFile::Open(path.c_str()));
+            if (!file || file->IsZombie()) throw std::runtime_error("Could not open " + path);
+            return StampOf(*file);
+        }
+
+        /**
+         * @brief Filter bits an entry needs to pass requireFilters
+         */
+        inline std::uint8_t AllFiltersMask() {
+            return static_cast<std::uint8_t>((1u << HBT_EVENT_FILTERS.size()) - 1);
+        }
+
+        /**
+         * @brief Event-level columns of one file or of a whole chain (files appended in list order)
+         */
+        struct EventIndex {
+            std::vector<float> vz;
+            std::vector<std::int32_t> hiBin;
+            std::vector<std::int32_t> nTrk;
+            std::vector<std::uint8_t> flags;
+
+            Long64_t Entries() const { return static_cast<Long64_t>(vz.size()); }
+
+            void Append(const EventIndex& other) {
+                vz.insert(vz.end(), other.vz.begin(), other.vz.end());
+                hiBin.insert(hiBin.end(), other.hiBin.begin(), other.hiBin.end());
+                nTrk.insert(nTrk.end(), other.nTrk.begin(), other.nTrk.end());
+                flags.insert(flags.end(), other.flags.begin(), other.flags.end());
+            }
+
+            /**
+             * @brief EventPassesCuts evaluated from the index
+             * @param hiBin_out Output: hiBin after the centrality variation shift
+             */
+            bool Passes(Long64_t entry, const HBTEventCuts& cuts, int& hiBin_out) const {
+                hiBin_out = hiBin[entry] + cuts.hiBinShift;
+                if (!(flags[entry] & ENTRY_READABLE)) return false;
+                if (cuts.requireFilters && (flags[entry] & AllFiltersMask()) != AllFiltersMask()) return false;
+                if (std::abs(vz[entry]) > cuts.maxAbsVz) return false;
+                return (hiBin_out >= cuts.minHiBin && hiBin_out <= cuts.maxHiBin);
+            }
+
+            std::size_t MemoryBytes() const {
+                return vz.capacity() * sizeof(float) + (hiBin.capacity() + nTrk.capacity()) * sizeof(std::int32_t)
+                     + flags.capacity();
+            }
+        };
+
+        /**
+         * @brief Entries of [first, last) that pass any of the event cuts
+         * @param out Replaced by the selected entries, in entry order
+         */
+        inline void SelectEntries(const EventIndex& index, Long64_t first, Long64_t last,
+                                  const std::vector<HBTEventCuts>& cuts, std::vector<Long64_t>& out) {
+            out.clear();
+            int hiBin = 0;
+            for (Long64_t i = first; i < last; ++i) {
+                for (const HBTEventCuts& c : cuts) {
+                    if (index.Passes(i, c, hiBin)) {
+                        out.push_back(i);
+                        break;
+                    }
+                }
+            }
+        }
+
+        // Building ============================================================
+
+        /**
+         * @brief Reads vz, hiBin, nTrk and the filter bits of every entry of a forest file
+         * Only these branches are read (no track arrays).
+         * @param stamp Output: stamp of the file as it was read
+         * @throws std::runtime_error if the file, a tree, vz, hiBin, nTrk or a filter branch is missing
+         */
+        inline EventIndex BuildFileIndex(const std::string& path, FileStamp& stamp) {
+            std::unique_ptr<TFile> file(TFile::Open(path.c_str()));
+            if (!file || file->IsZombie()) throw std::runtime_error("Could not open " + path);
+            stamp = StampOf(*file);
+            TTree* event_tree = dynamic_cast<TTree*>(file->Get("hiEvtAnalyzer/HiTree"));
+            TTree* track_tree = dynamic_cast<TTree*>(file->Get("ppTrack/trackTree"));
+            TTree* skim_tree = dynamic_cast<TTree*>(file->Get("skimanalysis/HltTree"));
+            if (!event_tree || !track_tree || !skim_tree) {
+                throw std::runtime_error("Missing HiTree, trackTree or HltTree in " + path);
+            }
+
+            float vz = 0;
+            int hiBin = -1, nTrk = 0;
+            TBranch* b_vz = event_tree->GetBranch("vz");
+            TBranch* b_hiBin = event_tree->GetBranch("hiBin");
+            TBranch* b_nTrk = track_tree->GetBranch("nTrk");
+            if (!b_vz || !b_hiBin || !b_nTrk) throw std::runtime_error("Missing vz, hiBin or nTrk in " + path);
+            b_vz->SetAddress(&vz);
+            b_hiBin->SetAddress(&hiBin);
+            b_nTrk->SetAddress(&nTrk);
+            std::vector<int> filterValues(HBT_EVENT_FILTERS.size(), 1);
+            std::vector<TBranch*> filterBranches(HBT_EVENT_FILTERS.size(), nullptr);
+            for (std::size_t f = 0; f < HBT_EVENT_FILTERS.size(); ++f) {
+                filterBranches[f] = skim_tree->GetBranch(HBT_EVENT_FILTERS[f].c_str());
+                if (!filterBranches[f]) throw std::runtime_error("Missing branch " + HBT_EVENT_FILTERS[f] + " in " + path);
+                filterBranches[f]->SetAddress(&filterValues[f]);
+            }
+
+            const Long64_t n = event_tree->GetEntries();
+            const Long64_t n_tracks = track_tree->GetEntries();
+            const Long64_t n_skim = skim_tree->GetEntries();
+            EventIndex index;
+            index.vz.resize(n);
+            index.hiBin.resize(n);
+            index.nTrk.resize(n);
+            index.flags.resize(n);
+            for (Long64_t i = 0; i < n; ++i) {
+                b_vz->GetEntry(i);
+                b_hiBin->GetEntry(i);
+                nTrk = 0;
+                if (i < n_tracks) b_nTrk->GetEntry(i);
+                std::uint8_t flags = (i < n_skim) ? ENTRY_READABLE : 0;
+                for (std::size_t f = 0; f < filterBranches.size(); ++f) {
+                    filterValues[f] = 1;
+                    if (i < n_skim) filterBranches[f]->GetEntry(i);
+                    if (filterValues[f]) flags |= (1u << f);
+                }
+                index.vz[i] = vz;
+                index.hiBin[i] = hiBin;
+                index.nTrk[i] = nTrk;
+                index.flags[i] = flags;
+            }
+            return index;
+        }
+
+        // Files ===============================================================
+
+        /**
+         * @brief Sidecar path of a forest file
+         * @param index_dir Empty: next to the forest (<path>.hbtidx). Otherwise
+         *        <index_dir>/<basename>.<hash of path>.hbtidx, since forests
+         *        in different directories often share a basename.
+         */
+        inline std::string SidecarPath(const std::string& path, const std::string& index_dir) {
+            if (index_dir.empty()) return path + ".hbtidx";
+            Checkpoint::Fingerprint fp;
+            fp.AddString(path);
+            char hash[17];
+            std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(fp.Value()));
+            std::string base = path.substr(path.find_last_of('/') + 1);
+            return index_dir + "/" + base + "." + std::string(hash, 8) + ".hbtidx";
+        }
+
+        /**
+         * @brief Writes the sidecar of source to path (via <path>.tmp and a rename)
+         * @param stamp Stamp of source when the index was built
+         * @throws std::runtime_error on I/O errors
+         */
+        inline void WriteSidecar(const std::string& path, const std::string& source, const FileStamp& stamp,
+                                 const EventIndex& index) {
+            const std::string tmp = path + ".tmp";
+            std::FILE* file = std::fopen(tmp.c_str(), "wb");
+            if (!file) throw std::runtime_error("Could not create index: " + tmp);
+            FileHeader header;
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.n_filters = HBT_EVENT_FILTERS.size();
+            header.n_entries = index.vz.size();
+            header.source_bytes = source.size();
+            header.source_size = stamp.bytes;
+            std::strncpy(header.source_uuid, stamp.uuid.c_str(), sizeof(header.source_uuid) - 1);
+            const std::size_t n = index.vz.size();
+            bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1
+                   && std::fwrite(source.data(), 1, source.size(), file) == source.size()
+                   && std::fwrite(index.vz.data(), sizeof(float), n, file) == n
+                   && std::fwrite(index.hiBin.data(), sizeof(std::int32_t), n, file) == n
+                   && std::fwrite(index.nTrk.data(), sizeof(std::int32_t), n, file) == n
+                   && std::fwrite(index.flags.data(), 1, n, file) == n;
+            ok = (std::fclose(file) == 0) && ok;
+            if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+                std::remove(tmp.c_str());
+                throw std::runtime_error("Could not write index: " + path);
+            }
+        }
+
+        /**
+         * @brief Reads a sidecar written for source
+         * @param stamp Current stamp of source
+         * @return false if there is no sidecar at path
+         * @throws std::runtime_error if it is corrupt, of another version, of another file
+         *         or of an earlier version of source
+         */
+        inline bool ReadSidecar(const std::string& path, const std::string& source, const FileStamp& stamp,
+                                EventIndex& index) {
+            std::FILE* file = std::fopen(path.c_str(), "rb");
+            if (!file) return false;
+            FileHeader header;
+            std::string stored;
+            bool ok = std::fread(&header, sizeof(header), 1, file) == 1
+                   && std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0
+                   && header.version == VERSION && header.n_filters == HBT_EVENT_FILTERS.size();
+            if (ok) {
+                stored.resize(header.source_bytes);
+                ok = std::fread(&stored[0], 1, stored.size(), file) == stored.size();
+            }
+            if (ok && stored != source) {
+                std::fclose(file);
+                throw std::runtime_error("Index " + path + " was built for " + stored);
+            }
+            header.source_uuid[sizeof(header.source_uuid) - 1] = 0;
+            if (ok && (Long64_t(header.n_entries) != stamp.entries || header.source_size != stamp.bytes ||
+                       stamp.uuid != header.source_uuid)) {
+                std::fclose(file);
+                throw std::runtime_error("Index " + path + " is stale: " + source + " was rewritten (rebuild it)");
+            }
+            const std::size_t n = ok ? header.n_entries : 0;
+            index.vz.resize(n);
+            index.hiBin.resize(n);
+            index.nTrk.resize(n);
+            index.flags.resize(n);
+            ok = ok && std::fread(index.vz.data(), sizeof(float), n, file) == n
+                    && std::fread(index.hiBin.data(), sizeof(std::int32_t), n, file) == n
+                    && std::fread(index.nTrk.data(), sizeof(std::int32_t), n, file) == n
+                    && std::fread(index.flags.data(), 1, n, file) == n;
+            std::fclose(file);
+            if (!ok) throw std::runtime_error("Corrupt or outdated index: " + path);
+            return true;
+        }
+
+        /**
+         * @brief Index of a chain: the sidecars of its files, appended in list order
+         * Every forest is opened to check its stamp against the sidecar.
+         * @throws std::runtime_error if a sidecar is missing or stale (run build_event_index.C first)
+         */
+        inline std::shared_ptr<const EventIndex> LoadChainIndex(const std::vector<std::string>& files,
+                                                                const std::string& index_dir) {
+            auto chain = std::make_shared<EventIndex>();
+            EventIndex file_index;
+            for (const std::string& path : files) {
+                const std::string sidecar = SidecarPath(path, index_dir);
+                if (!ReadSidecar(sidecar, path, ReadFileStamp(path), file_index)) {
+                    throw std::runtime_error("No event index " + sidecar + " (run build_event_index.C)");
+                }
+                chain->Append(file_index);
+            }
+            return chain;
+        }
+
+    } // namespace Index
+} // namespace HBT
+
+#endif // HBT_EVENT_INDEX_H
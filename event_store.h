@@ -0,0 +1,109 @@
+#ifndef EVENT_STORE_H
+#define EVENT_STORE_H
+
+#include "pair_kernel.h"
+#include <vector>
+
+/**
+ * @file event_store.h
+ * @brief Read-only store of many events for mixing without copies
+ *
+ * All tracks live in one contiguous SoA arena; each event is a
+ * [begin, end) range in it plus its centrality, multiplicity and vz.
+ * Consumers address events by index and pass the ranges straight to the
+ * pair kernel, so nothing is copied once the store is filled.
+ */
+
+namespace HBT {
+    namespace Mixing {
+
+        /**
+         * @brief Per-event metadata and track range in the arena
+         */
+        struct EventMeta {
+            int begin = 0;
+            int end = 0;
+            int centrality = 0;     // hiBin
+            int multiplicity = 0;   // Ntrkoff
+            double vz = 0;          // cm
+
+            int size() const { return end - begin; }
+        };
+
+        class EventStore {
+        public:
+            void Reserve(std::size_t n_events, std::size_t n_tracks) {
+                events_.reserve(n_events);
+                arena_.reserve(n_tracks);
+            }
+
+            void Clear() {
+                events_.clear();
+                arena_.clear();
+            }
+
+            /**
+             * @brief Appends an event from SoA tracks
+             */
+            void AddEvent(int centrality, int multiplicity, double vz, const Kernel::TrackSoA& tracks) {
+                EventMeta meta = NewEvent(centrality, multiplicity, vz);
+                arena_.Append(tracks, 0, tracks.size());
+                meta.end = arena_.size();
+                events_.push_back(meta);
+            }
+
+            /**
+             * @brief Appends an event from Lorentz vectors (MixEvents input layout)
+             * @param weights Per-track weight (efficiency correction)
+             */
+            template<typename LorentzVec>
+            void AddEvent(int centrality, int multiplicity, double vz,
+                          const std::vector<LorentzVec>& tracks,
+                          const std::vector<int>& charges,
+                          const std::vector<double>& weights) {
+                EventMeta meta = NewEvent(centrality, multiplicity, vz);
+                for (std::size_t t = 0; t < tracks.size(); ++t) {
+                    arena_.px.push_back(tracks[t].Px());
+                    arena_.py.push_back(tracks[t].Py());
+                    arena_.pz.push_back(tracks[t].Pz());
+                    arena_.E.push_back(tracks[t].E());
+                    arena_.pt.push_back(tracks[t].Pt());
+                    arena_.p.push_back(tracks[t].P());
+                    arena_.charge.push_back(charges[t]);
+                    arena_.weight.push_back(weights[t]);
+                }
+                meta.end = arena_.size();
+                events_.push_back(meta);
+            }
+
+            int NumEvents() const { return static_cast<int>(events_.size()); }
+            int NumTracks() const { return arena_.size(); }
+            const EventMeta& Meta(int e) const { return events_[e]; }
+            const Kernel::TrackSoA& Arena() const { return arena_; }
+
+            /**
+             * @brief Heap memory held by the arena and the event table
+             */
+            std::size_t MemoryBytes() const {
+                return arena_.px.capacity() * (7 * sizeof(double) + sizeof(int))
+                     + events_.capacity() * sizeof(EventMeta);
+            }
+
+        private:
+            EventMeta NewEvent(int centrality, int multiplicity, double vz) const {
+                EventMeta meta;
+                meta.begin = arena_.size();
+                meta.centrality = centrality;
+                meta.multiplicity = multiplicity;
+                meta.vz = vz;
+                return meta;
+            }
+
+            Kernel::TrackSoA arena_;
+            std::vector<EventMeta> events_;
+        };
+
+    } // namespace Mixing
+} // namespace HBT
+
+#endif // EVENT_STORE_H
@@ -2,8 +2,13 @@
 #define FUNCTION_DEFINITIONS_H
 
 #include "call_libraries.h"
+#include "pair_kernel.h"
+#include "pair_pruning.h"
 #include <vector>
 #include <utility>
+#include <string>
+#include <stdexcept>
+#include <cstdint>
 
 // HBT Constants ==============================================================
 constexpr double PI_MASS = 0.13957039;       // Pion mass (GeV/c²)
@@ -59,9 +64,10 @@ double CalculateQlongLCMS(const LorentzVec& p1, const LorentzVec& p2) {
  */
 template<typename LorentzVec>
 double CalculateQout(const LorentzVec& p1, const LorentzVec& p2) {
-    TVector3 qT(p1.Px()-p2.Px(), p1.Py()-p2.Py(), 0);
-    TVector3 kT((p1.Px()+p2.Px())/2.0, (p1.Py()+p2.Py())/2.0, 0);
-    return qT.Dot(kT.Unit());
+    double qx = p1.Px() - p2.Px(), qy = p1.Py() - p2.Py();
+    double kx = (p1.Px() + p2.Px())/2.0, ky = (p1.Py() + p2.Py())/2.0;
+    double kt = std::hypot(kx, ky);
+    return (kt > 0) ? (qx*kx + qy*ky)/kt : 0.0;
 }
 
 /**
@@ -72,10 +78,10 @@ double CalculateQout(const LorentzVec& p1, const LorentzVec& p2) {
  */
 template<typename LorentzVec>
 double CalculateQside(const LorentzVec& p1, const LorentzVec& p2) {
-    TVector3 qT(p1.Px()-p2.Px(), p1.Py()-p2.Py(), 0);
-    TVector3 kT((p1.Px()+p2.Px())/2.0, (p1.Py()+p2.Py())/2.0, 0);
-    TVector3 qout = qT.Dot(kT.Unit()) * kT.Unit();
-    return (qT - qout).Mag();
+    double qx = p1.Px() - p2.Px(), qy = p1.Py() - p2.Py();
+    double kx = (p1.Px() + p2.Px())/2.0, ky = (p1.Py() + p2.Py())/2.0;
+    double kt = std::hypot(kx, ky);
+    return (kt > 0) ? std::abs(qx*ky - qy*kx)/kt : std::hypot(qx, qy);  // No out axis at kT = 0: all of qT is side
 }
 
 /**
@@ -102,6 +108,112 @@ double CoulombOSWeight(double qinv, int syst = 0) {
     return weight * ((1.0 - std::exp(-x))/x - 1.0) + 1.0;
 }
 
+/**
+ * Maps the analysis systematic to the Gamow variation index
+ * @param systematic 9=coulombp15, 10=coulombm15 (see GetSystematicTag)
+ * @return 0=nominal, 1=+15%, 2=-15%
+ */
+inline int CoulombSystematicIndex(int systematic) {
+    return (systematic == 9) ? 1 : (systematic == 10 ? 2 : 0);
+}
+
+// Tabulated Gamow Factors ===================================================
+
+namespace HBT {
+    namespace Coulomb {
+
+        constexpr double TABLE_QMIN = 0.01;    // GeV/c, analytic below (steep, few pairs)
+        constexpr double TABLE_QMAX = 2.0;     // GeV/c, analytic above
+        constexpr int TABLE_INTERVALS = 20000; // ~0.1 MeV spacing
+        constexpr double TABLE_TOLERANCE = 1e-4;  // Max relative error vs CoulombSS/OSWeight (validate_hbt.C)
+
+        /**
+         * Scale of the Gamow excess (G - 1) for a Coulomb variation
+         * @param syst 0=nominal, 1=+15%, 2=-15% (see CoulombSystematicIndex)
+         */
+        inline double VariationScale(int syst) {
+            return (syst == 1) ? 1.15 : (syst == 2 ? 0.85 : 1.0);
+        }
+
+        /**
+         * Nominal and +/-15% Gamow weights of one pair
+         */
+        struct GamowWeights {
+            double nominal = 1.0;
+            double plus = 1.0;    // +15%
+            double minus = 1.0;   // -15%
+
+            double Get(int syst) const { return (syst == 1) ? plus : (syst == 2 ? minus : nominal); }
+        };
+
+        /**
+         * Gamow excess G - 1 of same- and opposite-sign pion pairs on a uniform
+         * qinv grid with linear interpolation. Every variation is 1 + scale*(G - 1),
+         * so one lookup gives the nominal and both +/-15% weights. Outside
+         * [TABLE_QMIN, TABLE_QMAX) the analytic form is used.
+         */
+        class GamowTable {
+        public:
+            GamowTable(double qlo = TABLE_QMIN, double qhi = TABLE_QMAX, int intervals = TABLE_INTERVALS)
+                : lo_(qlo), hi_(qhi), n_(intervals), invStep_(intervals / (qhi - qlo)),
+                  ss_(intervals + 1), os_(intervals + 1) {
+                for (int i = 0; i <= n_; ++i) {
+                    double q = lo_ + i / invStep_;
+                    ss_[i] = AnalyticExcess(q, true);
+                    os_[i] = AnalyticExcess(q, false);
+                }
+            }
+
+            static double AnalyticExcess(double qinv, bool sameSign) {
+                return (sameSign ? CoulombSSWeight(qinv) : CoulombOSWeight(qinv)) - 1.0;
+            }
+
+            /**
+             * Gamow excess G - 1 at qinv
+             */
+            double Excess(double qinv, bool sameSign) const {
+                if (qinv < lo_ || !(qinv < hi_)) return AnalyticExcess(qinv, sameSign);
+                double pos = (qinv - lo_) * invStep_;
+                int i = std::min(static_cast<int>(pos), n_ - 1);
+                const double* t = sameSign ? ss_.data() : os_.data();
+                return t[i] + (pos - i) * (t[i + 1] - t[i]);
+            }
+
+            /**
+             * Drop-in for CoulombSSWeight/CoulombOSWeight
+             * @param syst 0=nominal, 1=+15%, 2=-15%
+             */
+            double Weight(double qinv, bool sameSign, int syst = 0) const {
+                return 1.0 + VariationScale(syst) * Excess(qinv, sameSign);
+            }
+
+            GamowWeights Weights(double qinv, bool sameSign) const {
+                double d = Excess(qinv, sameSign);
+                GamowWeights w;
+                w.nominal = 1.0 + d;
+                w.plus = 1.0 + VariationScale(1) * d;
+                w.minus = 1.0 + VariationScale(2) * d;
+                return w;
+            }
+
+        private:
+            double lo_, hi_;
+            int n_;
+            double invStep_;
+            std::vector<double> ss_, os_;
+        };
+
+        /**
+         * Shared table used by the pair loops (built on first use)
+         */
+        inline const GamowTable& DefaultGamowTable() {
+            static const GamowTable table;
+            return table;
+        }
+
+    } // namespace Coulomb
+} // namespace HBT
+
 // Track Selection ============================================================
 
 /**
@@ -134,6 +246,19 @@ int CountHBTTracks(const std::vector<LorentzVec>& tracks, const HBTTrackCut& cut
 
 // Correlation Analysis =======================================================
 
+/**
+ * Pair-level constants for the SoA kernel (pair_kernel.h)
+ * @param splitCut Whether split pairs are rejected
+ */
+inline HBT::Kernel::PairCuts HBTPairCuts(bool splitCut = true) {
+    HBT::Kernel::PairCuts cuts;
+    cuts.mass = PI_MASS;
+    cuts.cosCut = COS_CUT;
+    cuts.dptCut = DPT_CUT;
+    cuts.rejectSplit = splitCut;
+    return cuts;
+}
+
 /**
  * Fills HBT correlation histograms for an event
  * @param tracks Track 4-vectors
@@ -144,42 +269,169 @@ int CountHBTTracks(const std::vector<LorentzVec>& tracks, const HBTTrackCut& cut
  * @param cent Centrality bin
  * @param applyCoulomb Whether to apply Gamow correction
  * @param syst Systematic variation
+ * @tparam Histograms Provides FillCorrelation(p1, p2, cent, weight), e.g. HBTHistograms
  */
-template<typename LorentzVec>
+template<typename LorentzVec, typename Histograms>
 void AnalyzeHBTCorrelations(
     const std::vector<LorentzVec>& tracks,
     const std::vector<int>& charges,
     const std::vector<double>& weights,
-    HBTHistograms& hSame,
-    HBTHistograms& hOpp,
+    Histograms& hSame,
+    Histograms& hOpp,
     int cent,
     bool applyCoulomb = true,
     int syst = 0) 
 {
-    const int nTracks = tracks.size();
+    // Convert once, then let the kernel do split rejection and qinv per block
+    HBT::Kernel::TrackSoA soa;
+    soa.Load(tracks, charges, weights);
     
-    for (int i = 0; i < nTracks; ++i) {
-        for (int j = i + 1; j < nTracks; ++j) {
-            // Skip split pairs
-            if (IsSplitPair(tracks[i], tracks[j])) continue;
-            
-            double weight = weights[i] * weights[j];
-            double qinv = CalculateQinv(tracks[i], tracks[j]);
-            bool isSameSign = (charges[i] * charges[j] > 0);
+    HBT::Kernel::ForEachSameEventPair(soa, HBTPairCuts(),
+        [&](int i, int j, const HBT::Kernel::PairBlock& b, int k) {
+            double weight = soa.weight[i] * soa.weight[j];
+            bool isSameSign = (soa.charge[i] * soa.charge[j] > 0);
             
             // Apply Coulomb correction
             if (applyCoulomb) {
-                weight *= isSameSign ? CoulombSSWeight(qinv, syst) 
-                                     : CoulombOSWeight(qinv, syst);
+                weight *= HBT::Coulomb::DefaultGamowTable().Weight(b.qinv[k], isSameSign, syst);
             }
             
             // Fill appropriate histograms
             auto& h = isSameSign ? hSame : hOpp;
             h.FillCorrelation(tracks[i], tracks[j], cent, weight);
-        }
+        });
+}
+
+/**
+ * Analysis-mode switches fixed at compile time for the specialized pair loops
+ * @tparam Do3D Compute and fill q_out, q_side, q_long
+ * @tparam Coulomb Apply the Gamow weight
+ * @tparam SplitCut Compute the split-pair flag and reject split pairs
+ */
+template<bool Do3D, bool Coulomb, bool SplitCut>
+struct HBTPairMode {
+    static constexpr bool do3D = Do3D;
+    static constexpr bool coulomb = Coulomb;
+    static constexpr bool splitCut = SplitCut;
+};
+
+/**
+ * Picks the HBTPairMode instantiation for runtime flags, once per configuration
+ * @param f Called as f(HBTPairMode<...>{})
+ */
+template<typename F>
+void DispatchPairMode(bool do3D, bool coulomb, bool splitCut, F&& f)
+{
+    if (do3D) {
+        if (coulomb) splitCut ? f(HBTPairMode<true, true, true>{}) : f(HBTPairMode<true, true, false>{});
+        else splitCut ? f(HBTPairMode<true, false, true>{}) : f(HBTPairMode<true, false, false>{});
+    } else {
+        if (coulomb) splitCut ? f(HBTPairMode<false, true, true>{}) : f(HBTPairMode<false, true, false>{});
+        else splitCut ? f(HBTPairMode<false, false, true>{}) : f(HBTPairMode<false, false, false>{});
     }
 }
 
+/**
+ * Default pair tap of the specialized loops: does nothing
+ */
+struct NoPairTap {
+    void operator()(const HBT::Kernel::TrackSoA&, int, const HBT::Kernel::TrackSoA&, int,
+                    const HBT::Kernel::PairBlock&, int) const {}
+};
+
+/**
+ * Pair visitor of the SoA loops: track weights, charge product, Gamow weight
+ * @param a, b Track columns the visitor's i and j index into
+ * @param fill Called as fill(isSameSign, qinv, kt, qout, qside, qlong, weight)
+ * @param tap Also called for every filled pair as tap(a, i, b, j, blk, k) (e.g. the pair cache)
+ */
+template<typename Mode, typename PairSink, typename PairTap = NoPairTap>
+auto MakeHBTPairVisitorT(const HBT::Kernel::TrackSoA& a, const HBT::Kernel::TrackSoA& b,
+                         PairSink& fill, int syst, const PairTap& tap = PairTap())
+{
+    return [&a, &b, &fill, syst, &tap](int i, int j, const HBT::Kernel::PairBlock& blk, int k) {
+        double weight = a.weight[i] * b.weight[j];
+        bool isSameSign = (a.charge[i] * b.charge[j] > 0);
+        if constexpr (Mode::coulomb) {
+            weight *= HBT::Coulomb::DefaultGamowTable().Weight(blk.qinv[k], isSameSign, syst);
+        }
+        if constexpr (Mode::do3D) {
+            fill(isSameSign, blk.qinv[k], blk.kt[k], blk.qout[k], blk.qside[k], blk.qlong[k], weight);
+        } else {
+            fill(isSameSign, blk.qinv[k], blk.kt[k], 0.0, 0.0, 0.0, weight);
+        }
+        tap(a, i, b, j, blk, k);
+    };
+}
+
+/**
+ * Specialized same-event loops (plain and cell-pruned)
+ * The pruned loop also visits pairs of its cells above grid.QMax(); those
+ * are dropped, so the filled pairs do not depend on the cell size.
+ * @note The split cut follows Mode::splitCut; cuts.rejectSplit must agree
+ */
+template<typename Mode, typename PairSink, typename PairTap = NoPairTap>
+void AnalyzeHBTCorrelationsT(const HBT::Kernel::TrackSoA& tracks, PairSink&& fill,
+                             const HBT::Kernel::PairCuts& cuts, int syst = 0, const PairTap& tap = PairTap())
+{
+    HBT::Kernel::ForEachSameEventPairT<Mode::do3D, Mode::splitCut>(tracks, cuts,
+        MakeHBTPairVisitorT<Mode>(tracks, tracks, fill, syst, tap));
+}
+
+template<typename Mode, typename PairSink, typename PairTap = NoPairTap>
+void AnalyzeHBTCorrelationsT(const HBT::Kernel::CellSortedTracks& tracks, const HBT::Kernel::CellGrid& grid,
+                             PairSink&& fill, const HBT::Kernel::PairCuts& cuts, int syst = 0,
+                             const PairTap& tap = PairTap())
+{
+    auto visit = MakeHBTPairVisitorT<Mode>(tracks.tracks, tracks.tracks, fill, syst, tap);
+    const double qmax = grid.QMax();
+    HBT::Kernel::ForEachSameEventPairPrunedT<Mode::do3D, Mode::splitCut>(tracks, grid, cuts,
+        [&](int i, int j, const HBT::Kernel::PairBlock& blk, int k) { if (blk.qinv[k] < qmax) visit(i, j, blk, k); });
+}
+
+/**
+ * Specialized mixed-event loops (plain and cell-pruned)
+ */
+template<typename Mode, typename PairSink, typename PairTap = NoPairTap>
+void AnalyzeMixedHBTCorrelationsT(const HBT::Kernel::TrackSoA& tracks, const HBT::Kernel::TrackSoA& partner,
+                                  PairSink&& fill, const HBT::Kernel::PairCuts& cuts, int syst = 0,
+                                  const PairTap& tap = PairTap())
+{
+    HBT::Kernel::ForEachMixedPairT<Mode::do3D, Mode::splitCut>(tracks, partner, cuts,
+        MakeHBTPairVisitorT<Mode>(tracks, partner, fill, syst, tap));
+}
+
+/**
+ * @param tracks, cells Cell-sorted tracks of the current event and their cell
+ *        offsets (CellSortedTracks::tracks and cellBegin)
+ * Pairs at or above grid.QMax() are dropped, as in the same-event loop.
+ */
+template<typename Mode, typename PairSink, typename PairTap = NoPairTap>
+void AnalyzeMixedHBTCorrelationsT(const HBT::Kernel::TrackSoA& tracks, const std::vector<int>& cells,
+                                  const HBT::Kernel::TrackSoA& partner, const std::vector<int>& partnerCells,
+                                  const HBT::Kernel::CellGrid& grid, PairSink&& fill,
+                                  const HBT::Kernel::PairCuts& cuts, int syst = 0, const PairTap& tap = PairTap())
+{
+    auto visit = MakeHBTPairVisitorT<Mode>(tracks, partner, fill, syst, tap);
+    const double qmax = grid.QMax();
+    HBT::Kernel::ForEachMixedPairPrunedT<Mode::do3D, Mode::splitCut>(
+        tracks, cells, partner, partnerCells, grid, cuts,
+        [&](int i, int j, const HBT::Kernel::PairBlock& blk, int k) { if (blk.qinv[k] < qmax) visit(i, j, blk, k); });
+}
+
+/**
+ * Specialized within-event reference loop: pairs (i, j), i < j, with track j
+ * taken from reference (see InvertMomentum, RotateXY); fills like mixed pairs
+ */
+template<typename Mode, typename PairSink, typename PairTap = NoPairTap>
+void AnalyzeReferenceHBTCorrelationsT(const HBT::Kernel::TrackSoA& tracks, const HBT::Kernel::TrackSoA& reference,
+                                      PairSink&& fill, const HBT::Kernel::PairCuts& cuts, int syst = 0,
+                                      const PairTap& tap = PairTap())
+{
+    HBT::Kernel::ForEachReferencePairT<Mode::do3D, Mode::splitCut>(tracks, reference, cuts,
+        MakeHBTPairVisitorT<Mode>(tracks, reference, fill, syst, tap));
+}
+
 // Utility Functions ==========================================================
 
 /**
@@ -206,4 +458,26 @@ LorentzVec RotateXY(const LorentzVec& vec) {
     return rotated;
 }
 
+/**
+ * InvertMomentum for every track of an SoA event
+ * @param out Tracks of in with (px, py, pz) -> (-px, -py, -pz); may be in itself
+ */
+inline void InvertMomentum(const HBT::Kernel::TrackSoA& in, HBT::Kernel::TrackSoA& out) {
+    if (&out != &in) out = in;
+    for (auto* col : {&out.px, &out.py, &out.pz}) {
+        for (double& x : *col) x = -x;
+    }
+}
+
+/**
+ * RotateXY for every track of an SoA event (rotation by pi around the beam axis)
+ * @param out Tracks of in with (px, py) -> (-px, -py); may be in itself
+ */
+inline void RotateXY(const HBT::Kernel::TrackSoA& in, HBT::Kernel::TrackSoA& out) {
+    if (&out != &in) out = in;
+    for (auto* col : {&out.px, &out.py}) {
+        for (double& x : *col) x = -x;
+    }
+}
+
 #endif // FUNCTION_DEFINITIONS_H
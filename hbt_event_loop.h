@@ -0,0 +1,1236 @@
+#ifndef HBT_EVENT_LOOP_H
+#define HBT_EVENT_LOOP_H
+
+#include "call_libraries.h"
+#include "read_tree.h"
+#include "track_corrections.h"
+#include "hbt_accumulators.h"
+#include "mixing_pool.h"
+#include "hbt_skim.h"
+#include "perf_stats.h"
+#include "checkpoint.h"
+#include "event_index.h"
+#include "mc_matching.h"
+#include "pair_cache.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <fstream>
+#include <stdexcept>
+#include <exception>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <functional>
+#include <utility>
+#include <sys/stat.h>
+
+/**
+ * @file hbt_event_loop.h
+ * @brief Multithreaded event loop for correlation_XeXe
+ *
+ * The entry range is cut into chunks of CHUNK_ENTRIES entries. Worker threads
+ * take chunks in increasing order; each worker owns its chains, track buffers
+ * and accumulators. When a chunk is done its partial result is added to the
+ * run total strictly in chunk order, so the output does not depend on the
+ * number of threads. Events are mixed with the streaming pool of
+ * mixing_pool.h, which runs through the chunks in entry order: a worker
+ * first does the same-event pairs of its chunk, then takes the pool left by
+ * the previous chunk, publishes it with this chunk's events added for the
+ * next one, and mixes its events against it. The mixed pairs are therefore
+ * those of one pool over the whole range, for any number of threads. With
+ * a checkpoint path the merged total and the pool are saved periodically
+ * after a chunk, and a rerun continues after the last saved chunk with the
+ * same result.
+ */
+
+namespace HBT {
+    namespace EventLoop {
+
+        // Configuration =======================================================
+        constexpr Long64_t CHUNK_ENTRIES = 2000;   // Entries per work unit
+        constexpr Long64_t QUICK_TEST_ENTRIES = 1000;
+
+        // Run modes
+        constexpr int RUN_FULL = 0;        // Forest -> pairs and mixing
+        constexpr int RUN_WRITE_SKIM = 1;  // Forest -> compact skim file (hbt_skim.h)
+        constexpr int RUN_PAIRS_ONLY = 2;  // Skim file -> pairs and mixing
+
+        // Reference of the mixed-event histograms (mixing_mode of correlation_XeXe)
+        constexpr int MIXING_POOL = 1;      // Earlier events of the (centrality, vz) bucket
+        constexpr int MIXING_INVERTED = 2;  // Same event, partner track with inverted momentum
+        constexpr int MIXING_ROTATED = 3;   // Same event, partner track rotated by pi around the beam
+
+        /**
+         * @brief Analysis options shared (read-only) by all workers
+         */
+        struct RunConfig {
+            TString input_file;
+            bool is_mc = false;
+            bool do_mixing = true;
+            int mixing_mode = MIXING_POOL;  // Reference filled into the mixed histograms when do_mixing
+            bool do_3d = false;
+            bool do_coulomb = false;
+            bool use_cent = true;
+            int systematic = 0;
+            int n_mix_events = 10;
+            int cent_mult_window = 5;
+            float vz_window = 2.0;
+            int n_threads = 1;
+            Long64_t first_entry = 0;
+            Long64_t last_entry = -1;  // exclusive, -1 = all entries
+            std::vector<std::pair<Long64_t, Long64_t>> segments;  // Non-empty: only these [first, last) ranges, chunked separately
+            std::vector<TH2D*> eff_hists;  // eff, fake, secondary, multiple
+            std::shared_ptr<const Corrections::CorrectionTable> corrections;  // Built from eff_hists by RunEventLoop
+            int run_mode = RUN_FULL;
+            std::string skim_path;         // Output (RUN_WRITE_SKIM) or input (RUN_PAIRS_ONLY)
+            const Skim::SkimFile* skim_input = nullptr;  // Set by RunEventLoop
+            double prune_qmax = 0;          // > 0: only enumerate pairs that can have qinv below it
+            bool validate_pruning = false;  // Check the pruned pairs against the brute-force loop
+            std::shared_ptr<const Kernel::CellGrid> pruning;  // Built by RunEventLoop from prune_qmax
+            int pipeline_depth = 0;         // > 0: read on a second thread per worker, this many events in flight
+            std::string checkpoint_path;    // Non-empty: checkpoint the merged state here (not with RUN_WRITE_SKIM)
+            double checkpoint_interval_s = 600;  // Minimum time between checkpoints
+            bool resume = true;             // Continue from checkpoint_path if it exists
+            bool use_index = false;         // Select entries from the event index before reading (event_index.h)
+            std::string index_dir;          // Sidecar directory, empty = next to each input file
+            std::shared_ptr<const Index::EventIndex> event_index;  // Loaded by RunEventLoop when use_index
+            double cache_qmax = 0;          // > 0: also write the filled pairs with qinv below it to cache_path
+            std::string cache_path;         // Pair cache for replay_pair_cache.C (pair_cache.h)
+        };
+
+        /**
+         * @brief Whether the run has a gen-level path (MC read from the forest)
+         */
+        inline bool WithMC(const RunConfig& cfg) {
+            return cfg.is_mc && cfg.run_mode == RUN_FULL;
+        }
+
+        /**
+         * @brief Within-event reference tracks of MIXING_INVERTED or MIXING_ROTATED
+         */
+        inline void BuildReference(int mixing_mode, const Kernel::TrackSoA& tracks, Kernel::TrackSoA& reference) {
+            if (mixing_mode == MIXING_INVERTED) InvertMomentum(tracks, reference);
+            else RotateXY(tracks, reference);
+        }
+
+        /**
+         * @brief Entry range of a work-unit list, from a "#entries <first> <last>" line
+         * Lists written by plan_jobs.py carry one; entries are chain entries of
+         * the list, last exclusive.
+         * @return false if the list has no such line (whole chain)
+         */
+        inline bool ReadEntryRange(const TString& list, Long64_t& first, Long64_t& last) {
+            std::ifstream in(list.Data());
+            std::string line;
+            while (std::getline(in, line)) {
+                long long f = 0, l = 0;
+                if (std::sscanf(line.c_str(), " #entries %lld %lld", &f, &l) == 2) {
+                    first = f;
+                    last = l;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * @brief Paths of a text list (one per line; blank lines and # lines skipped)
+         * @throws std::runtime_error if the list cannot be opened
+         */
+        inline std::vector<std::string> ReadFileList(const TString& list) {
+            std::ifstream in(list.Data());
+            if (!in) throw std::runtime_error(std::string("Could not open input list: ") + list.Data());
+            std::vector<std::string> files;
+            std::string line;
+            while (std::getline(in, line)) {
+                line.erase(0, line.find_first_not_of(" \t"));
+                line.erase(line.find_last_not_of(" \t\r") + 1);
+                if (line.empty() || line[0] == '#') continue;
+                files.push_back(line);
+            }
+            return files;
+        }
+
+        /**
+         * @brief Adds every file of a text list (one path per line) to the chains
+         * @throws std::runtime_error if the list cannot be opened
+         */
+        inline void AddFilesFromList(const TString& list, const std::vector<TChain*>& chains) {
+            for (const std::string& path : ReadFileList(list)) {
+                for (TChain* chain : chains) chain->Add(path.c_str());
+            }
+        }
+
+        // Pipeline ============================================================
+
+        /**
+         * @brief Busy and waiting time of one pipeline stage
+         */
+        struct StageTimes {
+            double busy_s = 0;
+            double wait_s = 0;
+
+            void Add(const StageTimes& other) {
+                busy_s += other.busy_s;
+                wait_s += other.wait_s;
+            }
+
+            /**
+             * @brief Fraction of the stage's wall time spent working
+             */
+            double Occupancy() const { return busy_s + wait_s > 0 ? busy_s / (busy_s + wait_s) : 0; }
+        };
+
+        /**
+         * @brief Selected, corrected tracks of one event, handed from reader to compute
+         */
+        struct EventBuffer {
+            int hiBin = 0;
+            float vz = 0;
+            Kernel::TrackSoA tracks;
+            MC::MCEvent mc;   // MC runs: gen particles and matches
+        };
+
+        /**
+         * @brief Blocking FIFO of buffer pointers; Pop returns false once closed and drained
+         * Capacity is bounded by the number of buffers in circulation.
+         */
+        class BufferQueue {
+        public:
+            void Push(EventBuffer* buf) {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    items_.push_back(buf);
+                }
+                cv_.notify_one();
+            }
+
+            /**
+             * @param waited Incremented by the time spent blocked (s)
+             */
+            bool Pop(EventBuffer*& buf, double& waited) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (items_.empty() && !closed_) {
+                    auto t0 = std::chrono::steady_clock::now();
+                    cv_.wait(lock, [&] { return !items_.empty() || closed_; });
+                    waited += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+                }
+                if (items_.empty()) return false;
+                buf = items_.front();
+                items_.pop_front();
+                return true;
+            }
+
+            void Close() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    closed_ = true;
+                }
+                cv_.notify_all();
+            }
+
+            void Reopen() {
+                std::lock_guard<std::mutex> lock(mutex_);
+                closed_ = false;
+            }
+
+        private:
+            std::mutex mutex_;
+            std::condition_variable cv_;
+            std::deque<EventBuffer*> items_;
+            bool closed_ = false;
+        };
+
+        // Results =============================================================
+
+        /**
+         * @brief Histograms and counters produced by one chunk (or a whole run)
+         */
+        struct LoopOutput {
+            Accum::PairAccumulators same;
+            Accum::PairAccumulators mixed;
+            Skim::SkimBlock skim;   // Only filled in RUN_WRITE_SKIM
+            PairCache::ChunkSpool cache;   // Only filled with cache_qmax > 0
+            std::unique_ptr<TH1D> hCentrality;
+            std::unique_ptr<TH1D> hVz;
+            std::unique_ptr<TH1D> hMultiplicity;
+            Long64_t n_processed = 0;
+            Long64_t n_pruning_missed = 0;   // validate_pruning: window pairs the pruned loop lost
+            StageTimes read_stage;           // pipeline_depth > 0: reader thread
+            StageTimes compute_stage;        // pipeline_depth > 0: pair/mixing thread
+            Perf::PerfStats perf;
+            std::unique_ptr<MC::MCOutput> mc;   // Gen level and q resolution, MC runs from the forest only
+
+            explicit LoopOutput(bool do3D, bool withMC = false)
+                : same(do3D), mixed(do3D),
+                  hCentrality(new TH1D("loop_centrality", "centrality", 150, 0.0, 300.0)),
+                  hVz(new TH1D("loop_vzhist", "vzhist", 80, -20., 20.)),
+                  hMultiplicity(new TH1D("loop_multiplicity", "multiplicity", 400, 0.0, 4000.0)),
+                  mc(withMC ? new MC::MCOutput(do3D) : nullptr) {
+                for (TH1D* h : {hCentrality.get(), hVz.get(), hMultiplicity.get()}) h->SetDirectory(nullptr);
+            }
+
+            void Add(const LoopOutput& other) {
+                same.Add(other.same);
+                mixed.Add(other.mixed);
+                hCentrality->Add(other.hCentrality.get());
+                hVz->Add(other.hVz.get());
+                hMultiplicity->Add(other.hMultiplicity.get());
+                n_processed += other.n_processed;
+                n_pruning_missed += other.n_pruning_missed;
+                read_stage.Add(other.read_stage);
+                compute_stage.Add(other.compute_stage);
+                perf.Add(other.perf);
+                if (mc && other.mc) mc->Add(*other.mc);
+            }
+
+            void Reset() {
+                same.Reset();
+                mixed.Reset();
+                skim.Clear();
+                cache.Clear();
+                hCentrality->Reset();
+                hVz->Reset();
+                hMultiplicity->Reset();
+                n_processed = 0;
+                n_pruning_missed = 0;
+                read_stage = StageTimes();
+                compute_stage = StageTimes();
+                perf.Reset();
+                if (mc) mc->Reset();
+            }
+
+            std::size_t MemoryBytes() const {
+                return same.MemoryBytes() + mixed.MemoryBytes() + (mc ? mc->MemoryBytes() : 0);
+            }
+
+            /**
+             * @brief Everything but the skim block and pair cache, for a checkpoint (checkpoint.h)
+             */
+            template<typename Out>
+            void Save(Out& out) const {
+                same.Save(out);
+                mixed.Save(out);
+                Checkpoint::SaveTH1(out, *hCentrality);
+                Checkpoint::SaveTH1(out, *hVz);
+                Checkpoint::SaveTH1(out, *hMultiplicity);
+                out.Write(n_processed);
+                out.Write(n_pruning_missed);
+                out.Write(read_stage);
+                out.Write(compute_stage);
+                out.Write(perf);
+                if (mc) mc->Save(out);
+            }
+
+            template<typename In>
+            void Load(In& in) {
+                same.Load(in);
+                mixed.Load(in);
+                Checkpoint::LoadTH1(in, *hCentrality);
+                Checkpoint::LoadTH1(in, *hVz);
+                Checkpoint::LoadTH1(in, *hMultiplicity);
+                in.Read(n_processed);
+                in.Read(n_pruning_missed);
+                in.Read(read_stage);
+                in.Read(compute_stage);
+                in.Read(perf);
+                if (mc) mc->Load(in);
+            }
+        };
+
+        /**
+         * @brief Peak resident memory of the process (VmHWM) in MB, -1 if unknown
+         */
+        inline double PeakResidentMB() {
+            std::ifstream status("/proc/self/status");
+            std::string line;
+            while (std::getline(status, line)) {
+                if (line.compare(0, 6, "VmHWM:") == 0) return std::strtod(line.c_str() + 6, nullptr) / 1024.0;
+            }
+            return -1;
+        }
+
+        /**
+         * @brief Prints the job's peak memory and the size of the merged pair histograms
+         */
+        inline void PrintMemoryReport(std::size_t histogram_bytes) {
+            std::cout << "Peak memory (VmHWM): " << PeakResidentMB() << " MB, merged pair histograms: "
+                      << histogram_bytes / (1024.0 * 1024.0) << " MB" << std::endl;
+        }
+
+        /**
+         * @brief Whether events are mixed with earlier events (pool carried across chunks)
+         */
+        inline bool PoolMixing(const RunConfig& cfg) {
+            return cfg.do_mixing && cfg.mixing_mode == MIXING_POOL && cfg.run_mode != RUN_WRITE_SKIM;
+        }
+
+        /**
+         * @brief Mixing pools carried from chunk to chunk: reco, and gen level in MC runs
+         */
+        struct CarriedPools {
+            Mixing::MixingPool reco;
+            Mixing::MixingPool gen;   // Same buckets as reco
+
+            explicit CarriedPools(const RunConfig& cfg)
+                : reco(cfg.n_mix_events, cfg.cent_mult_window, cfg.vz_window),
+                  gen(cfg.n_mix_events, cfg.cent_mult_window, cfg.vz_window) {}
+
+            template<typename Out>
+            void Save(Out& out) const {
+                reco.Save(out, Mixing::SavePooledEvent<Out>);
+                gen.Save(out, Mixing::SavePooledEvent<Out>);
+            }
+
+            template<typename In>
+            void Load(In& in) {
+                reco.Load(in, Mixing::LoadPooledEvent<In>);
+                gen.Load(in, Mixing::LoadPooledEvent<In>);
+            }
+        };
+
+        using PoolCarry = Mixing::PoolHandoff<CarriedPools>;
+
+        /**
+         * @brief Flat correction table from eff, fake, secondary, multiple maps (missing = none)
+         */
+        inline std::shared_ptr<const Corrections::CorrectionTable> MakeCorrectionTable(
+            const std::vector<TH2D*>& eff_hists) {
+            auto hist = [&](std::size_t k) -> const TH2* { return k < eff_hists.size() ? eff_hists[k] : nullptr; };
+            return std::make_shared<const Corrections::CorrectionTable>(hist(0), hist(1), hist(2), hist(3));
+        }
+
+        /**
+         * @brief Corrected tracks of an event in SoA form; tracks the table flags out of range are dropped
+         * @param weights Scratch, resized to at least event.nTracks
+         * @param flags Output, range flags of all event.nTracks tracks
+         */
+        inline void CorrectTracks(const Corrections::CorrectionTable& table, const HBTEvent& event,
+                                  std::vector<double>& weights, std::vector<std::uint8_t>& flags,
+                                  Kernel::TrackSoA& tracks) {
+            const int n = event.nTracks;
+            if (static_cast<int>(weights.size()) < n) {
+                weights.resize(n);
+                flags.resize(n);
+            }
+            table.CorrectEvent(n, event.pt, event.eta, weights.data(), flags.data());
+            tracks.clear();
+            tracks.reserve(n);
+            for (int t = 0; t < n; ++t) {
+                if (flags[t]) continue;
+                tracks.push_back_ptetaphi(event.pt[t], event.eta[t], event.phi[t],
+                                          PI_MASS, event.charge[t], weights[t]);
+            }
+        }
+
+        // Worker ==============================================================
+
+        /**
+         * @brief Per-thread state: chains, event buffer, tracks and partial output
+         */
+        class Worker {
+        public:
+            Worker(const RunConfig& cfg)
+                : cfg_(cfg),
+                  qualityCuts_(QualityCutsForSystematic(cfg.systematic)),
+                  eventCuts_(EventCutsForSystematic(cfg.systematic)),
+                  pairCuts_(HBTPairCuts()),
+                  event_(new HBTEvent()),
+                  pools_(cfg),
+                  out_(cfg.do_3d, WithMC(cfg)) {
+                DispatchPairMode(cfg.do_3d, cfg.do_coulomb, pairCuts_.rejectSplit, [this](auto mode) {
+                    analyzePairs_ = &Worker::AnalyzePairs<decltype(mode)>;
+                    analyzeGen_ = &Worker::AnalyzeGen<decltype(mode)>;
+                    mixChunk_ = &Worker::MixChunkEvents<decltype(mode)>;
+                });
+                genCuts_ = pairCuts_;
+                genCuts_.rejectSplit = false;
+                out_.cache.SetThreshold(cfg.cache_qmax);
+                if (cfg.run_mode == RUN_PAIRS_ONLY) return;
+                event_chain_.reset(new TChain("hiEvtAnalyzer/HiTree"));
+                track_chain_.reset(new TChain("ppTrack/trackTree"));
+                skim_chain_.reset(new TChain("skimanalysis/HltTree"));
+                AddFilesFromList(cfg.input_file, {event_chain_.get(), track_chain_.get(), skim_chain_.get()});
+                // The filter branches are required only when the event cuts use them
+                reader_.reset(new HBTTreeReader(event_chain_.get(), track_chain_.get(),
+                                                 eventCuts_.requireFilters ? skim_chain_.get() : nullptr,
+                                                 qualityCuts_, cfg.is_mc));
+            }
+
+            /**
+             * @brief Processes chunk c, entries [first, last), into the partial output
+             * In RUN_PAIRS_ONLY the chunk is block c of the skim file instead.
+             * @param carry Pool handoff between chunks (PoolMixing runs, else nullptr)
+             */
+            void ProcessChunk(Long64_t c, Long64_t first, Long64_t last, PoolCarry* carry = nullptr) {
+                out_.Reset();
+                chunkEvents_.clear();
+                chunkGen_.clear();
+                if (cfg_.run_mode == RUN_PAIRS_ONLY) {
+                    ProcessSkimBlock(cfg_.skim_input->Block(c));
+                } else {
+                    SelectChunkEntries(first, last);
+                    if (cfg_.pipeline_depth > 0 && cfg_.run_mode == RUN_FULL) ProcessChunkPipelined(first, last);
+                    else for (Long64_t i : entries_) ProcessEntry(i);
+                }
+                if (carry) MixChunk(c, *carry);
+            }
+
+            LoopOutput& Output() { return out_; }
+
+        private:
+            /**
+             * @brief Fills entries_ with the entries of [first, last) to read
+             * With the event index, entries failing the event cuts are dropped
+             * before any branch is read; they still count as read. The rest
+             * stay in entry order, so mixing and output are unchanged.
+             */
+            void SelectChunkEntries(Long64_t first, Long64_t last) {
+                entries_.clear();
+                if (!cfg_.event_index) {
+                    for (Long64_t i = first; i < last; ++i) entries_.push_back(i);
+                    return;
+                }
+                Index::SelectEntries(*cfg_.event_index, first, last, {eventCuts_}, entries_);
+                out_.perf.Count(Perf::ENTRIES_READ, (last - first) - static_cast<Long64_t>(entries_.size()));
+            }
+
+            /**
+             * @brief Reader stage: event cuts, track selection and corrections
+             * @param tracks Filled with the corrected tracks as SoA
+             * @param mc MC runs: filled with the gen particles and the reco-gen matches
+             * @param perf Receives the I/O and correction counters and timers
+             * @return false if the entry is missing or the event is rejected
+             */
+            bool LoadEvent(Long64_t entry, Kernel::TrackSoA& tracks, MC::MCEvent& mc, Perf::PerfStats& perf) {
+                // Event-level branches first; tracks only for accepted events
+                auto t0 = Perf::Clock::now();
+                if (!reader_->ReadEvent(entry, *event_)) return false;
+                perf.Count(Perf::ENTRIES_READ);
+                if (!PassEventCuts(*event_, eventCuts_)) {
+                    perf.AddTime(Perf::TIME_IO, Perf::SecondsSince(t0));
+                    return false;
+                }
+                reader_->ReadTracks(*event_);
+                perf.Count(Perf::EVENTS_PASSED);
+                perf.Count(Perf::TRACKS_READ, reader_->RawTrackCount());
+                auto t1 = Perf::Clock::now();
+                perf.AddTime(Perf::TIME_IO, std::chrono::duration<double>(t1 - t0).count());
+
+                // Corrected tracks, converted once to SoA; out-of-range tracks are dropped
+                CorrectTracks(*cfg_.corrections, *event_, weights_, flags_, tracks);
+                perf.Count(Perf::TRACKS_ACCEPTED, tracks.size());
+                if (WithMC(cfg_)) MC::FillMCEvent(*event_, flags_.data(), PI_MASS, matcher_, mc);
+                perf.AddTime(Perf::TIME_CORRECTION, Perf::SecondsSince(t1));
+                return true;
+            }
+
+            void ProcessEntry(Long64_t entry) {
+                if (!LoadEvent(entry, tracks_, mc_, out_.perf)) return;
+
+                if (cfg_.run_mode == RUN_WRITE_SKIM) {
+                    out_.skim.AddEvent(event_->vz, event_->hiBin, tracks_);
+                    ++out_.n_processed;
+                    return;
+                }
+                AnalyzeEvent(event_->hiBin, event_->vz);
+            }
+
+            /**
+             * @brief Entries entries_ of [first, last) with reading on a second thread
+             * The reader fills recycled EventBuffers and queues them; this thread
+             * swaps each into tracks_ and runs the pair stage. At most
+             * pipeline_depth events are in flight.
+             * @throws The first exception of either stage, after the reader is joined
+             *         and both queues are closed and emptied
+             */
+            void ProcessChunkPipelined(Long64_t first, Long64_t last) {
+                using Clock = std::chrono::steady_clock;
+                auto seconds = [](Clock::time_point a, Clock::time_point b) {
+                    return std::chrono::duration<double>(b - a).count();
+                };
+                while (static_cast<int>(buffers_.size()) < cfg_.pipeline_depth) {
+                    buffers_.emplace_back(new EventBuffer());
+                }
+                free_.Reopen();
+                full_.Reopen();
+                for (auto& buf : buffers_) free_.Push(buf.get());
+                reader_->EnableCache(first, last);
+
+                StageTimes read_times;
+                Perf::PerfStats read_perf;   // Reader-thread counters, merged after the join
+                std::exception_ptr read_error, compute_error;
+                std::atomic<bool> stop{false};
+                std::thread reader([&] {
+                    try {
+                        EventBuffer* buf = nullptr;
+                        for (Long64_t i : entries_) {
+                            if (stop) break;
+                            if (!buf && !free_.Pop(buf, read_times.wait_s)) break;
+                            auto t0 = Clock::now();
+                            bool accepted = LoadEvent(i, buf->tracks, buf->mc, read_perf);
+                            if (accepted) {
+                                buf->hiBin = event_->hiBin;
+                                buf->vz = event_->vz;
+                            }
+                            read_times.busy_s += seconds(t0, Clock::now());
+                            if (!accepted) continue;
+                            full_.Push(buf);
+                            buf = nullptr;
+                        }
+                    } catch (...) {
+                        read_error = std::current_exception();
+                    }
+                    full_.Close();   // Also after a failure, so the pair stage drains and stops
+                });
+
+                EventBuffer* buf = nullptr;
+                try {
+                    while (full_.Pop(buf, out_.compute_stage.wait_s)) {
+                        auto t0 = Clock::now();
+                        tracks_.swap(buf->tracks);
+                        mc_.swap(buf->mc);
+                        AnalyzeEvent(buf->hiBin, buf->vz);
+                        tracks_.swap(buf->tracks);
+                        mc_.swap(buf->mc);
+                        out_.compute_stage.busy_s += seconds(t0, Clock::now());
+                        free_.Push(buf);
+                    }
+                } catch (...) {
+                    compute_error = std::current_exception();
+                    stop = true;
+                    free_.Close();   // A reader blocked on a free buffer gives up
+                    full_.Close();
+                }
+                reader.join();
+                free_.Close();
+                double drained = 0;
+                while (free_.Pop(buf, drained)) {}   // Empty both queues for the next chunk
+                while (full_.Pop(buf, drained)) {}   // (events read ahead of a failure)
+                if (compute_error) std::rethrow_exception(compute_error);
+                if (read_error) std::rethrow_exception(read_error);
+                out_.read_stage.Add(read_times);
+                out_.perf.Add(read_perf);
+            }
+
+            void ProcessSkimBlock(const Skim::BlockView& block) {
+                for (std::uint32_t e = 0; e < block.n_events; ++e) {
+                    block.LoadTracks(e, PI_MASS, tracks_);
+                    out_.perf.Count(Perf::ENTRIES_READ);
+                    out_.perf.Count(Perf::EVENTS_PASSED);
+                    out_.perf.Count(Perf::TRACKS_ACCEPTED, tracks_.size());
+                    AnalyzeEvent(block.hiBin[e], block.vz[e]);
+                }
+            }
+
+            /**
+             * @brief Same-event pairs and mixing for the tracks in tracks_ (and the gen particles in mc_)
+             */
+            void AnalyzeEvent(int hiBin, float vz) {
+                const int mult = tracks_.size();
+                double cent = cfg_.use_cent ? hiBin : mult;
+                out_.hCentrality->Fill(hiBin);
+                out_.hVz->Fill(vz);
+                out_.hMultiplicity->Fill(mult);
+
+                auto t0 = Perf::Clock::now();
+                (this->*analyzePairs_)(cent, vz);
+                out_.cache.CountEvent();
+                out_.perf.AddPairTime(mult, Perf::SecondsSince(t0));
+                if (out_.mc) (this->*analyzeGen_)(cent, vz);
+                ++out_.n_processed;
+            }
+
+            /**
+             * @brief Mixes the chunk's events, in entry order, with the pool left by the chunks before
+             * The pool for the next chunk (this one's events added) is published
+             * before the pair loops run, so the next chunk's worker waits only
+             * for the copy, not for the mixing.
+             */
+            void MixChunk(Long64_t c, PoolCarry& carry) {
+                if (!carry.Take(c, pools_)) return;   // Another chunk failed; this output is never merged
+                CarriedPools next = pools_;
+                for (const auto& ev : chunkEvents_) next.reco.Push(ev->cent, ev->vz, ev);
+                for (const auto& ev : chunkGen_) next.gen.Push(ev->cent, ev->vz, ev);
+                carry.Publish(c + 1, std::move(next));
+                (this->*mixChunk_)();
+                chunkEvents_.clear();
+                chunkGen_.clear();
+            }
+
+            /**
+             * @brief Same-event pairs and within-event reference, specialized for the analysis mode
+             * With pool mixing the event is kept in chunkEvents_ for MixChunk.
+             */
+            template<typename Mode>
+            void AnalyzePairs(double cent, float vz) {
+                const int coulombSyst = CoulombSystematicIndex(cfg_.systematic);
+                const Kernel::CellGrid* grid = cfg_.pruning.get();
+
+                // Pairs below cache_qmax also go to the pair cache (never with cache_qmax = 0)
+                const double cacheQ = cfg_.cache_qmax;
+                auto cacheSame = [&](const Kernel::TrackSoA& a, int i, const Kernel::TrackSoA& b, int j,
+                                     const Kernel::PairBlock& blk, int k) {
+                    if (blk.qinv[k] < cacheQ) out_.cache.Add<Mode::do3D>(a, i, b, j, blk, k, cent, false);
+                };
+                auto cacheMixed = [&](const Kernel::TrackSoA& a, int i, const Kernel::TrackSoA& b, int j,
+                                      const Kernel::PairBlock& blk, int k) {
+                    if (blk.qinv[k] < cacheQ) out_.cache.Add<Mode::do3D>(a, i, b, j, blk, k, cent, true);
+                };
+
+                // Same-event pairs, optionally only the cell pairs inside the q window
+                auto t0 = Perf::Clock::now();
+                Kernel::PairLoopCounters before = Kernel::ThreadPairCounters();
+                if (grid) {
+                    sorted_.Build(tracks_, *grid);
+                    AnalyzeHBTCorrelationsT<Mode>(sorted_, *grid, out_.same.SinkT<Mode::do3D>(cent),
+                                                  pairCuts_, coulombSyst, cacheSame);
+                    if (cfg_.validate_pruning) {
+                        Kernel::PairLoopCounters saved = Kernel::ThreadPairCounters();   // Not counted
+                        out_.n_pruning_missed += Kernel::PruningMisses(tracks_, sorted_, *grid, pairCuts_);
+                        Kernel::ThreadPairCounters() = saved;
+                    }
+                } else {
+                    AnalyzeHBTCorrelationsT<Mode>(tracks_, out_.same.SinkT<Mode::do3D>(cent),
+                                                  pairCuts_, coulombSyst, cacheSame);
+                }
+                RecordPairs(before, Perf::PAIRS_VISITED);
+                out_.perf.AddTime(Perf::TIME_SAME_PAIRS, Perf::SecondsSince(t0));
+
+                // Within-event reference: no pool, the partner track is inverted or rotated
+                if (cfg_.do_mixing && cfg_.mixing_mode != MIXING_POOL) {
+                    t0 = Perf::Clock::now();
+                    before = Kernel::ThreadPairCounters();
+                    BuildReference(cfg_.mixing_mode, tracks_, reference_);
+                    auto fill = out_.mixed.SinkT<Mode::do3D>(cent);
+                    const double window = grid ? grid->QMax() : HUGE_VAL;   // Same q window as the pruned pairs
+                    AnalyzeReferenceHBTCorrelationsT<Mode>(tracks_, reference_,
+                        [&](bool ss, double qinv, double kt, double qout, double qside, double qlong, double w) {
+                            if (qinv < window) fill(ss, qinv, kt, qout, qside, qlong, w);
+                        }, pairCuts_, coulombSyst, cacheMixed);
+                    RecordPairs(before, Perf::MIX_PAIRS_VISITED);
+                    out_.perf.AddTime(Perf::TIME_MIXING, Perf::SecondsSince(t0));
+                }
+
+                // Kept for mixing once the pool left by the previous chunks is known
+                if (PoolMixing(cfg_)) {
+                    std::shared_ptr<Mixing::PooledEvent> ev = std::make_shared<Mixing::PooledEvent>();
+                    ev->cent = cent;
+                    ev->vz = vz;
+                    ev->tracks = grid ? sorted_.tracks : tracks_;
+                    if (grid) ev->cells = sorted_.cellBegin;
+                    chunkEvents_.push_back(std::move(ev));
+                }
+            }
+
+            /**
+             * @brief Pool mixing of the events in chunkEvents_ (and chunkGen_) against pools_
+             * Every event is mixed with its bucket, newest first, and then
+             * stored, as if the whole range were streamed through one pool.
+             */
+            template<typename Mode>
+            void MixChunkEvents() {
+                using GenMode = HBTPairMode<Mode::do3D, Mode::coulomb, false>;
+                const int coulombSyst = CoulombSystematicIndex(cfg_.systematic);
+                const Kernel::CellGrid* grid = cfg_.pruning.get();
+                const double cacheQ = cfg_.cache_qmax;
+
+                for (const auto& ev : chunkEvents_) {
+                    const double cent = ev->cent;
+                    auto cacheMixed = [&](const Kernel::TrackSoA& a, int i, const Kernel::TrackSoA& b, int j,
+                                          const Kernel::PairBlock& blk, int k) {
+                        if (blk.qinv[k] < cacheQ) out_.cache.Add<Mode::do3D>(a, i, b, j, blk, k, cent, true);
+                    };
+                    auto t0 = Perf::Clock::now();
+                    Kernel::PairLoopCounters before = Kernel::ThreadPairCounters();
+                    pools_.reco.MixAndPush(cent, ev->vz, ev, [&](const Mixing::PooledEvent& partner) {
+                        if (!grid) {
+                            AnalyzeMixedHBTCorrelationsT<Mode>(ev->tracks, partner.tracks,
+                                                               out_.mixed.SinkT<Mode::do3D>(cent),
+                                                               pairCuts_, coulombSyst, cacheMixed);
+                            return;
+                        }
+                        AnalyzeMixedHBTCorrelationsT<Mode>(ev->tracks, ev->cells, partner.tracks, partner.cells,
+                                                           *grid, out_.mixed.SinkT<Mode::do3D>(cent),
+                                                           pairCuts_, coulombSyst, cacheMixed);
+                        if (cfg_.validate_pruning) {
+                            Kernel::PairLoopCounters saved = Kernel::ThreadPairCounters();
+                            out_.n_pruning_missed += Kernel::PruningMisses(
+                                ev->tracks, ev->cells, partner.tracks, partner.cells, *grid, pairCuts_);
+                            Kernel::ThreadPairCounters() = saved;
+                        }
+                    });
+                    RecordPairs(before, Perf::MIX_PAIRS_VISITED);
+                    const double dt = Perf::SecondsSince(t0);
+                    out_.perf.AddTime(Perf::TIME_MIXING, dt);
+                    out_.perf.AddPairTime(ev->tracks.size(), dt, false);
+                }
+
+                if (chunkGen_.empty()) return;
+                Kernel::PairLoopCounters saved = Kernel::ThreadPairCounters();   // Gen level is not counted
+                MC::MCOutput& mc = *out_.mc;
+                for (const auto& ev : chunkGen_) {
+                    pools_.gen.MixAndPush(ev->cent, ev->vz, ev, [&](const Mixing::PooledEvent& partner) {
+                        AnalyzeMixedHBTCorrelationsT<GenMode>(ev->tracks, partner.tracks,
+                                                              mc.mixed.SinkT<Mode::do3D>(ev->cent),
+                                                              genCuts_, coulombSyst);
+                    });
+                }
+                Kernel::ThreadPairCounters() = saved;
+            }
+
+            /**
+             * @brief Gen-level pairs, reference and q resolution of an MC event
+             * Same binning, Coulomb weight and mixing as reco, without the
+             * split cut (no merging at gen level) and not in the perf counters.
+             */
+            template<typename Mode>
+            void AnalyzeGen(double cent, float vz) {
+                using GenMode = HBTPairMode<Mode::do3D, Mode::coulomb, false>;
+                const int coulombSyst = CoulombSystematicIndex(cfg_.systematic);
+                Kernel::PairLoopCounters saved = Kernel::ThreadPairCounters();
+                MC::MCOutput& mc = *out_.mc;
+                AnalyzeHBTCorrelationsT<GenMode>(mc_.gen, mc.same.SinkT<Mode::do3D>(cent), genCuts_, coulombSyst);
+                if (cfg_.do_mixing && cfg_.mixing_mode != MIXING_POOL) {
+                    BuildReference(cfg_.mixing_mode, mc_.gen, reference_);
+                    AnalyzeReferenceHBTCorrelationsT<GenMode>(mc_.gen, reference_, mc.mixed.SinkT<Mode::do3D>(cent),
+                                                              genCuts_, coulombSyst);
+                } else if (PoolMixing(cfg_)) {
+                    std::shared_ptr<Mixing::PooledEvent> ev = std::make_shared<Mixing::PooledEvent>();
+                    ev->cent = cent;
+                    ev->vz = vz;
+                    ev->tracks = mc_.gen;
+                    chunkGen_.push_back(std::move(ev));   // Mixed in MixChunk, like reco
+                }
+                MC::FillResolution<Mode::do3D>(mc_, pairCuts_, mc);
+                mc.CountEvent(mc_);
+                Kernel::ThreadPairCounters() = saved;
+            }
+
+            /**
+             * @brief Adds the kernel pair counts since before to the perf counters
+             * @param visited PAIRS_VISITED or MIX_PAIRS_VISITED; the split and
+             *        filled counters follow it (every non-split pair is filled)
+             */
+            void RecordPairs(const Kernel::PairLoopCounters& before, Perf::Counter visited) {
+                const Kernel::PairLoopCounters& now = Kernel::ThreadPairCounters();
+                const std::int64_t n_visited = now.visited - before.visited;
+                const std::int64_t n_split = now.split - before.split;
+                out_.perf.Count(visited, n_visited);
+                out_.perf.Count(Perf::Counter(visited + 1), n_split);
+                out_.perf.Count(Perf::Counter(visited + 2), n_visited - n_split);
+            }
+
+            const RunConfig& cfg_;
+            HBTQualityCuts qualityCuts_;
+            HBTEventCuts eventCuts_;
+            Kernel::PairCuts pairCuts_;
+            Kernel::PairCuts genCuts_;          // pairCuts_ without the split cut
+            std::unique_ptr<TChain> event_chain_, track_chain_, skim_chain_;
+            std::unique_ptr<HBTTreeReader> reader_;
+            std::unique_ptr<HBTEvent> event_;   // ~1 MB of track arrays, keep off the stack
+            Kernel::TrackSoA tracks_;
+            MC::MCEvent mc_;                    // Gen particles of the current event (MC runs)
+            MC::GenMatcher matcher_;
+            Kernel::CellSortedTracks sorted_;   // tracks_ sorted by momentum cell (pruning)
+            Kernel::TrackSoA reference_;        // tracks_ inverted or rotated (within-event reference)
+            std::vector<double> weights_;       // Per-track correction of the current event
+            std::vector<std::uint8_t> flags_;   // Per-track range flags
+            std::vector<Long64_t> entries_;     // Entries of the current chunk to read
+            std::vector<std::unique_ptr<EventBuffer>> buffers_;   // pipeline_depth recycled buffers
+            BufferQueue free_, full_;           // Pipeline: empty buffers -> reader -> full buffers -> compute
+            std::vector<std::shared_ptr<const Mixing::PooledEvent>> chunkEvents_;  // Pool mixing: the chunk's events
+            std::vector<std::shared_ptr<const Mixing::PooledEvent>> chunkGen_;     // and their gen particles (MC)
+            CarriedPools pools_;                // Pool of the chunk being mixed
+            LoopOutput out_;
+            void (Worker::*analyzePairs_)(double, float) = nullptr;  // Chosen once from cfg_
+            void (Worker::*analyzeGen_)(double, float) = nullptr;
+            void (Worker::*mixChunk_)() = nullptr;
+        };
+
+        // Driver ==============================================================
+
+        /**
+         * @brief Runs chunks [0, n_chunks) on one thread per worker
+         * Chunks are handed out in increasing order; results are merged
+         * strictly in chunk order, independent of the number of workers.
+         * If process or merge throws on any thread, no further chunk is
+         * started, every thread is joined and the first exception is rethrown.
+         * @param process Called as process(worker, chunk) on the worker's thread
+         * @param merge Called as merge(worker, chunk) under the merge lock
+         * @param first_chunk Chunks before it are already merged (resumed run)
+         */
+        template<typename WorkerT, typename ProcessFn, typename MergeFn>
+        inline void RunChunks(std::vector<std::unique_ptr<WorkerT>>& workers, Long64_t n_chunks,
+                              ProcessFn&& process, MergeFn&& merge, Long64_t first_chunk = 0) {
+            std::atomic<Long64_t> next_chunk(first_chunk);
+            Long64_t next_merge = first_chunk;
+            std::mutex merge_mutex;
+            std::condition_variable merge_cv;
+            std::atomic<bool> failed(false);
+            std::exception_ptr error;           // First failure, under merge_mutex
+
+            auto fail = [&](std::exception_ptr e) {
+                std::lock_guard<std::mutex> lock(merge_mutex);
+                if (!error) error = e;
+                failed = true;
+                next_chunk = n_chunks;
+                merge_cv.notify_all();
+            };
+            auto work = [&](WorkerT& worker) {
+                try {
+                    for (Long64_t c = next_chunk++; c < n_chunks && !failed; c = next_chunk++) {
+                        process(worker, c);
+                        std::unique_lock<std::mutex> lock(merge_mutex);
+                        merge_cv.wait(lock, [&] { return next_merge == c || failed; });
+                        if (failed) return;
+                        merge(worker, c);
+                        ++next_merge;
+                        merge_cv.notify_all();
+                    }
+                } catch (...) {
+                    fail(std::current_exception());
+                }
+            };
+
+            std::vector<std::thread> threads;
+            try {
+                for (std::size_t t = 1; t < workers.size(); ++t) threads.emplace_back(work, std::ref(*workers[t]));
+            } catch (...) {
+                fail(std::current_exception());   // Thread creation failed: stop the ones already running
+            }
+            if (!failed) work(*workers[0]);
+            for (auto& th : threads) th.join();
+            if (error) std::rethrow_exception(error);
+        }
+
+        /**
+         * @brief Adds the content of a correction table: eta/pt edges and the tabulated floats
+         */
+        inline void AddCorrections(Checkpoint::Fingerprint& fp, const Corrections::CorrectionTable& table) {
+            for (const Corrections::TableAxis* axis : {&table.EtaAxis(), &table.PtAxis()}) {
+                for (int i = 0; i <= axis->NBins(); ++i) fp.Add(axis->Edge(i));
+            }
+            fp.AddBytes(table.Values().data(), table.Values().size() * sizeof(float));
+        }
+
+        /**
+         * @brief Adds the histogram binning of define_histograms.h
+         */
+        inline void AddBinning(Checkpoint::Fingerprint& fp) {
+            for (int n : {nQBins, nQBins3D, nKtBins, nCentBins}) fp.Add(n);
+            for (double q : {minQ, maxQ, minQ3D, maxQ3D}) fp.Add(q);
+            for (double kt : KtBins) fp.Add(kt);
+            for (double cent : CentBins) fp.Add(cent);
+        }
+
+        /**
+         * @brief Adds the track, event and pair cuts of a systematic and the track acceptance
+         */
+        inline void AddCuts(Checkpoint::Fingerprint& fp, int systematic) {
+            const HBTQualityCuts q = QualityCutsForSystematic(systematic);
+            const HBTEventCuts e = EventCutsForSystematic(systematic);
+            const Kernel::PairCuts p = HBTPairCuts();
+            for (int v : {int(q.requireHighPurity), q.minPixelHits, q.minTotalHits,
+                          e.minHiBin, e.maxHiBin, e.hiBinShift, int(e.requireFilters), int(p.rejectSplit)}) {
+                fp.Add(v);
+            }
+            for (float v : {q.maxDcaXY, q.maxDcaZ, q.maxChi2, e.maxAbsVz, MIN_HBT_PT, MAX_HBT_ETA}) fp.Add(v);
+            for (double v : {p.mass, p.cosCut, p.dptCut}) fp.Add(v);
+        }
+
+        /**
+         * @brief Adds path, size and modification time of a file without reading it
+         * A file that cannot be stat'ed adds size and time -1.
+         */
+        inline void AddFileStamp(Checkpoint::Fingerprint& fp, const std::string& path) {
+            struct stat st;
+            const bool found = ::stat(path.c_str(), &st) == 0;
+            fp.AddString(path);
+            fp.Add(std::int64_t(found ? st.st_size : -1));
+            fp.Add(std::int64_t(found ? st.st_mtime : -1));
+        }
+
+        /**
+         * @brief Fingerprint of everything that shapes the merged output
+         * The thread count and pipeline depth are left out: they do not change
+         * the result, so a resumed job may use different ones. The input (skim
+         * or file list) is stamped by size and modification time, not read.
+         * @param cfg Needs cfg.corrections
+         */
+        inline std::uint64_t RunFingerprint(const RunConfig& cfg, Long64_t first, Long64_t last,
+                                            Long64_t n_chunks) {
+            Checkpoint::Fingerprint fp;
+            AddFileStamp(fp, cfg.run_mode == RUN_PAIRS_ONLY ? cfg.skim_path : std::string(cfg.input_file.Data()));
+            for (Long64_t v : {first, last, n_chunks, CHUNK_ENTRIES}) fp.Add(v);
+            for (int v : {cfg.run_mode, cfg.systematic, cfg.n_mix_events, cfg.cent_mult_window,
+                          int(cfg.is_mc), int(cfg.do_mixing), int(cfg.do_3d), int(cfg.do_coulomb), int(cfg.use_cent)}) {
+                fp.Add(v);
+            }
+            fp.Add(double(cfg.vz_window));
+            fp.Add(cfg.prune_qmax);
+            fp.Add(int(cfg.use_index));
+            fp.Add(cfg.mixing_mode);
+            AddCorrections(fp, *cfg.corrections);
+            AddBinning(fp);
+            AddCuts(fp, cfg.systematic);
+            fp.Add(std::int32_t(2));   // Body layout: merged output, then the carried pools
+            return fp.Value();
+        }
+
+        /**
+         * @brief Writes the merged output of chunks [0, chunks_done) to cfg.checkpoint_path
+         * Chunk boundaries are the only consistent points. The pool that chunk
+         * chunks_done starts from is saved after the output, so a resumed run
+         * mixes exactly as an uninterrupted one.
+         * @param pools Pool of chunk chunks_done (PoolMixing runs, else nullptr)
+         * @return false (with a warning) if the checkpoint could not be written
+         */
+        inline bool SaveCheckpoint(const RunConfig& cfg, std::uint64_t fingerprint, Long64_t n_chunks,
+                                   Long64_t chunks_done, Long64_t next_entry, const LoopOutput& total,
+                                   const CarriedPools* pools) {
+            Checkpoint::CheckpointHeader header;
+            header.fingerprint = fingerprint;
+            header.n_chunks = n_chunks;
+            header.chunks_done = chunks_done;
+            header.next_entry = next_entry;
+            try {
+                Checkpoint::WriteCheckpoint(cfg.checkpoint_path, header, [&](Checkpoint::BinaryWriter& out) {
+                    total.Save(out);
+                    if (pools) pools->Save(out);
+                });
+            } catch (const std::exception& e) {
+                std::cout << "Warning: " << e.what() << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /**
+         * @brief Event index of the input list, checked against the chain length
+         * @throws std::runtime_error if a sidecar is missing or the entry counts differ
+         */
+        inline std::shared_ptr<const Index::EventIndex> LoadEventIndex(const RunConfig& cfg, Long64_t n_entries) {
+            auto index = Index::LoadChainIndex(ReadFileList(cfg.input_file), cfg.index_dir);
+            if (index->Entries() != n_entries) {
+                throw std::runtime_error("Event index has " + std::to_string(index->Entries()) +
+                                         " entries, the input chain " + std::to_string(n_entries));
+            }
+            std::cout << "Event index: " << n_entries << " entries, "
+                      << index->MemoryBytes() / (1024.0 * 1024.0) << " MB" << std::endl;
+            return index;
+        }
+
+        /**
+         * @brief Called with the index and output of a segment once all its chunks are merged
+         */
+        using SegmentFn = std::function<void(std::size_t, const LoopOutput&)>;
+
+        /**
+         * @brief Runs the event loop on cfg.n_threads threads
+         * @param n_entries Total entries of the input chains
+         * @param quick_test Restrict to the first QUICK_TEST_ENTRIES entries
+         * @param on_segment With cfg.segments: receives each segment's output, in segment order
+         * @return Run total, merged in chunk order
+         * @throws std::runtime_error if a pairs-only skim was made with other cuts or a skim cannot be written
+         */
+        inline std::unique_ptr<LoopOutput> RunEventLoop(const RunConfig& config, Long64_t n_entries,
+                                                        bool quick_test = false, const SegmentFn& on_segment = nullptr) {
+            RunConfig cfg = config;
+            Long64_t first = cfg.first_entry;
+            Long64_t last = (cfg.last_entry < 0) ? n_entries : std::min(cfg.last_entry, n_entries);
+            if (quick_test) last = std::min(last, first + QUICK_TEST_ENTRIES);
+            Long64_t n_chunks = (last > first) ? (last - first + CHUNK_ENTRIES - 1) / CHUNK_ENTRIES : 0;
+            const int n_threads = std::max(1, cfg.n_threads);
+
+            // Segments: chunks restart at every segment start, so no chunk (and no mixing) spans two
+            std::vector<Long64_t> chunk_first, chunk_last;
+            std::vector<std::size_t> chunk_segment;
+            if (!cfg.segments.empty()) {
+                if (cfg.run_mode != RUN_FULL) throw std::runtime_error("Entry segments need run_mode 0");
+                for (std::size_t s = 0; s < cfg.segments.size(); ++s) {
+                    const Long64_t seg_last = std::min(cfg.segments[s].second, n_entries);
+                    for (Long64_t b = cfg.segments[s].first; b < seg_last; b += CHUNK_ENTRIES) {
+                        chunk_first.push_back(b);
+                        chunk_last.push_back(std::min(b + CHUNK_ENTRIES, seg_last));
+                        chunk_segment.push_back(s);
+                    }
+                }
+                n_chunks = chunk_first.size();
+            }
+
+            // Skim input: one chunk per block; skim output: blocks written in chunk order
+            std::unique_ptr<Skim::SkimFile> skim_in;
+            std::unique_ptr<Skim::SkimWriter> skim_out;
+            if (cfg.run_mode == RUN_PAIRS_ONLY) {
+                skim_in.reset(new Skim::SkimFile(cfg.skim_path));
+                if (!skim_in->Matches(cfg.systematic, QualityCutsForSystematic(cfg.systematic),
+                                      EventCutsForSystematic(cfg.systematic))) {
+                    throw std::runtime_error("Skim " + cfg.skim_path + " was made with systematic " +
+                                             std::to_string(skim_in->Header().systematic) + " or different cuts");
+                }
+                cfg.skim_input = skim_in.get();
+                n_chunks = quick_test ? std::min<Long64_t>(1, skim_in->NumBlocks()) : skim_in->NumBlocks();
+            } else if (cfg.run_mode == RUN_WRITE_SKIM) {
+                skim_out.reset(new Skim::SkimWriter(cfg.skim_path, cfg.systematic, cfg.is_mc,
+                                                    QualityCutsForSystematic(cfg.systematic),
+                                                    EventCutsForSystematic(cfg.systematic)));
+            }
+
+            // Correction maps folded once into a flat table shared by all workers
+            if (!cfg.corrections) cfg.corrections = MakeCorrectionTable(cfg.eff_hists);
+            if (cfg.use_index && cfg.run_mode != RUN_PAIRS_ONLY && !cfg.event_index) {
+                cfg.event_index = LoadEventIndex(cfg, n_entries);
+            }
+            if (cfg.prune_qmax > 0 && !cfg.pruning) {
+                cfg.pruning = std::make_shared<const Kernel::CellGrid>(cfg.prune_qmax, PI_MASS);
+            }
+
+            // Pair cache: chunk spools appended in chunk order
+            std::unique_ptr<PairCache::CacheWriter> cache_out;
+            if (cfg.cache_qmax > 0 && cfg.run_mode != RUN_WRITE_SKIM) {
+                if (cfg.pruning && cfg.cache_qmax > cfg.prune_qmax) {
+                    throw std::runtime_error("The pair cache threshold must not exceed the q window");
+                }
+                cache_out.reset(new PairCache::CacheWriter(cfg.cache_path, cfg.systematic, cfg.cache_qmax,
+                                                           cfg.do_3d, cfg.use_cent));
+            }
+
+            std::unique_ptr<LoopOutput> total(new LoopOutput(cfg.do_3d, WithMC(cfg)));
+            std::unique_ptr<LoopOutput> segment_total;
+            if (!chunk_first.empty()) segment_total.reset(new LoopOutput(cfg.do_3d, WithMC(cfg)));
+
+            // Resume from the last checkpoint: its total already holds chunks [0, first_chunk)
+            const bool checkpointing = !cfg.checkpoint_path.empty() && cfg.run_mode != RUN_WRITE_SKIM && !cache_out &&
+                                       cfg.segments.empty();
+            const std::uint64_t fingerprint = checkpointing ? RunFingerprint(cfg, first, last, n_chunks) : 0;
+            Long64_t first_chunk = 0;
+            CarriedPools resumed(cfg);
+            if (checkpointing && cfg.resume) {
+                Checkpoint::CheckpointHeader header;
+                if (Checkpoint::ReadCheckpoint(cfg.checkpoint_path, fingerprint, header,
+                                               [&](Checkpoint::BinaryReader& in) {
+                                                   total->Load(in);
+                                                   if (PoolMixing(cfg)) resumed.Load(in);
+                                               })) {
+                    first_chunk = header.chunks_done;
+                    std::cout << "Resuming from " << cfg.checkpoint_path << ": " << first_chunk << "/" << n_chunks
+                              << " chunks done, next entry " << header.next_entry << std::endl;
+                }
+            }
+            auto last_checkpoint = Perf::Clock::now();
+
+            // One pool over the whole range, restarted at every segment; a resumed run starts from the saved one
+            std::unique_ptr<PoolCarry> carry;
+            if (PoolMixing(cfg) && n_chunks > 0) {
+                std::vector<char> starts(n_chunks, 0);
+                starts[0] = 1;
+                for (Long64_t c = 1; c < Long64_t(chunk_segment.size()); ++c) {
+                    starts[c] = chunk_segment[c] != chunk_segment[c - 1];
+                }
+                if (first_chunk < n_chunks) starts[first_chunk] = first_chunk == 0;
+                carry.reset(new PoolCarry(CarriedPools(cfg), std::move(starts)));
+                carry->Publish(first_chunk, resumed);
+            }
+
+            // Workers are built serially: TChain construction is not thread-safe
+            if (n_threads > 1 || cfg.pipeline_depth > 0) ROOT::EnableThreadSafety();
+            std::vector<std::unique_ptr<Worker>> workers;
+            for (int t = 0; t < n_threads; ++t) workers.emplace_back(new Worker(cfg));
+
+            RunChunks(workers, n_chunks,
+                [&](Worker& worker, Long64_t c) {
+                    try {
+                        if (!chunk_first.empty()) {
+                            worker.ProcessChunk(c, chunk_first[c], chunk_last[c], carry.get());
+                            return;
+                        }
+                        Long64_t begin = first + c * CHUNK_ENTRIES;
+                        worker.ProcessChunk(c, begin, std::min(begin + CHUNK_ENTRIES, last), carry.get());
+                    } catch (...) {
+                        if (carry) carry->Abort();   // Chunks waiting for this one's pool give up
+                        throw;
+                    }
+                },
+                [&](Worker& worker, Long64_t c) {
+                    if (segment_total) {
+                        segment_total->Add(worker.Output());
+                        if (c + 1 == n_chunks || chunk_segment[c + 1] != chunk_segment[c]) {
+                            if (on_segment) on_segment(chunk_segment[c], *segment_total);
+                            total->Add(*segment_total);
+                            segment_total->Reset();
+                        }
+                    } else {
+                        total->Add(worker.Output());
+                    }
+                    if (skim_out) skim_out->WriteBlock(worker.Output().skim);
+                    if (cache_out) cache_out->WriteChunk(c, worker.Output().cache);
+                    if ((c + 1) % 10 == 0 || c + 1 == n_chunks) {
+                        std::cout << "Processed " << c + 1 << "/" << n_chunks << " chunks ("
+                                  << total->n_processed << " events)" << std::endl;
+                    }
+                    if (checkpointing && c + 1 < n_chunks &&
+                        Perf::SecondsSince(last_checkpoint) >= cfg.checkpoint_interval_s) {
+                        Long64_t next_entry = std::min(last, first + (c + 1) * CHUNK_ENTRIES);
+                        CarriedPools next(cfg);
+                        if (carry) carry->Get(c + 1, next);   // Published by chunk c before its merge
+                        if (SaveCheckpoint(cfg, fingerprint, n_chunks, c + 1, next_entry, *total,
+                                           carry ? &next : nullptr)) {
+                            std::cout << "Checkpoint after chunk " << c + 1 << " written to "
+                                      << cfg.checkpoint_path << std::endl;
+                        }
+                        last_checkpoint = Perf::Clock::now();
+                    }
+                    if (carry) carry->Retire(c);
+                }, first_chunk);
+            if (skim_out) skim_out->Close();
+            if (cache_out) {
+                cache_out->Close();
+                const PairCache::FileHeader& h = cache_out->Header();
+                std::cout << "Pair cache " << cfg.cache_path << ": " << h.n_same << " same-event and " << h.n_mixed
+                          << " mixed pairs with qinv < " << cfg.cache_qmax << " ("
+                          << (h.n_same + h.n_mixed) * sizeof(PairCache::PairRecord) / (1024.0 * 1024.0) << " MB)"
+                          << std::endl;
+            }
+            if (cfg.pruning && cfg.validate_pruning) {
+                std::cout << "Pair pruning check: " << total->n_pruning_missed << " pairs with qinv < "
+                          << cfg.prune_qmax << " missed by the cell loop" << std::endl;
+                if (total->n_pruning_missed > 0) throw std::runtime_error("Pair pruning dropped pairs inside the q window");
+            }
+            if (cfg.pipeline_depth > 0 && cfg.run_mode == RUN_FULL) {
+                std::cout << "Pipeline occupancy: reader " << 100 * total->read_stage.Occupancy()
+                          << "%, compute " << 100 * total->compute_stage.Occupancy()
+                          << "% (the stage near 100% is the bottleneck)" << std::endl;
+            }
+            PrintMemoryReport(total->MemoryBytes());
+            return total;
+        }
+
+        /**
+         * @brief Converts the merged accumulators and writes them to a directory
+         * The perf counters (write time included) go to dir/perf when the loop
+         * recorded them.
+         * @param dir Output file, or a per-variant directory in multi-systematic mode
+         */
+        inline void WriteResults(TDirectory& dir, LoopOutput& result) {
+            auto t0 = Perf::Clock::now();
+            dir.cd();
+            result.hCentrality->Write("centrality_loop");
+            result.hVz->Write("vzhist_loop");
+            result.hMultiplicity->Write("multiplicity_loop");
+            result.same.Write("");
+            result.mixed.Write("_mix");
+            if (result.mc) result.mc->Write();
+            result.perf.AddTime(Perf::TIME_WRITE, Perf::SecondsSince(t0));
+            if (result.perf.counts[Perf::ENTRIES_READ] > 0) result.perf.Write(dir);
+        }
+
+    } // namespace EventLoop
+} // namespace HBT
+
+#endif // HBT_EVENT_LOOP_H
@@ -0,0 +1,343 @@
+#ifndef HBT_SKIM_H
+#define HBT_SKIM_H
+
+#include "read_tree.h"
+#include "pair_kernel.h"
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * @file hbt_skim.h
+ * @brief Compact columnar skim of selected tracks for repeated pair passes
+ *
+ * Layout (little endian, as written by the producing machine):
+ *   FileHeader
+ *   Block 0 .. n_blocks-1, each one chunk of the event loop:
+ *     BlockHeader
+ *     float    vz[n_events]
+ *     int16_t  hiBin[n_events]
+ *     uint32_t offsets[n_events + 1]   (track range of each event in the block)
+ *     uint16_t pt[n_tracks]            (log-quantized between PT_LO and PT_HI)
+ *     int16_t  eta[n_tracks], phi[n_tracks]
+ *     int8_t   charge[n_tracks]
+ *     float    weight[n_tracks]        (track correction already applied)
+ * Columns are padded to 8 bytes. The header records the HBTQualityCuts,
+ * HBTEventCuts and systematic used, so a pairs-only pass can check them.
+ */
+
+namespace HBT {
+    namespace Skim {
+
+        // Format ==============================================================
+        constexpr char MAGIC[8] = {'H', 'B', 'T', 'S', 'K', 'I', 'M', '1'};
+        constexpr std::uint32_t VERSION = 1;
+        constexpr double PT_LO = 0.1;     // GeV/c
+        constexpr double PT_HI = 500.0;   // GeV/c
+        constexpr double ETA_RANGE = 3.0;
+
+        struct FileHeader {
+            char magic[8];
+            std::uint32_t version = VERSION;
+            std::int32_t systematic = 0;
+            std::int32_t is_mc = 0;
+            // HBTQualityCuts
+            std::int32_t requireHighPurity = 1;
+            std::int32_t minPixelHits = 0;
+            std::int32_t minTotalHits = 0;
+            float maxDcaXY = 0, maxDcaZ = 0, maxChi2 = 0;
+            // HBTEventCuts
+            float maxAbsVz = 0;
+            std::int32_t hiBinShift = 0;
+            std::int32_t requireFilters = 1;
+            // Content
+            std::uint64_t n_blocks = 0;
+            std::uint64_t n_events = 0;
+            std::uint64_t n_tracks = 0;
+        };
+
+        struct BlockHeader {
+            std::uint64_t bytes = 0;       // Block size including this header
+            std::uint32_t n_events = 0;
+            std::uint32_t n_tracks = 0;
+        };
+
+        inline std::size_t Pad8(std::size_t n) { return (n + 7) & ~std::size_t(7); }
+
+        // Quantization ========================================================
+        inline std::uint16_t QuantizePt(double pt) {
+            double x = (std::log(pt) - std::log(PT_LO)) / (std::log(PT_HI) - std::log(PT_LO));
+            x = std::min(std::max(x, 0.0), 1.0);
+            return static_cast<std::uint16_t>(std::lround(x * 65535.0));
+        }
+        inline double DequantizePt(std::uint16_t q) {
+            return PT_LO * std::exp(q / 65535.0 * (std::log(PT_HI) - std::log(PT_LO)));
+        }
+        inline std::int16_t QuantizeSigned(double x, double range) {
+            double y = std::min(std::max(x / range, -1.0), 1.0);
+            return static_cast<std::int16_t>(std::lround(y * 32767.0));
+        }
+        inline double DequantizeSigned(std::int16_t q, double range) {
+            return q / 32767.0 * range;
+        }
+
+        // In-memory Block =====================================================
+
+        /**
+         * @brief Accepted events of one chunk, ready to be written
+         */
+        struct SkimBlock {
+            std::vector<float> vz;
+            std::vector<std::int16_t> hiBin;
+            std::vector<std::uint32_t> offsets{0};
+            std::vector<std::uint16_t> pt;
+            std::vector<std::int16_t> eta, phi;
+            std::vector<std::int8_t> charge;
+            std::vector<float> weight;
+
+            std::uint32_t NumEvents() const { return static_cast<std::uint32_t>(vz.size()); }
+            std::uint32_t NumTracks() const { return offsets.back(); }
+
+            void Clear() {
+                vz.clear(); hiBin.clear(); offsets.assign(1, 0);
+                pt.clear(); eta.clear(); phi.clear(); charge.clear(); weight.clear();
+            }
+
+            /**
+             * @brief Appends one event from its corrected track SoA
+             * @param tracks Accepted tracks only, as the full run analyses them
+             */
+            void AddEvent(float event_vz, int event_hiBin, const Kernel::TrackSoA& tracks) {
+                vz.push_back(event_vz);
+                hiBin.push_back(static_cast<std::int16_t>(event_hiBin));
+                for (int t = 0; t < tracks.size(); ++t) {
+                    pt.push_back(QuantizePt(tracks.pt[t]));
+                    eta.push_back(QuantizeSigned(std::asinh(tracks.pz[t] / tracks.pt[t]), ETA_RANGE));
+                    phi.push_back(QuantizeSigned(std::atan2(tracks.py[t], tracks.px[t]), M_PI));
+                    charge.push_back(static_cast<std::int8_t>(tracks.charge[t]));
+                    weight.push_back(static_cast<float>(tracks.weight[t]));
+                }
+                offsets.push_back(static_cast<std::uint32_t>(pt.size()));
+            }
+        };
+
+        // Writer ==============================================================
+        class SkimWriter {
+        public:
+            /**
+             * @throws std::runtime_error if the file cannot be created or the header written
+             */
+            SkimWriter(const std::string& path, int systematic, bool is_mc,
+                       const HBTQualityCuts& qcuts, const HBTEventCuts& ecuts) : path_(path) {
+                std::memcpy(header_.magic, MAGIC, sizeof(MAGIC));
+                header_.systematic = systematic;
+                header_.is_mc = is_mc;
+                header_.requireHighPurity = qcuts.requireHighPurity;
+                header_.minPixelHits = qcuts.minPixelHits;
+                header_.minTotalHits = qcuts.minTotalHits;
+                header_.maxDcaXY = qcuts.maxDcaXY;
+                header_.maxDcaZ = qcuts.maxDcaZ;
+                header_.maxChi2 = qcuts.maxChi2;
+                header_.maxAbsVz = ecuts.maxAbsVz;
+                header_.hiBinShift = ecuts.hiBinShift;
+                header_.requireFilters = ecuts.requireFilters;
+                file_ = std::fopen(path.c_str(), "wb");
+                if (!file_) throw std::runtime_error("Could not create skim file: " + path);
+                Put(&header_, sizeof(header_));
+                if (!ok_) {
+                    std::fclose(file_);
+                    throw std::runtime_error("Could not write skim file: " + path);
+                }
+            }
+
+            /**
+             * @brief Closes a writer that was not closed, e.g. after an exception; the file stays incomplete
+             */
+            ~SkimWriter() {
+                if (file_) std::fclose(file_);
+            }
+
+            /**
+             * @throws std::runtime_error on a write error (e.g. a full disk)
+             */
+            void WriteBlock(const SkimBlock& block) {
+                BlockHeader bh;
+                bh.n_events = block.NumEvents();
+                bh.n_tracks = block.NumTracks();
+                bh.bytes = sizeof(BlockHeader)
+                         + Pad8(bh.n_events * sizeof(float)) + Pad8(bh.n_events * sizeof(std::int16_t))
+                         + Pad8((bh.n_events + 1) * sizeof(std::uint32_t))
+                         + 3 * Pad8(bh.n_tracks * sizeof(std::int16_t))
+                         + Pad8(bh.n_tracks * sizeof(std::int8_t)) + Pad8(bh.n_tracks * sizeof(float));
+                Put(&bh, sizeof(bh));
+                WriteColumn(block.vz);
+                WriteColumn(block.hiBin);
+                WriteColumn(block.offsets);
+                WriteColumn(block.pt);
+                WriteColumn(block.eta);
+                WriteColumn(block.phi);
+                WriteColumn(block.charge);
+                WriteColumn(block.weight);
+                ++header_.n_blocks;
+                header_.n_events += bh.n_events;
+                header_.n_tracks += bh.n_tracks;
+                if (!ok_) throw std::runtime_error("Could not write skim file: " + path_);
+            }
+
+            /**
+             * @brief Rewrites the header with the final counts and closes the file
+             * @throws std::runtime_error if any write, the seek or the close failed
+             */
+            void Close() {
+                if (!file_) return;
+                if (std::fseek(file_, 0, SEEK_SET) != 0) ok_ = false;
+                Put(&header_, sizeof(header_));
+                if (std::fclose(file_) != 0) ok_ = false;
+                file_ = nullptr;
+                if (!ok_) throw std::runtime_error("Could not write skim file: " + path_);
+            }
+
+            const FileHeader& Header() const { return header_; }
+
+        private:
+            template<typename T>
+            void WriteColumn(const std::vector<T>& col) {
+                static const char zeros[8] = {0};
+                std::size_t bytes = col.size() * sizeof(T);
+                Put(col.data(), bytes);
+                Put(zeros, Pad8(bytes) - bytes);
+            }
+
+            void Put(const void* data, std::size_t n) {
+                if (ok_ && n && std::fwrite(data, 1, n, file_) != n) ok_ = false;
+            }
+
+            std::string path_;
+            FileHeader header_;
+            std::FILE* file_ = nullptr;
+            bool ok_ = true;
+        };
+
+        // Memory-mapped Reader ================================================
+
+        /**
+         * @brief Column pointers of one block inside the mapping
+         */
+        struct BlockView {
+            std::uint32_t n_events = 0;
+            std::uint32_t n_tracks = 0;
+            const float* vz = nullptr;
+            const std::int16_t* hiBin = nullptr;
+            const std::uint32_t* offsets = nullptr;
+            const std::uint16_t* pt = nullptr;
+            const std::int16_t* eta = nullptr;
+            const std::int16_t* phi = nullptr;
+            const std::int8_t* charge = nullptr;
+            const float* weight = nullptr;
+
+            /**
+             * @brief Dequantizes the tracks of event e into SoA form
+             */
+            void LoadTracks(std::uint32_t e, double mass, Kernel::TrackSoA& tracks) const {
+                tracks.clear();
+                tracks.reserve(offsets[e + 1] - offsets[e]);
+                for (std::uint32_t t = offsets[e]; t < offsets[e + 1]; ++t) {
+                    tracks.push_back_ptetaphi(DequantizePt(pt[t]), DequantizeSigned(eta[t], ETA_RANGE),
+                                              DequantizeSigned(phi[t], M_PI), mass, charge[t], weight[t]);
+                }
+            }
+        };
+
+        class SkimFile {
+        public:
+            /**
+             * @throws std::runtime_error if the file cannot be mapped or is not a skim
+             */
+            explicit SkimFile(const std::string& path) {
+                int fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0) throw std::runtime_error("Could not open skim file: " + path);
+                struct stat st;
+                ::fstat(fd, &st);
+                size_ = static_cast<std::size_t>(st.st_size);
+                void* map = (size_ >= sizeof(FileHeader)) ? ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+                ::close(fd);
+                if (map == MAP_FAILED) throw std::runtime_error("Could not map skim file: " + path);
+                base_ = static_cast<const char*>(map);
+                std::memcpy(&header_, base_, sizeof(header_));
+                if (std::memcmp(header_.magic, MAGIC, sizeof(MAGIC)) != 0 || header_.version != VERSION) {
+                    ::munmap(const_cast<char*>(base_), size_);
+                    throw std::runtime_error("Not an HBT skim file: " + path);
+                }
+                IndexBlocks();
+            }
+
+            ~SkimFile() { if (base_) ::munmap(const_cast<char*>(base_), size_); }
+            SkimFile(const SkimFile&) = delete;
+            SkimFile& operator=(const SkimFile&) = delete;
+
+            const FileHeader& Header() const { return header_; }
+            std::size_t NumBlocks() const { return blocks_.size(); }
+            const BlockView& Block(std::size_t b) const { return blocks_[b]; }
+
+            /**
+             * @brief Whether the skim was made with the given cuts and systematic
+             */
+            bool Matches(int systematic, const HBTQualityCuts& q, const HBTEventCuts& e) const {
+                return header_.systematic == systematic
+                    && header_.requireHighPurity == q.requireHighPurity
+                    && header_.minPixelHits == q.minPixelHits && header_.minTotalHits == q.minTotalHits
+                    && header_.maxDcaXY == q.maxDcaXY && header_.maxDcaZ == q.maxDcaZ
+                    && header_.maxChi2 == q.maxChi2 && header_.maxAbsVz == e.maxAbsVz
+                    && header_.hiBinShift == e.hiBinShift && header_.requireFilters == e.requireFilters;
+            }
+
+        private:
+            void IndexBlocks() {
+                std::size_t pos = sizeof(FileHeader);
+                for (std::uint64_t b = 0; b < header_.n_blocks; ++b) {
+                    if (pos + sizeof(BlockHeader) > size_) throw std::runtime_error("Truncated skim file");
+                    BlockHeader bh;
+                    std::memcpy(&bh, base_ + pos, sizeof(bh));
+                    if (pos + bh.bytes > size_) throw std::runtime_error("Truncated skim file");
+                    BlockView v;
+                    v.n_events = bh.n_events;
+                    v.n_tracks = bh.n_tracks;
+                    const char* p = base_ + pos + sizeof(BlockHeader);
+                    v.vz = Column<float>(p, bh.n_events);
+                    v.hiBin = Column<std::int16_t>(p, bh.n_events);
+                    v.offsets = Column<std::uint32_t>(p, bh.n_events + 1);
+                    v.pt = Column<std::uint16_t>(p, bh.n_tracks);
+                    v.eta = Column<std::int16_t>(p, bh.n_tracks);
+                    v.phi = Column<std::int16_t>(p, bh.n_tracks);
+                    v.charge = Column<std::int8_t>(p, bh.n_tracks);
+                    v.weight = Column<float>(p, bh.n_tracks);
+                    blocks_.push_back(v);
+                    pos += bh.bytes;
+                }
+            }
+
+            template<typename T>
+            static const T* Column(const char*& p, std::size_t n) {
+                const T* col = reinterpret_cast<const T*>(p);
+                p += Pad8(n * sizeof(T));
+                return col;
+            }
+
+            const char* base_ = nullptr;
+            std::size_t size_ = 0;
+            FileHeader header_;
+            std::vector<BlockView> blocks_;
+        };
+
+    } // namespace Skim
+} // namespace HBT
+
+#endif // HBT_SKIM_H
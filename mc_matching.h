@@ -0,0 +1,370 @@
+#ifndef HBT_MC_MATCHING_H
+#define HBT_MC_MATCHING_H
+
+#include "read_tree.h"
+#include "pair_kernel.h"
+#include "hbt_accumulators.h"
+#include "checkpoint.h"
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
+
+/**
+ * @file mc_matching.h
+ * @brief Reco-gen matching and the gen-level pair path of MC runs
+ *
+ * Gen particles are sorted into an (η, φ) grid of MATCH_GRID_CELL cells
+ * (counting sort, φ periodic). Each reco track only looks at the 3x3 cells
+ * around it for gen particles within MATCH_MAX_DR whose pT agrees within
+ * MATCH_MAX_DPT_REL. The candidate pairs of the event are then matched one
+ * to one, closest first, so a gen particle never matches two tracks. This
+ * takes near linear time instead of the n_reco x n_gen of an all-pairs ΔR. Gen particles
+ * go through the same pair kernel and accumulators as reco tracks. Matched
+ * same-event pairs fill reco-vs-gen q response and resolution histograms.
+ */
+
+namespace HBT {
+    namespace MC {
+
+        // Configuration =======================================================
+        constexpr double MATCH_MAX_DR = 0.02;       // ΔR(reco, gen)
+        constexpr double MATCH_MAX_DPT_REL = 0.3;   // |pT_reco - pT_gen| / pT_gen
+        constexpr double MATCH_GRID_CELL = 0.1;     // (η, φ) cell size, >= MATCH_MAX_DR
+        constexpr int RES_QBINS = 100;              // Response and resolution: q_gen axis
+        constexpr double RES_QMAX = 0.5;            // GeV/c
+        constexpr int RES_DQBINS = 100;             // q_reco - q_gen axis
+        constexpr double RES_DQMAX = 0.05;          // GeV/c
+
+        inline double DeltaPhi(double a, double b) {
+            return std::remainder(a - b, 2.0 * M_PI);
+        }
+
+        // Matching ============================================================
+
+        /**
+         * @brief (η, φ) grid over one event's gen particles
+         * The arrays given to Index must outlive the Match calls.
+         */
+        class GenMatcher {
+        public:
+            /**
+             * @throws std::runtime_error if maxDR exceeds the grid cell
+             */
+            explicit GenMatcher(double maxDR = MATCH_MAX_DR, double maxDptRel = MATCH_MAX_DPT_REL,
+                                double cell = MATCH_GRID_CELL)
+                : maxDR2_(maxDR * maxDR), maxDptRel_(maxDptRel) {
+                if (maxDR > cell) throw std::runtime_error("GenMatcher: matching cone larger than the grid cell");
+                etaMin_ = -MAX_HBT_ETA - cell;
+                nEta_ = static_cast<int>(std::ceil(2.0 * (MAX_HBT_ETA + cell) / cell));
+                nPhi_ = std::max(3, static_cast<int>(std::floor(2.0 * M_PI / cell)));
+                cellEta_ = cell;
+                cellPhi_ = 2.0 * M_PI / nPhi_;
+                cellBegin_.assign(nEta_ * nPhi_ + 1, 0);
+            }
+
+            /**
+             * @brief Sorts n gen particles into the grid
+             */
+            void Index(int n, const float* pt, const float* eta, const float* phi) {
+                pt_ = pt; eta_ = eta; phi_ = phi;
+                cellOf_.resize(n);
+                order_.resize(n);
+                std::fill(cellBegin_.begin(), cellBegin_.end(), 0);
+                for (int g = 0; g < n; ++g) {
+                    cellOf_[g] = Cell(EtaBin(eta[g]), PhiBin(phi[g]));
+                    ++cellBegin_[cellOf_[g] + 1];
+                }
+                for (std::size_t c = 1; c < cellBegin_.size(); ++c) cellBegin_[c] += cellBegin_[c - 1];
+                cursor_.assign(cellBegin_.begin(), cellBegin_.end() - 1);
+                for (int g = 0; g < n; ++g) order_[cursor_[cellOf_[g]]++] = g;
+            }
+
+            /**
+             * @brief One-to-one matching of n reco tracks to the indexed gen particles
+             * Every (reco, gen) pair passing the cuts is a candidate; candidates are
+             * taken closest first (ties: lower reco, then lower gen index) and kept
+             * if neither side is matched yet, so no gen particle is matched twice.
+             * @param skip Per reco track, nonzero to leave it unmatched (nullptr: none)
+             * @param match Output: gen index given to Index per reco track, -1 if none
+             */
+            void Match(int n, const float* pt, const float* eta, const float* phi, const std::uint8_t* skip,
+                       std::vector<int>& match) {
+                candidates_.clear();
+                for (int r = 0; r < n; ++r) {
+                    if (skip && skip[r]) continue;
+                    const int ie = EtaBin(eta[r]), ip = PhiBin(phi[r]);
+                    for (int de = -1; de <= 1; ++de) {
+                        const int e = ie + de;
+                        if (e < 0 || e >= nEta_) continue;
+                        for (int dp = -1; dp <= 1; ++dp) {
+                            const int c = Cell(e, (ip + dp + nPhi_) % nPhi_);
+                            for (int o = cellBegin_[c]; o < cellBegin_[c + 1]; ++o) {
+                                Consider(r, order_[o], pt[r], eta[r], phi[r]);
+                            }
+                        }
+                    }
+                }
+                Assign(n, match);
+            }
+
+            /**
+             * @brief Same result as Match from a scan over all gen particles (validation)
+             */
+            void MatchBruteForce(int n_gen, int n, const float* pt, const float* eta, const float* phi,
+                                 const std::uint8_t* skip, std::vector<int>& match) {
+                candidates_.clear();
+                for (int r = 0; r < n; ++r) {
+                    if (skip && skip[r]) continue;
+                    for (int g = 0; g < n_gen; ++g) Consider(r, g, pt[r], eta[r], phi[r]);
+                }
+                Assign(n, match);
+            }
+
+        private:
+            struct Candidate {
+                double dr2;
+                int reco, gen;
+                bool operator<(const Candidate& o) const {
+                    if (dr2 != o.dr2) return dr2 < o.dr2;
+                    return reco != o.reco ? reco < o.reco : gen < o.gen;
+                }
+            };
+
+            int EtaBin(float eta) const {
+                int b = static_cast<int>(std::floor((eta - etaMin_) / cellEta_));
+                return std::min(std::max(b, 0), nEta_ - 1);
+            }
+            int PhiBin(float phi) const {
+                double x = std::remainder(double(phi), 2.0 * M_PI) + M_PI;   // [0, 2π]
+                int b = static_cast<int>(x / cellPhi_);
+                return std::min(b, nPhi_ - 1);
+            }
+            int Cell(int e, int p) const { return e * nPhi_ + p; }
+
+            void Consider(int r, int g, float pt, float eta, float phi) {
+                if (std::abs(pt - pt_[g]) > maxDptRel_ * pt_[g]) return;
+                const double deta = eta - eta_[g];
+                const double dphi = DeltaPhi(phi, phi_[g]);
+                const double dr2 = deta * deta + dphi * dphi;
+                if (dr2 < maxDR2_) candidates_.push_back({dr2, r, g});
+            }
+
+            // Closest candidates first; a track or gen particle already taken is skipped
+            void Assign(int n, std::vector<int>& match) {
+                std::sort(candidates_.begin(), candidates_.end());
+                match.assign(n, -1);
+                genUsed_.assign(cellOf_.size(), 0);
+                for (const Candidate& c : candidates_) {
+                    if (match[c.reco] >= 0 || genUsed_[c.gen]) continue;
+                    match[c.reco] = c.gen;
+                    genUsed_[c.gen] = 1;
+                }
+            }
+
+            double maxDR2_, maxDptRel_;
+            double etaMin_ = 0, cellEta_ = 0, cellPhi_ = 0;
+            int nEta_ = 0, nPhi_ = 0;
+            std::vector<int> cellBegin_, cursor_, cellOf_, order_;
+            std::vector<Candidate> candidates_;
+            std::vector<std::uint8_t> genUsed_;
+            const float *pt_ = nullptr, *eta_ = nullptr, *phi_ = nullptr;
+        };
+
+        // Event ===============================================================
+
+        /**
+         * @brief Gen particles and matched pairs of one event
+         */
+        struct MCEvent {
+            std::vector<float> selPt, selEta, selPhi;   // Gen particles in the acceptance (matching input)
+            std::vector<int> selCharge;                 // Their charge
+            std::vector<int> match;                     // Per reco track: matched gen index or -1
+            Kernel::TrackSoA gen;           // Charged gen particles in the track acceptance
+            Kernel::TrackSoA recoMatched;   // Reco tracks with a gen match ...
+            Kernel::TrackSoA genMatched;    // ... and their gen particles, same order
+            int nReco = 0;                  // Reco tracks considered for matching
+
+            void swap(MCEvent& o) {
+                selPt.swap(o.selPt); selEta.swap(o.selEta); selPhi.swap(o.selPhi); selCharge.swap(o.selCharge);
+                match.swap(o.match);
+                gen.swap(o.gen);
+                recoMatched.swap(o.recoMatched);
+                genMatched.swap(o.genMatched);
+                std::swap(nReco, o.nReco);
+            }
+        };
+
+        /**
+         * @brief Selects the gen particles of an event and matches the reco tracks to them
+         * Gen particles need pT >= MIN_HBT_PT, |η| <= MAX_HBT_ETA and a charge.
+         * @param skip Per reco track, nonzero to leave it out (correction range flags)
+         * @param mass Mass hypothesis of both levels
+         * @throws std::runtime_error if the event has fewer gen charges than gen particles
+         */
+        inline void FillMCEvent(const HBTEvent& ev, const std::uint8_t* skip, double mass,
+                                GenMatcher& matcher, MCEvent& out) {
+            const std::size_t nAll = std::min(ev.genPt.size(), std::min(ev.genEta.size(), ev.genPhi.size()));
+            if (ev.genCharge.size() < nAll) throw std::runtime_error("Gen particles without a charge (chg)");
+            out.selPt.clear(); out.selEta.clear(); out.selPhi.clear(); out.selCharge.clear();
+            for (std::size_t g = 0; g < nAll; ++g) {
+                if (ev.genPt[g] < MIN_HBT_PT || std::abs(ev.genEta[g]) > MAX_HBT_ETA) continue;
+                if (ev.genCharge[g] == 0) continue;
+                out.selPt.push_back(ev.genPt[g]);
+                out.selEta.push_back(ev.genEta[g]);
+                out.selPhi.push_back(ev.genPhi[g]);
+                out.selCharge.push_back(ev.genCharge[g]);
+            }
+            const int n = out.selPt.size();
+            matcher.Index(n, out.selPt.data(), out.selEta.data(), out.selPhi.data());
+
+            out.recoMatched.clear();
+            out.genMatched.clear();
+            out.nReco = 0;
+            matcher.Match(ev.nTracks, ev.pt, ev.eta, ev.phi, skip, out.match);
+            for (int t = 0; t < ev.nTracks; ++t) {
+                if (skip && skip[t]) continue;
+                ++out.nReco;
+                const int g = out.match[t];
+                if (g < 0) continue;
+                out.recoMatched.push_back_ptetaphi(ev.pt[t], ev.eta[t], ev.phi[t], mass, ev.charge[t], 1.0);
+                out.genMatched.push_back_ptetaphi(out.selPt[g], out.selEta[g], out.selPhi[g], mass,
+                                                  out.selCharge[g], 1.0);
+            }
+
+            out.gen.clear();
+            out.gen.reserve(n);
+            for (int g = 0; g < n; ++g) {
+                out.gen.push_back_ptetaphi(out.selPt[g], out.selEta[g], out.selPhi[g], mass, out.selCharge[g], 1.0);
+            }
+        }
+
+        // Output ==============================================================
+
+        /**
+         * @brief Gen-level pairs, q resolution and matching counts of an MC run
+         */
+        struct MCOutput {
+            Accum::PairAccumulators same;
+            Accum::PairAccumulators mixed;
+            std::unique_ptr<TH2D> hQinvResponse;   // (qinv gen, qinv reco)
+            std::unique_ptr<TH2D> hQinvResolution; // (qinv gen, reco - gen)
+            std::unique_ptr<TH2D> hQoutResolution, hQsideResolution, hQlongResolution;  // 3D runs
+            std::unique_ptr<TH1D> hMatching;       // Reco tracks, matched tracks, gen particles, events
+
+            explicit MCOutput(bool do3D) : same(do3D), mixed(do3D) {
+                hQinvResponse.reset(new TH2D("qinv_response", "matched pairs;qinv gen;qinv reco",
+                                             RES_QBINS, 0, RES_QMAX, RES_QBINS, 0, RES_QMAX));
+                hQinvResolution.reset(Resolution("qinv_resolution", "qinv", 0));
+                hQoutResolution.reset(Resolution("qout_resolution", "qout", -RES_QMAX));   // q_out is signed
+                hQsideResolution.reset(Resolution("qside_resolution", "qside", 0));
+                hQlongResolution.reset(Resolution("qlong_resolution", "qlong", 0));
+                hMatching.reset(new TH1D("mc_matching", "MC matching", 4, 0, 4));
+                const char* labels[4] = {"reco_tracks", "matched_tracks", "gen_particles", "events"};
+                for (int b = 0; b < 4; ++b) hMatching->GetXaxis()->SetBinLabel(b + 1, labels[b]);
+                for (TH1* h : Histograms()) h->SetDirectory(nullptr);
+            }
+
+            std::vector<TH1*> Histograms() const {
+                return {hQinvResponse.get(), hQinvResolution.get(), hQoutResolution.get(),
+                        hQsideResolution.get(), hQlongResolution.get(), hMatching.get()};
+            }
+
+            void Add(const MCOutput& other) {
+                same.Add(other.same);
+                mixed.Add(other.mixed);
+                std::vector<TH1*> mine = Histograms(), theirs = other.Histograms();
+                for (std::size_t h = 0; h < mine.size(); ++h) mine[h]->Add(theirs[h]);
+            }
+
+            void Reset() {
+                same.Reset();
+                mixed.Reset();
+                for (TH1* h : Histograms()) h->Reset();
+            }
+
+            std::size_t MemoryBytes() const { return same.MemoryBytes() + mixed.MemoryBytes(); }
+
+            /**
+             * @brief Counts of one event
+             */
+            void CountEvent(const MCEvent& ev) {
+                hMatching->Fill(0.5, ev.nReco);
+                hMatching->Fill(1.5, ev.recoMatched.size());
+                hMatching->Fill(2.5, ev.gen.size());
+                hMatching->Fill(3.5);
+            }
+
+            template<typename Out>
+            void Save(Out& out) const {
+                same.Save(out);
+                mixed.Save(out);
+                for (TH1* h : Histograms()) Checkpoint::SaveTH1(out, *h);
+            }
+
+            template<typename In>
+            void Load(In& in) {
+                same.Load(in);
+                mixed.Load(in);
+                for (TH1* h : Histograms()) Checkpoint::LoadTH1(in, *h);
+            }
+
+            /**
+             * @brief Writes the gen-level pairs (suffix _gen, _gen_mix) and the resolution histograms
+             */
+            void Write() const {
+                same.Write("_gen");
+                mixed.Write("_gen_mix");
+                hQinvResponse->Write();
+                hQinvResolution->Write();
+                if (same.do3D) {
+                    hQoutResolution->Write();
+                    hQsideResolution->Write();
+                    hQlongResolution->Write();
+                }
+                hMatching->Write();
+            }
+
+        private:
+            static TH2D* Resolution(const char* name, const char* q, double qlo) {
+                return new TH2D(name, Form("matched pairs;%s gen;%s reco - gen", q, q),
+                                RES_QBINS, qlo, RES_QMAX, RES_DQBINS, -RES_DQMAX, RES_DQMAX);
+            }
+        };
+
+        /**
+         * @brief Fills the response and resolution of the matched same-event pairs
+         * Pairs are taken with the reco split cut and gen qinv below RES_QMAX;
+         * the gen kinematics come from the same kernel, without a split cut.
+         */
+        template<bool Do3D>
+        inline void FillResolution(const MCEvent& ev, const Kernel::PairCuts& cuts, MCOutput& out) {
+            Kernel::PairBlock reco, gen;
+            const int n = ev.recoMatched.size();
+            for (int i = 0; i < n; ++i) {
+                for (int first = i + 1; first < n; first += Kernel::PAIR_BLOCK) {
+                    const int last = std::min(first + Kernel::PAIR_BLOCK, n);
+                    Kernel::ComputePairBlockT<Do3D, false>(ev.genMatched, i, ev.genMatched, first, last, cuts, gen);
+                    Kernel::ComputePairBlockT<Do3D, true>(ev.recoMatched, i, ev.recoMatched, first, last, cuts, reco);
+                    for (int k = 0; k < reco.n; ++k) {
+                        if (cuts.rejectSplit && reco.split[k]) continue;
+                        const double qgen = gen.qinv[k];
+                        if (!(qgen < RES_QMAX)) continue;
+                        out.hQinvResponse->Fill(qgen, reco.qinv[k]);
+                        out.hQinvResolution->Fill(qgen, reco.qinv[k] - qgen);
+                        if constexpr (Do3D) {
+                            out.hQoutResolution->Fill(gen.qout[k], reco.qout[k] - gen.qout[k]);
+                            out.hQsideResolution->Fill(gen.qside[k], reco.qside[k] - gen.qside[k]);
+                            out.hQlongResolution->Fill(gen.qlong[k], reco.qlong[k] - gen.qlong[k]);
+                        }
+                    }
+                }
+            }
+        }
+
+    } // namespace MC
+} // namespace HBT
+
+#endif // HBT_MC_MATCHING_H
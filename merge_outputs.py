@@ -0,0 +1,148 @@
+#!/usr/bin/env python
+
+import json
+import optparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+from concurrent.futures import ThreadPoolExecutor
+
+''' Parallel merge of correlation_XeXe outputs
+
+Merges the job outputs with hadd as a tree: groups of --fanin files are
+merged by up to -j hadd processes at once, then the partial files are merged
+the same way until one file is left. The event counts of the result
+(entries and passing events of perf/counters, entries of centrality_loop in
+the top directory and in each systematic directory) are compared with the
+sum over the inputs, and with --plan also with the entries of the work
+units, so a missing or duplicated job is caught before the analysis.
+Mean-valued perf histograms (pair_time_vs_mult) are summed by hadd like the
+others and are not meaningful in the merged file.
+'''
+
+COUNTERS = ["entries_read", "events_passed"]
+
+
+def event_counts(path):
+    ''' Event counts of one output: perf counters and centrality_loop entries per directory '''
+    import ROOT
+    ROOT.gErrorIgnoreLevel = ROOT.kError
+    f = ROOT.TFile.Open(path)
+    if not f or f.IsZombie():
+        raise RuntimeError(f"Could not open {path}")
+    counts = {}
+    directories = [("", f)]
+    for key in f.GetListOfKeys():
+        if key.GetClassName() == "TDirectoryFile" and key.GetName() != "perf":
+            directories.append((key.GetName() + "/", f.Get(key.GetName())))
+    for prefix, d in directories:
+        h = d.Get("centrality_loop")
+        if h:
+            counts[prefix + "centrality_loop"] = int(round(h.GetEntries()))
+        c = d.Get("perf/counters")
+        if c:
+            for name in COUNTERS:
+                b = c.GetXaxis().FindFixBin(name)
+                counts[prefix + name] = int(round(c.GetBinContent(b)))
+    f.Close()
+    return counts
+
+
+def hadd(target, sources):
+    ''' Merges sources into target; returns (target, hadd return code, output) '''
+    proc = subprocess.run(["hadd", "-f", "-k", target] + sources,
+                          stdout=subprocess.PIPE, stderr=subprocess.STDOUT, universal_newlines=True)
+    return target, proc.returncode, proc.stdout
+
+
+def main():
+    usage = 'usage: %prog -o merged.root [options] job outputs (or -l list)'
+    parser = optparse.OptionParser(usage)
+    parser.add_option('-o', '--output', dest='output', help='merged output (.root)', default='', type='string')
+    parser.add_option('-l', '--list', dest='inlist', help='text list of outputs, one per line', default='', type='string')
+    parser.add_option('-j', '--jobs', dest='nproc', help='hadd processes run at once', default=os.cpu_count() or 1, type='int')
+    parser.add_option('--fanin', dest='fanin', help='files merged by one hadd', default='8', type='int')
+    parser.add_option('--plan', dest='plan', help='plan from plan_jobs.py: check the merged entries against its units', default='', type='string')
+    parser.add_option('--tmpdir', dest='tmpdir', help='directory of the partial merges (default: next to the output)', default='', type='string')
+
+    (opt, args) = parser.parse_args()
+
+    inputs = list(args)
+    if opt.inlist:
+        with open(opt.inlist) as listfile:
+            inputs += [l.strip() for l in listfile if l.strip() and not l.strip().startswith('#')]
+    if not opt.output or not inputs:
+        parser.error("an output and at least one input are required")
+    missing = [p for p in inputs if not os.path.exists(p)]
+    if missing:
+        sys.exit(f"Error: {len(missing)} input(s) do not exist, first: {missing[0]}")
+    fanin = max(2, opt.fanin)
+    print(f"Merging {len(inputs)} files into {opt.output} ({opt.nproc} hadd at once, fan-in {fanin})")
+
+    ''' Expected counts: sum over the inputs '''
+    with ThreadPoolExecutor(max_workers=max(1, opt.nproc)) as pool:
+        input_counts = list(pool.map(event_counts, inputs))
+    expected = {}
+    for counts in input_counts:
+        for name, n in counts.items():
+            expected[name] = expected.get(name, 0) + n
+
+    ''' Tree of hadd: each level merges groups of fanin files in parallel '''
+    tmpdir = tempfile.mkdtemp(prefix="hbt_merge_", dir=opt.tmpdir or os.path.dirname(os.path.abspath(opt.output)))
+    level = 0
+    current = inputs
+    try:
+        while len(current) > 1:
+            groups = [current[i:i + fanin] for i in range(0, len(current), fanin)]
+            targets = [os.path.join(tmpdir, f"level{level}_{g}.root") for g in range(len(groups))]
+            with ThreadPoolExecutor(max_workers=max(1, opt.nproc)) as pool:
+                results = list(pool.map(hadd, targets, groups))
+            for target, code, output in results:
+                if code != 0:
+                    sys.exit(f"Error: hadd failed for {target}:\n{output}")
+            # Partial files of the previous level are no longer needed
+            for path in current:
+                if path.startswith(tmpdir):
+                    os.remove(path)
+            print(f"Level {level}: {len(current)} -> {len(targets)} files")
+            current = targets
+            level += 1
+        if current[0].startswith(tmpdir):
+            shutil.move(current[0], opt.output)
+        else:
+            shutil.copyfile(current[0], opt.output)
+    finally:
+        shutil.rmtree(tmpdir, ignore_errors=True)
+
+    ''' Check the event counts of the merged file '''
+    merged = event_counts(opt.output)
+    failed = False
+    for name in sorted(expected):
+        if merged.get(name) != expected[name]:
+            print(f"Mismatch: {name} = {merged.get(name)} in the merged file, {expected[name]} summed over the inputs")
+            failed = True
+    if opt.plan:
+        with open(opt.plan) as fplan:
+            plan = json.load(fplan)
+        planned = sum(u["entries"] for u in plan["units"])
+        # Multi-systematic outputs count entries once per variant directory; any of them will do
+        read = next((n for name, n in sorted(merged.items()) if name.endswith("entries_read")), None)
+        if read is None:
+            print("Warning: no perf/counters in the outputs, entries not checked against the plan")
+        elif read != planned:
+            print(f"Mismatch: {read} entries read, {planned} entries in the {len(plan['units'])} units of {opt.plan}")
+            failed = True
+        if len(inputs) != len(plan["units"]):
+            print(f"Warning: {len(inputs)} outputs for {len(plan['units'])} work units")
+    if failed:
+        sys.exit(1)
+    for name in COUNTERS + ["centrality_loop"]:
+        if name in merged:
+            print(f"{name}: {merged[name]}")
+    print(f"Merged output: {opt.output}")
+
+
+if __name__ == '__main__':
+    main()
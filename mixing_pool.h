@@ -0,0 +1,304 @@
+#ifndef MIXING_POOL_H
+#define MIXING_POOL_H
+
+#include "pair_kernel.h"
+#include <vector>
+#include <unordered_map>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+
+/**
+ * @file mixing_pool.h
+ * @brief Streaming, bounded event-mixing pool
+ *
+ * One ring buffer per (centrality/multiplicity bin, vz bin), holding the
+ * last n_mix_events accepted events of that bin. A new event is mixed
+ * against its bucket right away and then replaces the oldest entry, so
+ * peak memory is bounded by (#buckets x n_mix_events) events instead of
+ * growing with the dataset. Slots hold shared pointers to immutable
+ * events: copying a pool copies pointers, which is how the event loop
+ * hands the pool from one chunk to the next (PoolHandoff).
+ */
+
+namespace HBT {
+    namespace Mixing {
+
+        /**
+         * @brief One event held in the pool
+         */
+        struct PooledEvent {
+            double cent = 0;
+            float vz = 0;
+            Kernel::TrackSoA tracks;
+            std::vector<int> cells;   // Cell offsets when tracks are cell-sorted (pair_pruning.h)
+        };
+
+        /**
+         * @brief Writes a PooledEvent with a checkpoint writer (checkpoint.h)
+         */
+        template<typename Out>
+        void SavePooledEvent(Out& out, const PooledEvent& ev) {
+            out.Write(ev.cent);
+            out.Write(ev.vz);
+            const Kernel::TrackSoA& t = ev.tracks;
+            for (const auto* column : {&t.px, &t.py, &t.pz, &t.E, &t.pt, &t.p, &t.weight}) out.WriteVector(*column);
+            out.WriteVector(t.charge);
+            out.WriteVector(ev.cells);
+        }
+
+        template<typename In>
+        void LoadPooledEvent(In& in, PooledEvent& ev) {
+            in.Read(ev.cent);
+            in.Read(ev.vz);
+            Kernel::TrackSoA& t = ev.tracks;
+            for (auto* column : {&t.px, &t.py, &t.pz, &t.E, &t.pt, &t.p, &t.weight}) in.ReadVector(*column);
+            in.ReadVector(t.charge, t.px.size());
+            in.ReadVector(ev.cells);
+        }
+
+        /**
+         * @brief Pool of events of type EventT (PooledEvent or any type with
+         *        tracks.px for memory accounting)
+         */
+        template<typename EventT>
+        class BasicMixingPool {
+        public:
+            using EventPtr = std::shared_ptr<const EventT>;
+
+            /**
+             * @param depth Events kept per bucket (n_mix_events)
+             * @param cent_window Width of a centrality/multiplicity bin (cent_mult_window)
+             * @param vz_window Width of a vz bin (cm)
+             */
+            BasicMixingPool(int depth, double cent_window, double vz_window)
+                : depth_(depth > 0 ? depth : 1),
+                  cent_window_(cent_window > 0 ? cent_window : 1.0),
+                  vz_window_(vz_window > 0 ? vz_window : 1.0) {}
+
+            /**
+             * @brief Bucket key of an event
+             */
+            std::int64_t BucketKey(double cent, float vz) const {
+                std::int64_t icent = static_cast<std::int64_t>(std::floor(cent / cent_window_));
+                std::int64_t ivz = static_cast<std::int64_t>(std::floor(vz / vz_window_));
+                return (icent << 32) ^ (ivz & 0xffffffffLL);
+            }
+
+            /**
+             * @brief Calls mix(partner) for every stored event of the bucket, newest first
+             * @return Number of partner events
+             */
+            template<typename MixFunction>
+            int ForEachPartner(double cent, float vz, MixFunction&& mix) const {
+                auto it = buckets_.find(BucketKey(cent, vz));
+                if (it == buckets_.end()) return 0;
+                const Bucket& bucket = it->second;
+                for (int n = 0; n < bucket.count; ++n) {
+                    mix(*bucket.slots[(bucket.head - 1 - n + depth_) % depth_]);
+                }
+                return bucket.count;
+            }
+
+            /**
+             * @brief Stores an event in its bucket in place of the oldest one
+             */
+            void Push(double cent, float vz, EventPtr event) {
+                PushKey(BucketKey(cent, vz), std::move(event));
+            }
+
+            /**
+             * @brief Mixes an event with its bucket (newest first), then stores it
+             * @param mix Called as mix(partner) for every stored event of the bucket
+             * @return Number of partner events
+             */
+            template<typename MixFunction>
+            int MixAndPush(double cent, float vz, EventPtr event, MixFunction&& mix) {
+                int n_partners = ForEachPartner(cent, vz, std::forward<MixFunction>(mix));
+                Push(cent, vz, std::move(event));
+                return n_partners;
+            }
+
+            /**
+             * @brief Drops all events (they are freed once no other pool holds them)
+             */
+            void Clear() { buckets_.clear(); }
+
+            std::size_t NumBuckets() const { return buckets_.size(); }
+
+            std::size_t NumEvents() const {
+                std::size_t n = 0;
+                for (const auto& kv : buckets_) n += kv.second.count;
+                return n;
+            }
+
+            /**
+             * @brief Approximate heap memory held by the stored track columns
+             */
+            std::size_t MemoryBytes() const {
+                std::size_t bytes = 0;
+                for (const auto& kv : buckets_) {
+                    for (const EventPtr& ev : kv.second.slots) {
+                        if (ev) bytes += ev->tracks.px.capacity() * (7 * sizeof(double) + sizeof(int));
+                    }
+                }
+                return bytes;
+            }
+
+            /**
+             * @brief Writes every bucket, oldest event first (checkpoint.h writer)
+             * @param save Called as save(out, event)
+             */
+            template<typename Out, typename SaveFunction>
+            void Save(Out& out, SaveFunction&& save) const {
+                out.Write(std::uint64_t(buckets_.size()));
+                for (const auto& kv : buckets_) {
+                    const Bucket& bucket = kv.second;
+                    out.Write(kv.first);
+                    out.Write(std::int32_t(bucket.count));
+                    for (int n = bucket.count - 1; n >= 0; --n) {
+                        save(out, *bucket.slots[(bucket.head - 1 - n + depth_) % depth_]);
+                    }
+                }
+            }
+
+            /**
+             * @brief Replaces the content with a pool written by Save
+             * @param load Called as load(in, event) on a new event
+             */
+            template<typename In, typename LoadFunction>
+            void Load(In& in, LoadFunction&& load) {
+                Clear();
+                std::uint64_t n_buckets = 0;
+                in.Read(n_buckets);
+                for (std::uint64_t b = 0; b < n_buckets; ++b) {
+                    std::int64_t key = 0;
+                    std::int32_t count = 0;
+                    in.Read(key);
+                    in.Read(count);
+                    for (std::int32_t n = 0; n < count; ++n) {
+                        std::shared_ptr<EventT> ev = std::make_shared<EventT>();
+                        load(in, *ev);
+                        PushKey(key, std::move(ev));
+                    }
+                }
+            }
+
+        private:
+            struct Bucket {
+                std::vector<EventPtr> slots;
+                int head = 0;   // Next slot to overwrite
+                int count = 0;  // Valid events
+            };
+
+            void PushKey(std::int64_t key, EventPtr event) {
+                Bucket& bucket = buckets_[key];
+                if (bucket.slots.empty()) bucket.slots.resize(depth_);
+                bucket.slots[bucket.head] = std::move(event);
+                bucket.head = (bucket.head + 1) % depth_;
+                if (bucket.count < depth_) ++bucket.count;
+            }
+
+            int depth_;
+            double cent_window_;
+            double vz_window_;
+            std::unordered_map<std::int64_t, Bucket> buckets_;
+        };
+
+        using MixingPool = BasicMixingPool<PooledEvent>;
+
+        /**
+         * @brief Passes the pool state from chunk to chunk, in chunk order
+         * Chunk c mixes against the state left by the chunks before it. Its
+         * worker gets that state with Take(c), which waits until the worker of
+         * chunk c - 1 has published it with Publish(c, ...). Chunks marked as
+         * starts (first chunk, first chunk of a segment) begin from an empty
+         * state. A published state is kept until Retire(c), so the driver can
+         * still read it for a checkpoint.
+         */
+        template<typename StateT>
+        class PoolHandoff {
+        public:
+            /**
+             * @param empty State of a chunk that starts a mixing sequence
+             * @param starts Per chunk: nonzero if it starts from the empty state
+             */
+            PoolHandoff(StateT empty, std::vector<char> starts)
+                : empty_(std::move(empty)), starts_(std::move(starts)) {}
+
+            /**
+             * @brief Copies the state chunk c starts from into state, waiting for it if needed
+             * @return false if Abort was called first (state unchanged)
+             */
+            bool Take(std::int64_t c, StateT& state) {
+                if (starts_[c]) {
+                    state = empty_;
+                    return true;
+                }
+                std::unique_lock<std::mutex> lock(mutex_);
+                cv_.wait(lock, [&] { return aborted_ || states_.count(c) > 0; });
+                if (aborted_) return false;
+                state = states_.at(c);
+                return true;
+            }
+
+            /**
+             * @brief Publishes the state chunk c starts from (dropped for starts and past the end)
+             */
+            void Publish(std::int64_t c, StateT state) {
+                if (c >= std::int64_t(starts_.size()) || starts_[c]) return;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    states_.emplace(c, std::move(state));
+                }
+                cv_.notify_all();
+            }
+
+            /**
+             * @brief Copies the published state of chunk c
+             * @return false if it is not published (or c starts empty)
+             */
+            bool Get(std::int64_t c, StateT& state) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = states_.find(c);
+                if (it == states_.end()) return false;
+                state = it->second;
+                return true;
+            }
+
+            /**
+             * @brief Frees the state of chunk c once it is taken and no longer needed
+             */
+            void Retire(std::int64_t c) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                states_.erase(c);
+            }
+
+            /**
+             * @brief Wakes all waiting Take calls, which then return false
+             */
+            void Abort() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    aborted_ = true;
+                }
+                cv_.notify_all();
+            }
+
+        private:
+            StateT empty_;
+            std::vector<char> starts_;
+            std::mutex mutex_;
+            std::condition_variable cv_;
+            std::map<std::int64_t, StateT> states_;
+            bool aborted_ = false;
+        };
+
+    } // namespace Mixing
+} // namespace HBT
+
+#endif // MIXING_POOL_H
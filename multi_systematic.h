@@ -0,0 +1,435 @@
+#ifndef MULTI_SYSTEMATIC_H
+#define MULTI_SYSTEMATIC_H
+
+#include "hbt_event_loop.h"
+#include <sstream>
+
+/**
+ * @file multi_systematic.h
+ * @brief Single-pass evaluation of several systematic variations
+ *
+ * Each entry is read once with the loosest track cuts of all requested
+ * variants. Event cuts and track cuts of every variant are evaluated into
+ * bitmasks (bit v = variant v), pair kinematics are computed once, and each
+ * pair is filled into every variant whose bit is set for the event and for
+ * both tracks, with that variant's efficiency weights and Coulomb scale.
+ * Every variant keeps its own LoopOutput, written to its own directory.
+ * Pool mixing keeps one pool per variant, bucketed by that variant's
+ * centrality and holding only the events it accepts. A partner found in
+ * several variants' pools is mixed once and filled into all of them.
+ */
+
+namespace HBT {
+    namespace MultiSyst {
+
+        // Configuration =======================================================
+        constexpr int MAX_VARIANTS = 32;   // One bit per variant in the masks
+
+        /**
+         * @brief Cuts and corrections of one systematic variation
+         */
+        struct Variant {
+            int systematic = 0;
+            std::string tag;                  // Output directory (GetSystematicTag)
+            HBTQualityCuts qcuts;
+            HBTEventCuts ecuts;
+            std::vector<TH2D*> eff_hists;     // eff, fake, secondary, multiple
+            bool splitCut = true;             // Reject split pairs
+            bool coulomb = false;
+            double coulombScale = 1.0;        // Gamow (G - 1) scale, 1 +/- 0.15
+            int weightColumn = 0;             // Shared by variants with identical eff_hists
+            std::shared_ptr<const Corrections::CorrectionTable> corrections;
+        };
+
+        /**
+         * @brief Builds a variant with the cuts of systematic syst
+         * @param do_coulomb Apply the Gamow weight (forced for 9 and 10)
+         */
+        inline Variant MakeVariant(int syst, const std::string& tag,
+                                   const std::vector<TH2D*>& eff_hists, bool do_coulomb) {
+            Variant v;
+            v.systematic = syst;
+            v.tag = tag;
+            v.qcuts = QualityCutsForSystematic(syst);
+            v.ecuts = EventCutsForSystematic(syst);
+            v.eff_hists = eff_hists;
+            v.coulomb = do_coulomb || syst == 9 || syst == 10;
+            v.coulombScale = Coulomb::VariationScale(CoulombSystematicIndex(syst));
+            return v;
+        }
+
+        /**
+         * @brief Parses a comma-separated list of systematic indices ("0,3,4")
+         * @throws std::runtime_error on a malformed or out-of-range entry
+         */
+        inline std::vector<int> ParseSystematicList(const std::string& list) {
+            std::vector<int> out;
+            std::stringstream ss(list);
+            std::string item;
+            while (std::getline(ss, item, ',')) {
+                if (item.find_first_not_of(" \t") == std::string::npos) continue;
+                std::size_t used = 0;
+                int syst = std::stoi(item, &used);
+                if (item.find_first_not_of(" \t", used) != std::string::npos || syst < 0 || syst > 10) {
+                    throw std::runtime_error("Invalid systematic in list: " + item);
+                }
+                out.push_back(syst);
+            }
+            if (out.size() > static_cast<std::size_t>(MAX_VARIANTS)) {
+                throw std::runtime_error("Too many systematic variants");
+            }
+            return out;
+        }
+
+        /**
+         * @brief Variants with identical efficiency tables share one weight column
+         *        and one flat correction table
+         * @return Number of weight columns
+         */
+        inline int AssignWeightColumns(std::vector<Variant>& variants) {
+            int n_columns = 0;
+            for (std::size_t v = 0; v < variants.size(); ++v) {
+                variants[v].weightColumn = n_columns;
+                for (std::size_t u = 0; u < v; ++u) {
+                    if (variants[u].eff_hists == variants[v].eff_hists) {
+                        variants[v].weightColumn = variants[u].weightColumn;
+                        variants[v].corrections = variants[u].corrections;
+                        break;
+                    }
+                }
+                if (variants[v].weightColumn == n_columns) {
+                    variants[v].corrections = EventLoop::MakeCorrectionTable(variants[v].eff_hists);
+                    ++n_columns;
+                }
+            }
+            return n_columns;
+        }
+
+        /**
+         * @brief One event with the masks and weights of all variants
+         */
+        struct MultiEvent {
+            std::uint32_t eventMask = 0;             // Variants accepting the event
+            float vz = 0;
+            std::vector<double> cent;                // Per variant (shifted hiBin or multiplicity)
+            Kernel::TrackSoA tracks;                 // Union of all variants' tracks
+            std::vector<std::uint32_t> trackMask;    // Per track: variants accepting it
+            std::vector<std::vector<double>> weights;  // [weight column][track]
+        };
+
+        using MultiPool = Mixing::BasicMixingPool<MultiEvent>;
+        using MultiPools = std::vector<MultiPool>;             // One per variant
+        using MultiCarry = Mixing::PoolHandoff<MultiPools>;   // Pools handed from chunk to chunk
+
+        // Worker ==============================================================
+
+        /**
+         * @brief Per-thread state of the multi-systematic loop
+         */
+        class MultiWorker {
+        public:
+            /**
+             * @param variants Variants with weight columns assigned (AssignWeightColumns)
+             */
+            MultiWorker(const EventLoop::RunConfig& cfg, const std::vector<Variant>& variants)
+                : cfg_(cfg), variants_(variants),
+                  pairCuts_(HBTPairCuts(true)),
+                  event_(new HBTEvent()) {
+                // Pair kinematics once for all variants, split flag kept per pair
+                pairCuts_.rejectSplit = false;
+
+                std::vector<HBTQualityCuts> all;
+                for (std::size_t v = 0; v < variants_.size(); ++v) {
+                    all.push_back(variants_[v].qcuts);
+                    out_.emplace_back(new EventLoop::LoopOutput(cfg.do_3d));
+                    if (variants_[v].splitCut) splitCutMask_ |= (1u << v);
+                    if (variants_[v].coulomb) coulombMask_ |= (1u << v);
+                }
+                for (const Variant& v : variants_) {
+                    if (v.weightColumn >= n_columns_) {
+                        n_columns_ = v.weightColumn + 1;
+                        columnTables_.push_back(v.corrections.get());
+                    }
+                }
+                current_.weights.resize(n_columns_);
+
+                event_chain_.reset(new TChain("hiEvtAnalyzer/HiTree"));
+                track_chain_.reset(new TChain("ppTrack/trackTree"));
+                skim_chain_.reset(new TChain("skimanalysis/HltTree"));
+                EventLoop::AddFilesFromList(cfg.input_file, {event_chain_.get(), track_chain_.get(), skim_chain_.get()});
+                bool filters = false;   // Filter branches required only if some variant uses them
+                for (const Variant& v : variants_) filters = filters || v.ecuts.requireFilters;
+                reader_.reset(new HBTTreeReader(event_chain_.get(), track_chain_.get(),
+                                                 filters ? skim_chain_.get() : nullptr,
+                                                 LoosestQualityCuts(all), cfg.is_mc));
+                for (const HBTQualityCuts& q : all) reader_->AlsoReadBranchesFor(q);
+            }
+
+            /**
+             * @brief Processes chunk c, entries [first, last), into the per-variant outputs
+             * @param carry Pool handoff between chunks (pool mixing, else nullptr)
+             */
+            void ProcessChunk(Long64_t c, Long64_t first, Long64_t last, MultiCarry* carry = nullptr) {
+                for (auto& o : out_) o->Reset();
+                chunkEvents_.clear();
+                if (!cfg_.event_index) {
+                    for (Long64_t i = first; i < last; ++i) ProcessEntry(i);
+                } else {
+                    // Entries no variant accepts are never read
+                    std::vector<HBTEventCuts> all;
+                    for (const Variant& v : variants_) all.push_back(v.ecuts);
+                    Index::SelectEntries(*cfg_.event_index, first, last, all, entries_);
+                    for (Long64_t i : entries_) ProcessEntry(i);
+                }
+                if (carry) MixChunk(c, *carry);
+            }
+
+            EventLoop::LoopOutput& Output(std::size_t v) { return *out_[v]; }
+
+        private:
+            void ProcessEntry(Long64_t entry) {
+                if (!reader_->ReadEvent(entry, *event_)) return;
+
+                // Event-level cuts of all variants, without touching the event
+                const std::size_t nv = variants_.size();
+                std::uint32_t eventMask = 0;
+                hiBin_.resize(nv);
+                for (std::size_t v = 0; v < nv; ++v) {
+                    if (EventPassesCuts(*event_, variants_[v].ecuts, hiBin_[v])) eventMask |= (1u << v);
+                }
+                if (!eventMask) return;
+                reader_->ReadTracks(*event_);
+
+                // Track masks and per-column weights for the union of all variants
+                current_.eventMask = eventMask;
+                current_.vz = event_->vz;
+                current_.tracks.clear();
+                current_.tracks.reserve(event_->nTracks);
+                current_.trackMask.clear();
+                for (auto& w : current_.weights) w.clear();
+                std::vector<int> mult(nv, 0);
+                for (int t = 0; t < event_->nTracks; ++t) {
+                    if (Corrections::TrackRangeFlags(event_->pt[t], event_->eta[t])) continue;
+                    std::uint32_t mask = 0;
+                    for (std::size_t v = 0; v < nv; ++v) {
+                        if (PassTrackCuts(*event_, t, variants_[v].qcuts)) {
+                            mask |= (1u << v);
+                            ++mult[v];
+                        }
+                    }
+                    if (!mask) continue;
+                    current_.tracks.push_back_ptetaphi(event_->pt[t], event_->eta[t], event_->phi[t],
+                                                       PI_MASS, event_->charge[t], 1.0);
+                    current_.trackMask.push_back(mask);
+                    for (int c = 0; c < n_columns_; ++c) {
+                        current_.weights[c].push_back(columnTables_[c]->Lookup(event_->pt[t], event_->eta[t]));
+                    }
+                }
+
+                current_.cent.resize(nv);
+                for (std::size_t v = 0; v < nv; ++v) {
+                    current_.cent[v] = cfg_.use_cent ? hiBin_[v] : mult[v];
+                    if (!(eventMask & (1u << v))) continue;
+                    out_[v]->hCentrality->Fill(hiBin_[v]);
+                    out_[v]->hVz->Fill(event_->vz);
+                    out_[v]->hMultiplicity->Fill(mult[v]);
+                    ++out_[v]->n_processed;
+                }
+
+                // Same-event pairs
+                Kernel::ForEachSameEventPair(current_.tracks, pairCuts_,
+                    [&](int i, int j, const Kernel::PairBlock& b, int k) {
+                        FillPair(current_, i, current_, j, eventMask, b, k, false);
+                    });
+
+                // Within-event reference: the partner track inverted or rotated, no pool
+                if (cfg_.do_mixing && cfg_.mixing_mode != EventLoop::MIXING_POOL) {
+                    EventLoop::BuildReference(cfg_.mixing_mode, current_.tracks, reference_);
+                    Kernel::ForEachReferencePair(current_.tracks, reference_, pairCuts_,
+                        [&](int i, int j, const Kernel::PairBlock& b, int k) {
+                            FillPair(current_, i, current_, j, eventMask, b, k, true);
+                        });
+                }
+
+                // Kept for MixChunk, which buckets it by each variant's cent
+                if (EventLoop::PoolMixing(cfg_)) chunkEvents_.push_back(std::make_shared<const MultiEvent>(current_));
+            }
+
+            /**
+             * @brief Stores ev in the pool of every variant accepting it, under that variant's cent
+             */
+            static void PushAll(MultiPools& pools, const std::shared_ptr<const MultiEvent>& ev) {
+                for (std::uint32_t m = ev->eventMask; m; m &= m - 1) {
+                    const int v = __builtin_ctz(m);
+                    pools[v].Push(ev->cent[v], ev->vz, ev);
+                }
+            }
+
+            /**
+             * @brief Mixes the chunk's events, in entry order, with the pools left by the chunks before
+             * Same scheme as EventLoop::Worker::MixChunk. Variant v mixes an event
+             * with the partners in its own bucket of pool v; a partner shared by
+             * several variants is mixed once, with the mask of those variants.
+             */
+            void MixChunk(Long64_t c, MultiCarry& carry) {
+                if (!carry.Take(c, pools_)) return;   // Another chunk failed; this output is never merged
+                MultiPools next = pools_;
+                for (const auto& ev : chunkEvents_) PushAll(next, ev);
+                carry.Publish(c + 1, std::move(next));
+
+                for (const auto& item : chunkEvents_) {
+                    const MultiEvent& ev = *item;
+                    partners_.clear();
+                    for (std::uint32_t m = ev.eventMask; m; m &= m - 1) {
+                        const int v = __builtin_ctz(m);
+                        pools_[v].ForEachPartner(ev.cent[v], ev.vz, [&](const MultiEvent& partner) {
+                            for (auto& p : partners_) {
+                                if (p.first == &partner) {
+                                    p.second |= (1u << v);
+                                    return;
+                                }
+                            }
+                            partners_.emplace_back(&partner, 1u << v);
+                        });
+                    }
+                    // First-seen order, so the fill order does not depend on the thread count
+                    for (const auto& p : partners_) {
+                        const MultiEvent& partner = *p.first;
+                        const std::uint32_t mixMask = p.second;
+                        Kernel::ForEachMixedPair(ev.tracks, partner.tracks, pairCuts_,
+                            [&](int i, int j, const Kernel::PairBlock& b, int k) {
+                                FillPair(ev, i, partner, j, mixMask, b, k, true);
+                            });
+                    }
+                    PushAll(pools_, item);
+                }
+                chunkEvents_.clear();
+            }
+
+            /**
+             * @brief Fills one pair into every variant of mask accepting both tracks
+             */
+            void FillPair(const MultiEvent& a, int i, const MultiEvent& b, int j, std::uint32_t mask,
+                          const Kernel::PairBlock& blk, int k, bool mixed) {
+                mask &= a.trackMask[i] & b.trackMask[j];
+                if (blk.split[k]) mask &= ~splitCutMask_;
+                if (!mask) return;
+
+                const bool isSameSign = (a.tracks.charge[i] * b.tracks.charge[j] > 0);
+                // Gamow excess once; variant v uses 1 + scale_v * (G - 1)
+                double excess = 0.0;
+                if (mask & coulombMask_) excess = Coulomb::DefaultGamowTable().Excess(blk.qinv[k], isSameSign);
+                for (std::uint32_t m = mask; m; m &= m - 1) {
+                    const int v = __builtin_ctz(m);
+                    const Variant& var = variants_[v];
+                    double weight = a.weights[var.weightColumn][i] * b.weights[var.weightColumn][j];
+                    if (var.coulomb) weight *= 1.0 + var.coulombScale * excess;
+                    Accum::PairAccumulators& acc = mixed ? out_[v]->mixed : out_[v]->same;
+                    acc.Fill(isSameSign, blk.qinv[k], blk.kt[k], blk.qout[k], blk.qside[k], blk.qlong[k],
+                             a.cent[v], weight);
+                }
+            }
+
+            const EventLoop::RunConfig& cfg_;
+            const std::vector<Variant>& variants_;
+            Kernel::PairCuts pairCuts_;
+            std::uint32_t splitCutMask_ = 0;
+            std::uint32_t coulombMask_ = 0;
+            int n_columns_ = 0;
+            std::vector<const Corrections::CorrectionTable*> columnTables_;  // One per weight column
+            std::unique_ptr<TChain> event_chain_, track_chain_, skim_chain_;
+            std::unique_ptr<HBTTreeReader> reader_;
+            std::unique_ptr<HBTEvent> event_;
+            std::vector<int> hiBin_;
+            std::vector<Long64_t> entries_;   // Entries of the current chunk passing some variant (event index)
+            MultiEvent current_;
+            Kernel::TrackSoA reference_;      // current_.tracks inverted or rotated (within-event reference)
+            std::vector<std::shared_ptr<const MultiEvent>> chunkEvents_;
+            MultiPools pools_;                // Per-variant pools of the chunk being mixed
+            std::vector<std::pair<const MultiEvent*, std::uint32_t>> partners_;  // Partner, variants mixing it
+            std::vector<std::unique_ptr<EventLoop::LoopOutput>> out_;
+        };
+
+        // Driver ==============================================================
+
+        /**
+         * @brief Runs all variants in one pass over the input on cfg.n_threads threads
+         * @param variants At most MAX_VARIANTS variations (weight columns and tables are assigned here)
+         * @return One run total per variant, merged in chunk order
+         * @throws std::runtime_error for skim run modes, q_window (prune_qmax), pipeline_depth,
+         *         is_mc (no gen-level histograms), checkpoint_path or an invalid variant count
+         */
+        inline std::vector<std::unique_ptr<EventLoop::LoopOutput>> RunMultiSystematic(
+            const EventLoop::RunConfig& config, std::vector<Variant>& variants,
+            Long64_t n_entries, bool quick_test = false) {
+            EventLoop::RunConfig cfg = config;
+            if (variants.empty() || variants.size() > static_cast<std::size_t>(MAX_VARIANTS)) {
+                throw std::runtime_error("Multi-systematic mode needs 1-32 variants");
+            }
+            if (cfg.run_mode != EventLoop::RUN_FULL) {
+                throw std::runtime_error("Multi-systematic mode reads the forests (run_mode 0) only");
+            }
+            if (cfg.prune_qmax > 0 || cfg.pipeline_depth > 0) {
+                throw std::runtime_error("Multi-systematic mode supports neither q_window nor pipeline_depth");
+            }
+            if (cfg.is_mc) {
+                throw std::runtime_error("Multi-systematic mode has no gen-level histograms; run MC one systematic at a time");
+            }
+            if (!cfg.checkpoint_path.empty()) {
+                throw std::runtime_error("Multi-systematic mode does not checkpoint; leave checkpoint_path empty");
+            }
+
+            Long64_t first = cfg.first_entry;
+            Long64_t last = (cfg.last_entry < 0) ? n_entries : std::min(cfg.last_entry, n_entries);
+            if (quick_test) last = std::min(last, first + EventLoop::QUICK_TEST_ENTRIES);
+            Long64_t n_chunks = (last > first)
+                ? (last - first + EventLoop::CHUNK_ENTRIES - 1) / EventLoop::CHUNK_ENTRIES : 0;
+            const int n_threads = std::max(1, cfg.n_threads);
+
+            std::vector<std::unique_ptr<EventLoop::LoopOutput>> totals;
+            for (std::size_t v = 0; v < variants.size(); ++v) totals.emplace_back(new EventLoop::LoopOutput(cfg.do_3d));
+
+            AssignWeightColumns(variants);
+            if (cfg.use_index && !cfg.event_index) cfg.event_index = EventLoop::LoadEventIndex(cfg, n_entries);
+
+            if (n_threads > 1) ROOT::EnableThreadSafety();
+            std::vector<std::unique_ptr<MultiWorker>> workers;
+            for (int t = 0; t < n_threads; ++t) workers.emplace_back(new MultiWorker(cfg, variants));
+
+            // One set of pools over the whole range, as in EventLoop::RunEventLoop
+            std::unique_ptr<MultiCarry> carry;
+            if (EventLoop::PoolMixing(cfg) && n_chunks > 0) {
+                std::vector<char> starts(n_chunks, 0);
+                starts[0] = 1;
+                MultiPools empty(variants.size(), MultiPool(cfg.n_mix_events, cfg.cent_mult_window, cfg.vz_window));
+                carry.reset(new MultiCarry(std::move(empty), std::move(starts)));
+            }
+
+            EventLoop::RunChunks(workers, n_chunks,
+                [&](MultiWorker& worker, Long64_t c) {
+                    Long64_t begin = first + c * EventLoop::CHUNK_ENTRIES;
+                    try {
+                        worker.ProcessChunk(c, begin, std::min(begin + EventLoop::CHUNK_ENTRIES, last), carry.get());
+                    } catch (...) {
+                        if (carry) carry->Abort();   // Chunks waiting for this one's pool give up
+                        throw;
+                    }
+                },
+                [&](MultiWorker& worker, Long64_t c) {
+                    for (std::size_t v = 0; v < variants.size(); ++v) totals[v]->Add(worker.Output(v));
+                    if ((c + 1) % 10 == 0 || c + 1 == n_chunks) {
+                        std::cout << "Processed " << c + 1 << "/" << n_chunks << " chunks ("
+                                  << totals[0]->n_processed << " events, " << variants[0].tag << ")" << std::endl;
+                    }
+                    if (carry) carry->Retire(c);
+                });
+            std::size_t histogram_bytes = 0;
+            for (const auto& total : totals) histogram_bytes += total->MemoryBytes();
+            EventLoop::PrintMemoryReport(histogram_bytes);
+            return totals;
+        }
+
+    } // namespace MultiSyst
+} // namespace HBT
+
+#endif // MULTI_SYSTEMATIC_H
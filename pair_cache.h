@@ -0,0 +1,350 @@
+#ifndef HBT_PAIR_CACHE_H
+#define HBT_PAIR_CACHE_H
+
+#include "pair_kernel.h"
+#include "hbt_skim.h"   // Quantization of pT and η
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/**
+ * @file pair_cache.h
+ * @brief Compact records of the low-q same-event and mixed pairs, for replay
+ *
+ * With a cache threshold, every pair the event loop fills with qinv below it
+ * is also written as one fixed-size PairRecord: quantized q components, kT,
+ * centrality (or multiplicity), the charge combination, the track-weight
+ * product and the (pT, η) of both tracks as efficiency keys. The Gamow
+ * weight is not included. A replay (replay_pair_cache.C) refills any kT and
+ * centrality binning, with or without Coulomb weights and with new efficiency
+ * tables, without the pair loops.
+ *
+ * Layout (native endianness):
+ *   FileHeader
+ *   Block per event-loop chunk, in chunk order:
+ *     BlockHeader
+ *     PairRecord records[n_records]
+ * Workers spool a chunk's records to an anonymous temporary file, so a chunk
+ * may hold more pairs than fit in memory; the spool is appended to the cache
+ * when the chunk is merged.
+ */
+
+namespace HBT {
+    namespace PairCache {
+
+        // Format ==============================================================
+        constexpr char MAGIC[8] = {'H', 'B', 'T', 'P', 'C', 'A', 'C', '1'};
+        constexpr std::uint32_t VERSION = 1;
+        constexpr double Q3D_RANGE = 2.5;   // q_out, q_side, q_long quantized in [-Q3D_RANGE, Q3D_RANGE]
+        constexpr double KT_RANGE = 4.0;    // kT quantized in [0, KT_RANGE] GeV/c
+        constexpr std::size_t SPOOL_RECORDS = 1 << 16;   // Records buffered before a spool write
+
+        // Record flags
+        constexpr std::uint8_t FIRST_POSITIVE = 0x1;
+        constexpr std::uint8_t SECOND_POSITIVE = 0x2;
+        constexpr std::uint8_t MIXED = 0x4;
+
+        struct FileHeader {
+            char magic[8];
+            std::uint32_t version = VERSION;
+            std::int32_t systematic = 0;
+            float qmax = 0;              // Records have qinv < qmax
+            std::int32_t do3D = 0;       // q_out, q_side, q_long filled
+            std::int32_t use_cent = 1;   // cent is hiBin (1) or the track multiplicity (0)
+            std::int32_t complete = 0;   // Set by Close; 0 means the job did not finish
+            std::uint64_t n_blocks = 0;
+            std::uint64_t n_events = 0;
+            std::uint64_t n_same = 0;
+            std::uint64_t n_mixed = 0;
+        };
+
+        struct BlockHeader {
+            std::uint64_t n_records = 0;
+            std::uint32_t chunk = 0;
+            std::uint32_t n_events = 0;
+        };
+
+        /**
+         * @brief One pair, 28 bytes
+         */
+        struct PairRecord {
+            float weight;                        // Track-weight product of the run
+            std::uint16_t qinv;                  // qinv / qmax * 65535
+            std::int16_t qout, qside, qlong;     // Skim::QuantizeSigned(q, Q3D_RANGE)
+            std::uint16_t kt;                    // kT / KT_RANGE * 65535
+            std::uint16_t cent;                  // hiBin or multiplicity
+            std::uint16_t pt1, pt2;              // Skim::QuantizePt
+            std::int16_t eta1, eta2;             // Skim::QuantizeSigned(η, Skim::ETA_RANGE)
+            std::uint8_t flags;                  // FIRST_POSITIVE, SECOND_POSITIVE, MIXED
+            std::uint8_t reserved[3];
+
+            bool SameSign() const { return !(flags & FIRST_POSITIVE) == !(flags & SECOND_POSITIVE); }
+            bool Mixed() const { return flags & MIXED; }
+        };
+        static_assert(sizeof(PairRecord) == 28, "PairRecord layout");
+
+        // Quantization ========================================================
+        inline std::uint16_t QuantizeUnsigned(double x, double range) {
+            double y = std::min(std::max(x / range, 0.0), 1.0);
+            return static_cast<std::uint16_t>(std::lround(y * 65535.0));
+        }
+        inline double DequantizeUnsigned(std::uint16_t q, double range) {
+            return q / 65535.0 * range;
+        }
+
+        // Spool ===============================================================
+
+        /**
+         * @brief Records of one worker's current chunk
+         * Kept in a buffer of SPOOL_RECORDS and spilled to an anonymous
+         * temporary file (removed by the system when closed).
+         */
+        class ChunkSpool {
+        public:
+            ChunkSpool() = default;
+            ~ChunkSpool() { if (file_) std::fclose(file_); }
+            ChunkSpool(const ChunkSpool&) = delete;
+            ChunkSpool& operator=(const ChunkSpool&) = delete;
+
+            /**
+             * @brief Records a pair of the event loop
+             * @param a, b Tracks of the pair (a == b for same-event pairs)
+             * @param cent Centrality or multiplicity of the event
+             */
+            template<bool Do3D>
+            void Add(const Kernel::TrackSoA& a, int i, const Kernel::TrackSoA& b, int j,
+                     const Kernel::PairBlock& blk, int k, double cent, bool mixed) {
+                PairRecord r;
+                r.weight = static_cast<float>(a.weight[i] * b.weight[j]);
+                r.qinv = QuantizeUnsigned(blk.qinv[k], qmax_);
+                if constexpr (Do3D) {
+                    r.qout = Skim::QuantizeSigned(blk.qout[k], Q3D_RANGE);
+                    r.qside = Skim::QuantizeSigned(blk.qside[k], Q3D_RANGE);
+                    r.qlong = Skim::QuantizeSigned(blk.qlong[k], Q3D_RANGE);
+                } else {
+                    r.qout = r.qside = r.qlong = 0;
+                }
+                r.kt = QuantizeUnsigned(blk.kt[k], KT_RANGE);
+                r.cent = static_cast<std::uint16_t>(std::min(std::max(std::lround(cent), 0L), 65535L));
+                r.pt1 = Skim::QuantizePt(a.pt[i]);
+                r.pt2 = Skim::QuantizePt(b.pt[j]);
+                r.eta1 = Skim::QuantizeSigned(std::asinh(a.pz[i] / a.pt[i]), Skim::ETA_RANGE);
+                r.eta2 = Skim::QuantizeSigned(std::asinh(b.pz[j] / b.pt[j]), Skim::ETA_RANGE);
+                r.flags = (a.charge[i] > 0 ? FIRST_POSITIVE : 0) | (b.charge[j] > 0 ? SECOND_POSITIVE : 0)
+                        | (mixed ? MIXED : 0);
+                std::memset(r.reserved, 0, sizeof(r.reserved));
+                buffer_.push_back(r);
+                ++(mixed ? n_mixed_ : n_same_);
+                if (buffer_.size() >= SPOOL_RECORDS) Spill();
+            }
+
+            void SetThreshold(double qmax) { qmax_ = qmax; }
+            void CountEvent() { ++n_events_; }
+
+            std::uint64_t NumRecords() const { return n_same_ + n_mixed_; }
+
+            /**
+             * @brief Drops the records (start of a chunk)
+             */
+            void Clear() {
+                buffer_.clear();
+                if (file_) {
+                    std::fclose(file_);
+                    file_ = nullptr;
+                }
+                n_same_ = n_mixed_ = n_events_ = 0;
+            }
+
+        private:
+            friend class CacheWriter;
+
+            void Spill() {
+                if (!file_) file_ = std::tmpfile();
+                if (!file_ || std::fwrite(buffer_.data(), sizeof(PairRecord), buffer_.size(), file_) != buffer_.size()) {
+                    throw std::runtime_error("Could not spool pair records to a temporary file");
+                }
+                buffer_.clear();
+            }
+
+            double qmax_ = 1;
+            std::vector<PairRecord> buffer_;
+            std::FILE* file_ = nullptr;
+            std::uint64_t n_same_ = 0, n_mixed_ = 0, n_events_ = 0;
+        };
+
+        // Writer ==============================================================
+        class CacheWriter {
+        public:
+            /**
+             * @throws std::runtime_error if the file cannot be created or the header written
+             */
+            CacheWriter(const std::string& path, int systematic, double qmax, bool do3D, bool use_cent)
+                : path_(path) {
+                std::memcpy(header_.magic, MAGIC, sizeof(MAGIC));
+                header_.systematic = systematic;
+                header_.qmax = static_cast<float>(qmax);
+                header_.do3D = do3D;
+                header_.use_cent = use_cent;
+                file_ = std::fopen(path.c_str(), "wb");
+                if (!file_) throw std::runtime_error("Could not create pair cache: " + path);
+                Put(&header_, sizeof(header_));
+                if (!ok_) {
+                    std::fclose(file_);
+                    file_ = nullptr;
+                    throw std::runtime_error("Could not write pair cache: " + path);
+                }
+            }
+
+            /**
+             * @brief Closes a writer that was not closed, e.g. after an exception; the file stays incomplete
+             */
+            ~CacheWriter() {
+                if (file_) std::fclose(file_);
+            }
+
+            /**
+             * @brief Appends the records of chunk c as one block, then clears the spool
+             * @throws std::runtime_error on I/O errors
+             */
+            void WriteChunk(std::uint32_t c, ChunkSpool& spool) {
+                BlockHeader bh;
+                bh.n_records = spool.NumRecords();
+                bh.chunk = c;
+                bh.n_events = static_cast<std::uint32_t>(spool.n_events_);
+                Put(&bh, sizeof(bh));
+                if (spool.file_) {
+                    std::rewind(spool.file_);
+                    std::vector<char> copy(1 << 20);
+                    std::size_t n;
+                    while (ok_ && (n = std::fread(copy.data(), 1, copy.size(), spool.file_)) > 0) Put(copy.data(), n);
+                    if (std::ferror(spool.file_)) ok_ = false;
+                }
+                Put(spool.buffer_.data(), spool.buffer_.size() * sizeof(PairRecord));
+                if (!ok_) throw std::runtime_error("Could not write pair cache block: " + path_);
+                ++header_.n_blocks;
+                header_.n_events += spool.n_events_;
+                header_.n_same += spool.n_same_;
+                header_.n_mixed += spool.n_mixed_;
+                spool.Clear();
+            }
+
+            /**
+             * @brief Rewrites the header with the final counts and closes the file
+             * The header is marked complete only after every block was flushed.
+             * @throws std::runtime_error if any write, the flush, the seek or the close failed
+             */
+            void Close() {
+                if (!file_) return;
+                if (std::fflush(file_) != 0) ok_ = false;
+                if (ok_) {
+                    header_.complete = 1;
+                    if (std::fseek(file_, 0, SEEK_SET) != 0) ok_ = false;
+                    Put(&header_, sizeof(header_));
+                }
+                if (std::fclose(file_) != 0) ok_ = false;
+                file_ = nullptr;
+                if (!ok_) throw std::runtime_error("Could not write pair cache: " + path_);
+            }
+
+            const FileHeader& Header() const { return header_; }
+
+        private:
+            void Put(const void* data, std::size_t n) {
+                if (ok_ && n && std::fwrite(data, 1, n, file_) != n) ok_ = false;
+            }
+
+            std::string path_;
+            FileHeader header_;
+            std::FILE* file_ = nullptr;
+            bool ok_ = true;
+        };
+
+        // Memory-mapped Reader ================================================
+
+        /**
+         * @brief Records of one block inside the mapping
+         */
+        struct BlockView {
+            std::uint32_t chunk = 0;
+            std::uint32_t n_events = 0;
+            std::uint64_t n_records = 0;
+            const PairRecord* records = nullptr;
+        };
+
+        class CacheFile {
+        public:
+            /**
+             * @throws std::runtime_error if the file cannot be mapped, is not a
+             *         pair cache or was not closed by its job
+             */
+            explicit CacheFile(const std::string& path) {
+                int fd = ::open(path.c_str(), O_RDONLY);
+                if (fd < 0) throw std::runtime_error("Could not open pair cache: " + path);
+                struct stat st;
+                size_ = (::fstat(fd, &st) == 0) ? static_cast<std::size_t>(st.st_size) : 0;
+                void* map = (size_ >= sizeof(FileHeader)) ? ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+                ::close(fd);
+                if (map == MAP_FAILED) throw std::runtime_error("Could not map pair cache: " + path);
+                base_ = static_cast<const char*>(map);
+                // The destructor does not run if the constructor throws, so the mapping is released here
+                try {
+                    ::madvise(const_cast<char*>(base_), size_, MADV_SEQUENTIAL);
+                    std::memcpy(&header_, base_, sizeof(header_));
+                    if (std::memcmp(header_.magic, MAGIC, sizeof(MAGIC)) != 0 || header_.version != VERSION) {
+                        throw std::runtime_error("Not an HBT pair cache: " + path);
+                    }
+                    if (!header_.complete) throw std::runtime_error("Incomplete pair cache (job did not finish): " + path);
+                    IndexBlocks();
+                } catch (...) {
+                    ::munmap(const_cast<char*>(base_), size_);
+                    base_ = nullptr;
+                    throw;
+                }
+            }
+
+            ~CacheFile() { if (base_) ::munmap(const_cast<char*>(base_), size_); }
+            CacheFile(const CacheFile&) = delete;
+            CacheFile& operator=(const CacheFile&) = delete;
+
+            const FileHeader& Header() const { return header_; }
+            std::size_t NumBlocks() const { return blocks_.size(); }
+            const BlockView& Block(std::size_t b) const { return blocks_[b]; }
+
+            double Qinv(const PairRecord& r) const { return DequantizeUnsigned(r.qinv, header_.qmax); }
+
+        private:
+            void IndexBlocks() {
+                std::size_t pos = sizeof(FileHeader);
+                for (std::uint64_t b = 0; b < header_.n_blocks; ++b) {
+                    if (pos + sizeof(BlockHeader) > size_) throw std::runtime_error("Truncated pair cache");
+                    BlockHeader bh;
+                    std::memcpy(&bh, base_ + pos, sizeof(bh));
+                    pos += sizeof(BlockHeader);
+                    if (pos + bh.n_records * sizeof(PairRecord) > size_) throw std::runtime_error("Truncated pair cache");
+                    BlockView v;
+                    v.chunk = bh.chunk;
+                    v.n_events = bh.n_events;
+                    v.n_records = bh.n_records;
+                    v.records = reinterpret_cast<const PairRecord*>(base_ + pos);
+                    blocks_.push_back(v);
+                    pos += bh.n_records * sizeof(PairRecord);
+                }
+            }
+
+            const char* base_ = nullptr;
+            std::size_t size_ = 0;
+            FileHeader header_;
+            std::vector<BlockView> blocks_;
+        };
+
+    } // namespace PairCache
+} // namespace HBT
+
+#endif // HBT_PAIR_CACHE_H
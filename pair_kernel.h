@@ -0,0 +1,495 @@
+#ifndef PAIR_KERNEL_H
+#define PAIR_KERNEL_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @file pair_kernel.h
+ * @brief Structure-of-arrays pair engine for the O(N^2) HBT loops
+ *
+ * Each event's accepted tracks are converted once into aligned
+ * px/py/pz/E/pT/|p|/charge/weight arrays. For a reference track the pair
+ * kinematics (qinv, split-pair flag, q_out, q_side, q_long, kT) are then
+ * computed for a whole block of partner tracks at a time, using AVX-512 or
+ * AVX2 when the translation unit is compiled with them (-mavx512f / -mavx2)
+ * and a scalar loop otherwise. The formulas are the ones of CalculateQinv,
+ * IsSplitPair, CalculateQlongLCMS, CalculateQout and CalculateQside in
+ * functions_definition.h, evaluated on the (px, py, pz, E) representation.
+ */
+
+namespace HBT {
+    namespace Kernel {
+
+        // Configuration =======================================================
+        constexpr std::size_t SIMD_ALIGN = 64;  // bytes (one cache line)
+        constexpr int PAIR_BLOCK = 256;         // partner tracks per block
+
+#if defined(__AVX512F__)
+        constexpr int SIMD_WIDTH = 8;
+#elif defined(__AVX2__)
+        constexpr int SIMD_WIDTH = 4;
+#else
+        constexpr int SIMD_WIDTH = 1;
+#endif
+
+        /**
+         * @brief Minimal over-aligned allocator so SoA columns start on a cache line
+         */
+        template<typename T>
+        struct AlignedAllocator {
+            using value_type = T;
+            AlignedAllocator() = default;
+            template<typename U> AlignedAllocator(const AlignedAllocator<U>&) {}
+
+            T* allocate(std::size_t n) {
+                std::size_t bytes = ((n * sizeof(T) + SIMD_ALIGN - 1) / SIMD_ALIGN) * SIMD_ALIGN;
+                void* ptr = std::aligned_alloc(SIMD_ALIGN, bytes ? bytes : SIMD_ALIGN);
+                if (!ptr) throw std::bad_alloc();
+                return static_cast<T*>(ptr);
+            }
+            void deallocate(T* ptr, std::size_t) { std::free(ptr); }
+
+            template<typename U> bool operator==(const AlignedAllocator<U>&) const { return true; }
+            template<typename U> bool operator!=(const AlignedAllocator<U>&) const { return false; }
+        };
+
+        template<typename T>
+        using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+        /**
+         * @brief Pair-level constants passed to the kernel
+         * @note Filled from PI_MASS/COS_CUT/DPT_CUT in functions_definition.h
+         */
+        struct PairCuts {
+            double mass = 0;          // Track mass hypothesis (GeV/c²)
+            double cosCut = 1;        // Split pairs have cos(angle) above this
+            double dptCut = 0;        // ... and |ΔpT| below this (GeV/c)
+            bool rejectSplit = true;  // false keeps split pairs (still flagged in PairBlock::split)
+        };
+
+        // Track Storage =======================================================
+
+        /**
+         * @brief Accepted tracks of one event, one aligned column per quantity
+         */
+        struct TrackSoA {
+            AlignedVector<double> px, py, pz, E, pt, p;
+            AlignedVector<double> weight;
+            AlignedVector<int> charge;
+
+            int size() const { return static_cast<int>(px.size()); }
+
+            void clear() {
+                px.clear(); py.clear(); pz.clear(); E.clear();
+                pt.clear(); p.clear(); weight.clear(); charge.clear();
+            }
+
+            void reserve(std::size_t n) {
+                px.reserve(n); py.reserve(n); pz.reserve(n); E.reserve(n);
+                pt.reserve(n); p.reserve(n); weight.reserve(n); charge.reserve(n);
+            }
+
+            /**
+             * @brief Exchanges columns with another SoA without copying
+             */
+            void swap(TrackSoA& other) {
+                px.swap(other.px); py.swap(other.py); pz.swap(other.pz); E.swap(other.E);
+                pt.swap(other.pt); p.swap(other.p); weight.swap(other.weight); charge.swap(other.charge);
+            }
+
+            /**
+             * @brief Appends one track from its Cartesian momentum
+             * @param mass Mass hypothesis used for the energy (GeV/c²)
+             */
+            void push_back(double tpx, double tpy, double tpz, double mass,
+                           int tcharge, double tweight) {
+                double p2 = tpx*tpx + tpy*tpy + tpz*tpz;
+                px.push_back(tpx);
+                py.push_back(tpy);
+                pz.push_back(tpz);
+                E.push_back(std::sqrt(p2 + mass*mass));
+                pt.push_back(std::sqrt(tpx*tpx + tpy*tpy));
+                p.push_back(std::sqrt(p2));
+                charge.push_back(tcharge);
+                weight.push_back(tweight);
+            }
+
+            /**
+             * @brief Appends one track from (pT, η, φ)
+             */
+            void push_back_ptetaphi(double tpt, double teta, double tphi, double mass,
+                                    int tcharge, double tweight) {
+                push_back(tpt * std::cos(tphi), tpt * std::sin(tphi), tpt * std::sinh(teta),
+                          mass, tcharge, tweight);
+            }
+
+            /**
+             * @brief Appends tracks [begin, end) of another SoA
+             */
+            void Append(const TrackSoA& o, int begin, int end) {
+                px.insert(px.end(), o.px.begin() + begin, o.px.begin() + end);
+                py.insert(py.end(), o.py.begin() + begin, o.py.begin() + end);
+                pz.insert(pz.end(), o.pz.begin() + begin, o.pz.begin() + end);
+                E.insert(E.end(), o.E.begin() + begin, o.E.begin() + end);
+                pt.insert(pt.end(), o.pt.begin() + begin, o.pt.begin() + end);
+                p.insert(p.end(), o.p.begin() + begin, o.p.begin() + end);
+                weight.insert(weight.end(), o.weight.begin() + begin, o.weight.begin() + end);
+                charge.insert(charge.end(), o.charge.begin() + begin, o.charge.begin() + end);
+            }
+
+            /**
+             * @brief Converts generic Lorentz vectors (any ROOT::Math coordinate system)
+             * @note Energy and |p| are taken from the vector itself, not recomputed
+             */
+            template<typename LorentzVec>
+            void Load(const std::vector<LorentzVec>& tracks,
+                      const std::vector<int>& charges,
+                      const std::vector<double>& weights) {
+                clear();
+                reserve(tracks.size());
+                for (std::size_t i = 0; i < tracks.size(); ++i) {
+                    px.push_back(tracks[i].Px());
+                    py.push_back(tracks[i].Py());
+                    pz.push_back(tracks[i].Pz());
+                    E.push_back(tracks[i].E());
+                    pt.push_back(tracks[i].Pt());
+                    p.push_back(tracks[i].P());
+                    charge.push_back(charges[i]);
+                    weight.push_back(weights[i]);
+                }
+            }
+        };
+
+        // Pair Output =========================================================
+
+        /**
+         * @brief Kinematics of one reference track against PAIR_BLOCK partners
+         * Entry k refers to partner track (first + k).
+         */
+        struct PairBlock {
+            alignas(SIMD_ALIGN) double qinv[PAIR_BLOCK];
+            alignas(SIMD_ALIGN) double qout[PAIR_BLOCK];
+            alignas(SIMD_ALIGN) double qside[PAIR_BLOCK];
+            alignas(SIMD_ALIGN) double qlong[PAIR_BLOCK];
+            alignas(SIMD_ALIGN) double kt[PAIR_BLOCK];
+            alignas(SIMD_ALIGN) std::uint8_t split[PAIR_BLOCK];
+            int first = 0;  // Index of the first partner
+            int n = 0;      // Number of valid entries
+        };
+
+        // Instruction Set Wrappers ============================================
+        namespace detail {
+
+            struct ScalarISA {
+                using V = double;
+                static constexpr int W = 1;
+                static V load(const double* x) { return *x; }
+                static void store(double* x, V v) { *x = v; }
+                static V set1(double x) { return x; }
+                static V add(V a, V b) { return a + b; }
+                static V sub(V a, V b) { return a - b; }
+                static V mul(V a, V b) { return a * b; }
+                static V div(V a, V b) { return a / b; }
+                static V sqrt(V a) { return std::sqrt(a); }
+                static V abs(V a) { return std::abs(a); }
+                static V neg(V a) { return -a; }
+                // Select b where a > 0, otherwise c
+                static V select_gt0(V a, V b, V c) { return (a > 0) ? b : c; }
+                static unsigned split_mask(V cosa, V cosCut, V dpt, V dptCut) {
+                    return (cosa > cosCut) && (dpt < dptCut) ? 1u : 0u;
+                }
+            };
+
+#if defined(__AVX2__)
+            struct Avx2ISA {
+                using V = __m256d;
+                static constexpr int W = 4;
+                static V load(const double* x) { return _mm256_loadu_pd(x); }
+                static void store(double* x, V v) { _mm256_storeu_pd(x, v); }
+                static V set1(double x) { return _mm256_set1_pd(x); }
+                static V add(V a, V b) { return _mm256_add_pd(a, b); }
+                static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+                static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+                static V div(V a, V b) { return _mm256_div_pd(a, b); }
+                static V sqrt(V a) { return _mm256_sqrt_pd(a); }
+                static V abs(V a) { return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a); }
+                static V neg(V a) { return _mm256_xor_pd(_mm256_set1_pd(-0.0), a); }
+                static V select_gt0(V a, V b, V c) {
+                    return _mm256_blendv_pd(c, b, _mm256_cmp_pd(a, _mm256_setzero_pd(), _CMP_GT_OQ));
+                }
+                static unsigned split_mask(V cosa, V cosCut, V dpt, V dptCut) {
+                    V m = _mm256_and_pd(_mm256_cmp_pd(cosa, cosCut, _CMP_GT_OQ),
+                                        _mm256_cmp_pd(dpt, dptCut, _CMP_LT_OQ));
+                    return static_cast<unsigned>(_mm256_movemask_pd(m));
+                }
+            };
+#endif
+
+#if defined(__AVX512F__)
+            struct Avx512ISA {
+                using V = __m512d;
+                static constexpr int W = 8;
+                static V load(const double* x) { return _mm512_loadu_pd(x); }
+                static void store(double* x, V v) { _mm512_storeu_pd(x, v); }
+                static V set1(double x) { return _mm512_set1_pd(x); }
+                static V add(V a, V b) { return _mm512_add_pd(a, b); }
+                static V sub(V a, V b) { return _mm512_sub_pd(a, b); }
+                static V mul(V a, V b) { return _mm512_mul_pd(a, b); }
+                static V div(V a, V b) { return _mm512_div_pd(a, b); }
+                static V sqrt(V a) { return _mm512_sqrt_pd(a); }
+                static V abs(V a) { return _mm512_abs_pd(a); }
+                static V neg(V a) { return _mm512_sub_pd(_mm512_setzero_pd(), a); }
+                static V select_gt0(V a, V b, V c) {
+                    return _mm512_mask_blend_pd(_mm512_cmp_pd_mask(a, _mm512_setzero_pd(), _CMP_GT_OQ), c, b);
+                }
+                static unsigned split_mask(V cosa, V cosCut, V dpt, V dptCut) {
+                    __mmask8 m = _mm512_cmp_pd_mask(cosa, cosCut, _CMP_GT_OQ) &
+                                 _mm512_cmp_pd_mask(dpt, dptCut, _CMP_LT_OQ);
+                    return static_cast<unsigned>(m);
+                }
+            };
+#endif
+
+#if defined(__AVX512F__)
+            using NativeISA = Avx512ISA;
+#elif defined(__AVX2__)
+            using NativeISA = Avx2ISA;
+#else
+            using NativeISA = ScalarISA;
+#endif
+
+            /**
+             * @brief Computes lanes [k, k + ISA::W) of a block
+             * @param i Reference track in a
+             * @param j First partner track in b for this step
+             * @tparam Do3D Also compute q_out, q_side, q_long
+             * @tparam Split Also compute the split-pair flag
+             */
+            template<typename ISA, bool Do3D = true, bool Split = true>
+            inline void ComputeLanes(const TrackSoA& a, int i, const TrackSoA& b, int j,
+                                     const PairCuts& cuts, PairBlock& out, int k) {
+                using V = typename ISA::V;
+                const V zero = ISA::set1(0.0);
+                const V half = ISA::set1(0.5);
+                const V two = ISA::set1(2.0);
+
+                const V px1 = ISA::set1(a.px[i]), py1 = ISA::set1(a.py[i]);
+                const V pz1 = ISA::set1(a.pz[i]), e1 = ISA::set1(a.E[i]);
+                const V pt1 = ISA::set1(a.pt[i]), p1 = ISA::set1(a.p[i]);
+
+                const V px2 = ISA::load(&b.px[j]), py2 = ISA::load(&b.py[j]);
+                const V pz2 = ISA::load(&b.pz[j]), e2 = ISA::load(&b.E[j]);
+                const V pt2 = ISA::load(&b.pt[j]), p2 = ISA::load(&b.p[j]);
+
+                // qinv from the invariant mass of the pair
+                V sx = ISA::add(px1, px2), sy = ISA::add(py1, py2);
+                V sz = ISA::add(pz1, pz2), se = ISA::add(e1, e2);
+                V m2 = ISA::sub(ISA::mul(se, se),
+                                ISA::add(ISA::add(ISA::mul(sx, sx), ISA::mul(sy, sy)), ISA::mul(sz, sz)));
+                V q = ISA::sub(m2, ISA::set1(4.0 * cuts.mass * cuts.mass));
+                V sq = ISA::sqrt(ISA::abs(q));
+                ISA::store(&out.qinv[k], ISA::select_gt0(q, sq, ISA::neg(sq)));
+
+                // Split-pair flag
+                if constexpr (Split) {
+                    V dot = ISA::add(ISA::add(ISA::mul(px1, px2), ISA::mul(py1, py2)), ISA::mul(pz1, pz2));
+                    V cosa = ISA::div(dot, ISA::mul(p1, p2));
+                    V dpt = ISA::abs(ISA::sub(pt1, pt2));
+                    unsigned mask = ISA::split_mask(cosa, ISA::set1(cuts.cosCut), dpt, ISA::set1(cuts.dptCut));
+                    for (int l = 0; l < ISA::W; ++l) out.split[k + l] = (mask >> l) & 1u;
+                }
+
+                // kT and the transverse components, normalizing kT only once
+                V kx = ISA::mul(sx, half), ky = ISA::mul(sy, half);
+                V kt = ISA::sqrt(ISA::add(ISA::mul(kx, kx), ISA::mul(ky, ky)));
+                ISA::store(&out.kt[k], kt);
+                if constexpr (!Do3D) return;
+
+                V inv_kt = ISA::select_gt0(kt, ISA::div(ISA::set1(1.0), kt), zero);
+                V qx = ISA::sub(px1, px2), qy = ISA::sub(py1, py2);
+                ISA::store(&out.qout[k], ISA::mul(ISA::add(ISA::mul(qx, kx), ISA::mul(qy, ky)), inv_kt));
+                // At kT = 0 there is no out axis and all of qT is side, as with TVector3::Unit()
+                V qt = ISA::sqrt(ISA::add(ISA::mul(qx, qx), ISA::mul(qy, qy)));
+                ISA::store(&out.qside[k], ISA::select_gt0(kt, ISA::abs(ISA::mul(ISA::sub(ISA::mul(qx, ky), ISA::mul(qy, kx)), inv_kt)), qt));
+
+                // q_long in the LCMS
+                V num = ISA::mul(two, ISA::sub(ISA::mul(pz1, e2), ISA::mul(pz2, e1)));
+                V den = ISA::sqrt(ISA::add(ISA::mul(se, se), ISA::mul(sz, sz)));
+                ISA::store(&out.qlong[k], ISA::select_gt0(den, ISA::abs(ISA::div(num, den)), zero));
+            }
+
+            template<typename ISA, bool Do3D = true, bool Split = true>
+            inline void ComputeBlockImpl(const TrackSoA& a, int i, const TrackSoA& b,
+                                         int first, int last, const PairCuts& cuts, PairBlock& out) {
+                out.first = first;
+                out.n = last - first;
+                int k = 0;
+                for (; k + ISA::W <= out.n; k += ISA::W) {
+                    ComputeLanes<ISA, Do3D, Split>(a, i, b, first + k, cuts, out, k);
+                }
+                for (; k < out.n; ++k) {
+                    ComputeLanes<ScalarISA, Do3D, Split>(a, i, b, first + k, cuts, out, k);
+                }
+            }
+
+        } // namespace detail
+
+        // Pair Counters =======================================================
+
+        /**
+         * @brief Pairs computed and split pairs rejected by the ForEach loops on
+         *        the calling thread; added once per loop call, read by perf_stats.h
+         */
+        struct PairLoopCounters {
+            std::int64_t visited = 0;
+            std::int64_t split = 0;
+        };
+
+        inline PairLoopCounters& ThreadPairCounters() {
+            static thread_local PairLoopCounters counters;
+            return counters;
+        }
+
+        // Kernel Entry Points =================================================
+
+        /**
+         * @brief Pair kinematics of track i of a with partners [first, last) of b
+         * @param last Must satisfy last - first <= PAIR_BLOCK
+         * @note a and b may be the same event (same-event pairs) or two events (mixing)
+         */
+        inline void ComputePairBlock(const TrackSoA& a, int i, const TrackSoA& b,
+                                     int first, int last, const PairCuts& cuts, PairBlock& out) {
+            detail::ComputeBlockImpl<detail::NativeISA>(a, i, b, first, last, cuts, out);
+        }
+
+        /**
+         * @brief ComputePairBlock specialized for the analysis mode
+         * @tparam Do3D false leaves qout/qside/qlong unset
+         * @tparam Split false leaves split unset (no split-pair cut)
+         */
+        template<bool Do3D, bool Split>
+        inline void ComputePairBlockT(const TrackSoA& a, int i, const TrackSoA& b,
+                                      int first, int last, const PairCuts& cuts, PairBlock& out) {
+            detail::ComputeBlockImpl<detail::NativeISA, Do3D, Split>(a, i, b, first, last, cuts, out);
+        }
+
+        /**
+         * @brief Scalar reference implementation, used for validation
+         */
+        inline void ComputePairBlockScalar(const TrackSoA& a, int i, const TrackSoA& b,
+                                           int first, int last, const PairCuts& cuts, PairBlock& out) {
+            detail::ComputeBlockImpl<detail::ScalarISA>(a, i, b, first, last, cuts, out);
+        }
+
+        /**
+         * @brief Visits all accepted pairs (i, j) with i < j of one event, partner j
+         *        taken from reference
+         * @param reference The event's tracks transformed track by track (same
+         *        size and order), e.g. with the momentum inverted
+         * @param visit Called as visit(i, j, block, k) for every non-split pair
+         *        (every pair if cuts.rejectSplit is false)
+         * @tparam Do3D, Split As in ComputePairBlockT; Split = false visits every pair
+         */
+        template<bool Do3D, bool Split, typename Visitor>
+        inline void ForEachReferencePairT(const TrackSoA& tracks, const TrackSoA& reference,
+                                          const PairCuts& cuts, Visitor&& visit) {
+            PairBlock block;
+            std::int64_t n_visited = 0, n_split = 0;
+            const int n = tracks.size();
+            for (int i = 0; i < n; ++i) {
+                for (int first = i + 1; first < n; first += PAIR_BLOCK) {
+                    int last = std::min(first + PAIR_BLOCK, n);
+                    ComputePairBlockT<Do3D, Split>(tracks, i, reference, first, last, cuts, block);
+                    n_visited += block.n;
+                    for (int k = 0; k < block.n; ++k) {
+                        if (Split && cuts.rejectSplit && block.split[k]) { ++n_split; continue; }
+                        visit(i, first + k, block, k);
+                    }
+                }
+            }
+            ThreadPairCounters().visited += n_visited;
+            ThreadPairCounters().split += n_split;
+        }
+
+        template<typename Visitor>
+        inline void ForEachReferencePair(const TrackSoA& tracks, const TrackSoA& reference,
+                                         const PairCuts& cuts, Visitor&& visit) {
+            ForEachReferencePairT<true, true>(tracks, reference, cuts, std::forward<Visitor>(visit));
+        }
+
+        /**
+         * @brief Visits all accepted pairs (i, j) with i < j of one event
+         * @param visit Called as visit(i, j, block, k) for every non-split pair
+         *        (every pair if cuts.rejectSplit is false)
+         * @tparam Do3D, Split As in ComputePairBlockT; Split = false visits every pair
+         */
+        template<bool Do3D, bool Split, typename Visitor>
+        inline void ForEachSameEventPairT(const TrackSoA& tracks, const PairCuts& cuts, Visitor&& visit) {
+            ForEachReferencePairT<Do3D, Split>(tracks, tracks, cuts, std::forward<Visitor>(visit));
+        }
+
+        template<typename Visitor>
+        inline void ForEachSameEventPair(const TrackSoA& tracks, const PairCuts& cuts, Visitor&& visit) {
+            ForEachSameEventPairT<true, true>(tracks, cuts, std::forward<Visitor>(visit));
+        }
+
+        /**
+         * @brief Visits all accepted pairs (i, j) with i in [aBegin, aEnd) of a
+         *        and j in [bBegin, bEnd) of b
+         * @note Lets several events share one SoA arena without copies
+         */
+        template<bool Do3D, bool Split, typename Visitor>
+        inline void ForEachMixedPairT(const TrackSoA& a, int aBegin, int aEnd,
+                                      const TrackSoA& b, int bBegin, int bEnd,
+                                      const PairCuts& cuts, Visitor&& visit) {
+            PairBlock block;
+            std::int64_t n_visited = 0, n_split = 0;
+            for (int i = aBegin; i < aEnd; ++i) {
+                for (int first = bBegin; first < bEnd; first += PAIR_BLOCK) {
+                    int last = std::min(first + PAIR_BLOCK, bEnd);
+                    ComputePairBlockT<Do3D, Split>(a, i, b, first, last, cuts, block);
+                    n_visited += block.n;
+                    for (int k = 0; k < block.n; ++k) {
+                        if (Split && cuts.rejectSplit && block.split[k]) { ++n_split; continue; }
+                        visit(i, first + k, block, k);
+                    }
+                }
+            }
+            ThreadPairCounters().visited += n_visited;
+            ThreadPairCounters().split += n_split;
+        }
+
+        template<typename Visitor>
+        inline void ForEachMixedPair(const TrackSoA& a, int aBegin, int aEnd,
+                                     const TrackSoA& b, int bBegin, int bEnd,
+                                     const PairCuts& cuts, Visitor&& visit) {
+            ForEachMixedPairT<true, true>(a, aBegin, aEnd, b, bBegin, bEnd, cuts, std::forward<Visitor>(visit));
+        }
+
+        /**
+         * @brief Visits all accepted pairs (i, j) with i in a and j in b
+         */
+        template<typename Visitor>
+        inline void ForEachMixedPair(const TrackSoA& a, const TrackSoA& b, const PairCuts& cuts, Visitor&& visit) {
+            ForEachMixedPair(a, 0, a.size(), b, 0, b.size(), cuts, std::forward<Visitor>(visit));
+        }
+
+        template<bool Do3D, bool Split, typename Visitor>
+        inline void ForEachMixedPairT(const TrackSoA& a, const TrackSoA& b, const PairCuts& cuts, Visitor&& visit) {
+            ForEachMixedPairT<Do3D, Split>(a, 0, a.size(), b, 0, b.size(), cuts, std::forward<Visitor>(visit));
+        }
+
+    } // namespace Kernel
+} // namespace HBT
+
+#endif // PAIR_KERNEL_H
@@ -0,0 +1,337 @@
+#ifndef PAIR_PRUNING_H
+#define PAIR_PRUNING_H
+
+#include "pair_kernel.h"
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <iterator>
+
+/**
+ * @file pair_pruning.h
+ * @brief Exact momentum-cell pruning of pairs outside a qinv window
+ *
+ * Tracks are counting-sorted into cells of transverse rapidity
+ * rho = asinh(pT/m), rapidity y and azimuth phi. For equal masses
+ *
+ *   qinv^2 / 2m^2 = (cosh(d_rho) - 1) + cosh(rho1) cosh(rho2) (cosh(d_y) - 1)
+ *                 + sinh(rho1) sinh(rho2) (1 - cos(d_phi))
+ *
+ * with three non-negative terms. Minimizing each term over two cells gives a
+ * lower bound on qinv for every pair of tracks in them; cell pairs whose
+ * bound is at or above qmax are never enumerated. Nothing below qmax is
+ * dropped (see PruningMisses for the brute-force check). Surviving partner
+ * cells form at most two contiguous track ranges per (rho, y) row, which go
+ * straight to ComputePairBlock.
+ */
+
+namespace HBT {
+    namespace Kernel {
+
+        // Configuration =======================================================
+        constexpr double PRUNE_Y_MAX = 2.4;     // y cells span [-PRUNE_Y_MAX, PRUNE_Y_MAX], outer cells open
+        constexpr double PRUNE_MARGIN = 1e-6;   // Relative safety margin on the bound
+
+        /**
+         * @brief Cell geometry and the per-term lower-bound tables for one qinv window
+         */
+        class CellGrid {
+        public:
+            /**
+             * @param qmax Upper edge of the qinv window (GeV/c); pairs below it are kept
+             * @param mass Track mass hypothesis (PairCuts::mass)
+             * @param nY, nPhi Rapidity and azimuth cells
+             * @param ptEdges pT cell edges (GeV/c); below the first edge is one more
+             *        cell starting at 0 (empty after the MIN_HBT_PT cut), the last is open
+             */
+            CellGrid(double qmax, double mass, int nY = 24, int nPhi = 32,
+                     const std::vector<double>& ptEdges = {0.15, 0.2, 0.25, 0.3, 0.4, 0.5,
+                                                           0.65, 0.8, 1.0, 1.3, 1.7, 2.5})
+                : qmax_(qmax), mass_(mass),
+                  threshold_(qmax * qmax / (2.0 * mass * mass) * (1.0 + PRUNE_MARGIN)),
+                  nY_(std::max(1, nY)), nPhi_(std::max(1, nPhi)),
+                  yWidth_(2.0 * PRUNE_Y_MAX / nY_),
+                  phiWidth_(2.0 * M_PI / nPhi_) {
+                rhoEdges_.push_back(0.0);
+                for (double pt : ptEdges) rhoEdges_.push_back(std::asinh(pt / mass));
+                nRho_ = static_cast<int>(rhoEdges_.size());
+
+                // term1: cosh of the rho gap between cells, minus 1
+                term1_.assign(nRho_ * nRho_, 0.0);
+                for (int a = 0; a < nRho_; ++a) {
+                    for (int b = 0; b < nRho_; ++b) {
+                        int lo = std::min(a, b), hi = std::max(a, b);
+                        double gap = (lo == hi) ? 0.0 : rhoEdges_[hi] - rhoEdges_[lo + 1];
+                        term1_[a * nRho_ + b] = std::cosh(gap) - 1.0;
+                    }
+                }
+                // cosh(y gap) - 1 and 1 - cos(phi gap) per cell distance
+                for (int d = 0; d < nY_; ++d) {
+                    yTerm_.push_back(d <= 1 ? 0.0 : std::cosh((d - 1) * yWidth_) - 1.0);
+                }
+                for (int d = 0; d <= nPhi_ / 2; ++d) {
+                    double gap = std::min(M_PI, d <= 1 ? 0.0 : (d - 1) * phiWidth_);
+                    phiTerm_.push_back(1.0 - std::cos(gap));
+                }
+
+                partners_.resize(NumCells());
+                for (int c = 0; c < NumCells(); ++c) BuildPartnerCells(c, partners_[c]);
+            }
+
+            int NumCells() const { return nRho_ * nY_ * nPhi_; }
+            int NumRhoCells() const { return nRho_; }
+            double QMax() const { return qmax_; }
+
+            /**
+             * @brief Cell of a track, ordered (rho, y, phi) with phi fastest
+             */
+            int CellOf(const TrackSoA& t, int i) const {
+                double rho = std::asinh(t.pt[i] / mass_);
+                int ir = int(std::upper_bound(rhoEdges_.begin() + 1, rhoEdges_.end(), rho) - rhoEdges_.begin()) - 1;
+                double y = 0.5 * std::log((t.E[i] + t.pz[i]) / (t.E[i] - t.pz[i]));
+                int iy = std::clamp(int(std::floor((y + PRUNE_Y_MAX) / yWidth_)), 0, nY_ - 1);
+                double phi = std::atan2(t.py[i], t.px[i]) + M_PI;
+                int ip = std::clamp(int(phi / phiWidth_), 0, nPhi_ - 1);
+                return (ir * nY_ + iy) * nPhi_ + ip;
+            }
+
+            /**
+             * @brief [begin, end) cell index ranges that can hold a partner of
+             *        cell a with qinv below qmax (merged where contiguous)
+             */
+            const std::vector<std::pair<int, int>>& PartnerCells(int a) const { return partners_[a]; }
+
+        private:
+            void BuildPartnerCells(int a, std::vector<std::pair<int, int>>& ranges) const {
+                ranges.clear();
+                const int ra = a / (nY_ * nPhi_);
+                const int ya = (a / nPhi_) % nY_;
+                const int pa = a % nPhi_;
+                for (int rb = 0; rb < nRho_; ++rb) {
+                    const double t1 = term1_[ra * nRho_ + rb];
+                    if (t1 >= threshold_) continue;
+                    const double ch = std::cosh(rhoEdges_[ra]) * std::cosh(rhoEdges_[rb]);
+                    const double sh = std::sinh(rhoEdges_[ra]) * std::sinh(rhoEdges_[rb]);
+                    for (int yb = 0; yb < nY_; ++yb) {
+                        const double t12 = t1 + ch * yTerm_[std::abs(yb - ya)];
+                        if (t12 >= threshold_) continue;
+                        // Largest phi cell distance still below the threshold (terms grow with it)
+                        int dmax = 0;
+                        while (dmax < nPhi_ / 2 && t12 + sh * phiTerm_[dmax + 1] < threshold_) ++dmax;
+                        const int row = (rb * nY_ + yb) * nPhi_;
+                        if (2 * dmax + 1 >= nPhi_) {
+                            ranges.emplace_back(row, row + nPhi_);
+                            continue;
+                        }
+                        int lo = pa - dmax, hi = pa + dmax + 1;
+                        if (lo < 0) {
+                            ranges.emplace_back(row, row + hi);
+                            ranges.emplace_back(row + lo + nPhi_, row + nPhi_);
+                        } else if (hi > nPhi_) {
+                            ranges.emplace_back(row + lo, row + nPhi_);
+                            ranges.emplace_back(row, row + hi - nPhi_);
+                        } else {
+                            ranges.emplace_back(row + lo, row + hi);
+                        }
+                    }
+                }
+
+                // Adjacent rows that are fully covered become one track range
+                std::sort(ranges.begin(), ranges.end());
+                std::vector<std::pair<int, int>> merged;
+                for (const auto& r : ranges) {
+                    if (!merged.empty() && merged.back().second == r.first) merged.back().second = r.second;
+                    else merged.push_back(r);
+                }
+                ranges.swap(merged);
+            }
+
+            double qmax_, mass_, threshold_;
+            int nY_, nPhi_;
+            double yWidth_, phiWidth_;
+            int nRho_ = 0;
+            std::vector<double> rhoEdges_;   // Lower edge of each rho cell
+            std::vector<double> term1_;      // [rho a][rho b]
+            std::vector<double> yTerm_;      // [y cell distance]
+            std::vector<double> phiTerm_;    // [phi cell distance]
+            std::vector<std::vector<std::pair<int, int>>> partners_;  // Per cell
+        };
+
+        /**
+         * @brief One event's tracks counting-sorted by cell
+         */
+        struct CellSortedTracks {
+            TrackSoA tracks;               // Sorted copy
+            std::vector<int> original;     // Sorted index -> index in the input
+            std::vector<int> cellBegin;    // NumCells()+1 offsets into tracks
+
+            void Build(const TrackSoA& in, const CellGrid& grid) {
+                const int n = in.size();
+                const int nc = grid.NumCells();
+                cell_.resize(n);
+                cellBegin.assign(nc + 1, 0);
+                for (int i = 0; i < n; ++i) {
+                    cell_[i] = grid.CellOf(in, i);
+                    ++cellBegin[cell_[i] + 1];
+                }
+                for (int c = 0; c < nc; ++c) cellBegin[c + 1] += cellBegin[c];
+
+                tracks.clear();
+                tracks.reserve(n);
+                tracks.px.resize(n); tracks.py.resize(n); tracks.pz.resize(n); tracks.E.resize(n);
+                tracks.pt.resize(n); tracks.p.resize(n); tracks.weight.resize(n); tracks.charge.resize(n);
+                original.resize(n);
+                fill_.assign(cellBegin.begin(), cellBegin.end() - 1);
+                for (int i = 0; i < n; ++i) {
+                    int s = fill_[cell_[i]]++;
+                    tracks.px[s] = in.px[i]; tracks.py[s] = in.py[i];
+                    tracks.pz[s] = in.pz[i]; tracks.E[s] = in.E[i];
+                    tracks.pt[s] = in.pt[i]; tracks.p[s] = in.p[i];
+                    tracks.weight[s] = in.weight[i]; tracks.charge[s] = in.charge[i];
+                    original[s] = i;
+                }
+            }
+
+        private:
+            std::vector<int> cell_, fill_;
+        };
+
+        /**
+         * @brief Same-event pairs of a cell-sorted event that can lie below grid.QMax()
+         * @param visit Called as visit(i, j, block, k) with i, j indices into
+         *        ev.tracks; block values are oriented as in ForEachSameEventPair
+         *        (lower input index first), so q_out has the brute-force sign
+         * @tparam Do3D, Split As in ComputePairBlockT
+         */
+        template<bool Do3D, bool Split, typename Visitor>
+        inline void ForEachSameEventPairPrunedT(const CellSortedTracks& ev, const CellGrid& grid,
+                                                const PairCuts& cuts, Visitor&& visit) {
+            const TrackSoA& t = ev.tracks;
+            PairBlock block;
+            std::int64_t n_visited = 0, n_split = 0;
+            for (int a = 0; a < grid.NumCells(); ++a) {
+                const int aBegin = ev.cellBegin[a], aEnd = ev.cellBegin[a + 1];
+                if (aBegin == aEnd) continue;
+                for (const auto& range : grid.PartnerCells(a)) {
+                    const int bBegin = ev.cellBegin[range.first], bEnd = ev.cellBegin[range.second];
+                    for (int i = aBegin; i < aEnd; ++i) {
+                        for (int first = std::max(bBegin, i + 1); first < bEnd; first += PAIR_BLOCK) {
+                            int last = std::min(first + PAIR_BLOCK, bEnd);
+                            ComputePairBlockT<Do3D, Split>(t, i, t, first, last, cuts, block);
+                            n_visited += block.n;
+                            for (int k = 0; k < block.n; ++k) {
+                                if (Split && cuts.rejectSplit && block.split[k]) { ++n_split; continue; }
+                                // Only q_out is odd under exchanging the two tracks
+                                if (Do3D && ev.original[first + k] < ev.original[i]) block.qout[k] = -block.qout[k];
+                                visit(i, first + k, block, k);
+                            }
+                        }
+                    }
+                }
+            }
+            ThreadPairCounters().visited += n_visited;
+            ThreadPairCounters().split += n_split;
+        }
+
+        /**
+         * @brief Mixed pairs of two cell-sorted events that can lie below grid.QMax()
+         * @param aCells, bCells Cell offsets (CellSortedTracks::cellBegin) of a and b
+         * @param visit Called as visit(i, j, block, k), i into a and j into b
+         */
+        template<bool Do3D, bool Split, typename Visitor>
+        inline void ForEachMixedPairPrunedT(const TrackSoA& a, const std::vector<int>& aCells,
+                                            const TrackSoA& b, const std::vector<int>& bCells,
+                                            const CellGrid& grid, const PairCuts& cuts, Visitor&& visit) {
+            PairBlock block;
+            std::int64_t n_visited = 0, n_split = 0;
+            for (int c = 0; c < grid.NumCells(); ++c) {
+                const int aBegin = aCells[c], aEnd = aCells[c + 1];
+                if (aBegin == aEnd) continue;
+                for (const auto& range : grid.PartnerCells(c)) {
+                    const int bBegin = bCells[range.first], bEnd = bCells[range.second];
+                    for (int i = aBegin; i < aEnd; ++i) {
+                        for (int first = bBegin; first < bEnd; first += PAIR_BLOCK) {
+                            int last = std::min(first + PAIR_BLOCK, bEnd);
+                            ComputePairBlockT<Do3D, Split>(a, i, b, first, last, cuts, block);
+                            n_visited += block.n;
+                            for (int k = 0; k < block.n; ++k) {
+                                if (Split && cuts.rejectSplit && block.split[k]) { ++n_split; continue; }
+                                visit(i, first + k, block, k);
+                            }
+                        }
+                    }
+                }
+            }
+            ThreadPairCounters().visited += n_visited;
+            ThreadPairCounters().split += n_split;
+        }
+
+        template<typename Visitor>
+        inline void ForEachSameEventPairPruned(const CellSortedTracks& ev, const CellGrid& grid,
+                                               const PairCuts& cuts, Visitor&& visit) {
+            ForEachSameEventPairPrunedT<true, true>(ev, grid, cuts, std::forward<Visitor>(visit));
+        }
+
+        template<typename Visitor>
+        inline void ForEachMixedPairPruned(const TrackSoA& a, const std::vector<int>& aCells,
+                                           const TrackSoA& b, const std::vector<int>& bCells,
+                                           const CellGrid& grid, const PairCuts& cuts, Visitor&& visit) {
+            ForEachMixedPairPrunedT<true, true>(a, aCells, b, bCells, grid, cuts, std::forward<Visitor>(visit));
+        }
+
+        // Validation ==========================================================
+
+        namespace detail {
+            inline std::uint64_t PairKey(int i, int j) {
+                return (std::uint64_t(std::uint32_t(i)) << 32) | std::uint32_t(j);
+            }
+
+            inline long CountMissing(std::vector<std::uint64_t>& brute, std::vector<std::uint64_t>& pruned) {
+                std::sort(brute.begin(), brute.end());
+                std::sort(pruned.begin(), pruned.end());
+                std::vector<std::uint64_t> missing;
+                std::set_difference(brute.begin(), brute.end(), pruned.begin(), pruned.end(),
+                                    std::back_inserter(missing));
+                return static_cast<long>(missing.size());
+            }
+        }
+
+        /**
+         * @brief Same-event pairs below grid.QMax() found by the brute-force loop
+         *        but not by the pruned one (0 if the pruning is exact)
+         * @param in Unsorted tracks; ev must be built from them
+         */
+        inline long PruningMisses(const TrackSoA& in, const CellSortedTracks& ev,
+                                  const CellGrid& grid, const PairCuts& cuts) {
+            std::vector<std::uint64_t> brute, pruned;
+            ForEachSameEventPair(in, cuts, [&](int i, int j, const PairBlock& b, int k) {
+                if (b.qinv[k] < grid.QMax()) brute.push_back(detail::PairKey(i, j));
+            });
+            ForEachSameEventPairPruned(ev, grid, cuts, [&](int i, int j, const PairBlock& b, int k) {
+                int oi = ev.original[i], oj = ev.original[j];
+                if (b.qinv[k] < grid.QMax()) pruned.push_back(detail::PairKey(std::min(oi, oj), std::max(oi, oj)));
+            });
+            return detail::CountMissing(brute, pruned);
+        }
+
+        /**
+         * @brief Mixed-pair version of PruningMisses for two cell-sorted events
+         */
+        inline long PruningMisses(const TrackSoA& a, const std::vector<int>& aCells,
+                                  const TrackSoA& b, const std::vector<int>& bCells,
+                                  const CellGrid& grid, const PairCuts& cuts) {
+            std::vector<std::uint64_t> brute, pruned;
+            ForEachMixedPair(a, b, cuts, [&](int i, int j, const PairBlock& blk, int k) {
+                if (blk.qinv[k] < grid.QMax()) brute.push_back(detail::PairKey(i, j));
+            });
+            ForEachMixedPairPruned(a, aCells, b, bCells, grid, cuts, [&](int i, int j, const PairBlock& blk, int k) {
+                if (blk.qinv[k] < grid.QMax()) pruned.push_back(detail::PairKey(i, j));
+            });
+            return detail::CountMissing(brute, pruned);
+        }
+
+    } // namespace Kernel
+} // namespace HBT
+
+#endif // PAIR_PRUNING_H
@@ -0,0 +1,175 @@
+#ifndef PERF_STATS_H
+#define PERF_STATS_H
+
+#include "call_libraries.h"
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+/**
+ * @file perf_stats.h
+ * @brief Per-stage counters and timers of the event loop
+ *
+ * Each worker owns one PerfStats in its LoopOutput, so updates are plain
+ * adds (a few clock reads and increments per event; pair counts come from
+ * the per-loop totals of the pair kernel). Chunks are summed like the
+ * histograms, and the run total is written into a perf/ directory of the
+ * output file, optionally also as JSON, so HTCondor jobs can be compared
+ * after the fact.
+ */
+
+namespace HBT {
+    namespace Perf {
+
+        enum Counter : int {
+            ENTRIES_READ,        // Forest (or skim) entries read
+            EVENTS_PASSED,       // Events passing PassEventCuts
+            TRACKS_READ,         // Tracks in the track tree of passing events
+            TRACKS_ACCEPTED,     // Tracks after selection and correction ranges
+            PAIRS_VISITED,       // Same-event pairs computed by the kernel
+            PAIRS_SPLIT,         // Same-event pairs rejected as split
+            PAIRS_FILLED,        // Same-event pairs filled
+            MIX_PAIRS_VISITED,   // Mixed pairs computed by the kernel
+            MIX_PAIRS_SPLIT,     // Mixed pairs rejected as split
+            MIX_PAIRS_FILLED,    // Mixed pairs filled
+            N_COUNTERS
+        };
+
+        enum Timer : int {
+            TIME_IO,             // Event and track branches, event cuts
+            TIME_CORRECTION,     // Track corrections and SoA conversion
+            TIME_SAME_PAIRS,     // Same-event pair loops
+            TIME_MIXING,         // Mixing pair loops and pool insertion
+            TIME_WRITE,          // Histogram conversion and writing
+            N_TIMERS
+        };
+
+        const char* const COUNTER_NAMES[N_COUNTERS] = {
+            "entries_read", "events_passed", "tracks_read", "tracks_accepted",
+            "pairs_visited", "pairs_split", "pairs_filled",
+            "mix_pairs_visited", "mix_pairs_split", "mix_pairs_filled"};
+
+        const char* const TIMER_NAMES[N_TIMERS] = {"io", "correction", "same_pairs", "mixing", "write"};
+
+        constexpr int PERF_MULT_BINS = 40;            // Pair time vs multiplicity: bins, plus one overflow
+        constexpr double PERF_MULT_BIN_WIDTH = 100;   // Tracks per bin
+
+        using Clock = std::chrono::steady_clock;
+
+        inline double SecondsSince(Clock::time_point start) {
+            return std::chrono::duration<double>(Clock::now() - start).count();
+        }
+
+        struct PerfStats {
+            std::array<std::int64_t, N_COUNTERS> counts{};
+            std::array<double, N_TIMERS> seconds{};
+            std::array<double, PERF_MULT_BINS + 1> pair_seconds{};        // Same-event + mixing time per bin
+            std::array<std::int64_t, PERF_MULT_BINS + 1> pair_events{};   // Events per bin
+
+            void Count(Counter c, std::int64_t n = 1) { counts[c] += n; }
+            void AddTime(Timer t, double s) { seconds[t] += s; }
+
+            /**
+             * @brief Records the pair-loop time of one event of mult tracks
+             * @param new_event false to add to an event already counted (its mixing)
+             */
+            void AddPairTime(int mult, double s, bool new_event = true) {
+                int bin = std::min(PERF_MULT_BINS, static_cast<int>(mult / PERF_MULT_BIN_WIDTH));
+                pair_seconds[bin] += s;
+                if (new_event) ++pair_events[bin];
+            }
+
+            void Add(const PerfStats& other) {
+                for (int c = 0; c < N_COUNTERS; ++c) counts[c] += other.counts[c];
+                for (int t = 0; t < N_TIMERS; ++t) seconds[t] += other.seconds[t];
+                for (int b = 0; b <= PERF_MULT_BINS; ++b) {
+                    pair_seconds[b] += other.pair_seconds[b];
+                    pair_events[b] += other.pair_events[b];
+                }
+            }
+
+            void Reset() { *this = PerfStats(); }
+
+            /**
+             * @brief Writes counters, timers and pair time vs multiplicity into dir/perf
+             * Timers are summed over threads, so they are CPU-like seconds. Every
+             * histogram holds sums, so hadd of job outputs stays correct; the mean
+             * pair time per event is computed on read (MeanPairTime).
+             */
+            void Write(TDirectory& dir) const {
+                TDirectory* perf = dir.mkdir("perf");
+                perf->cd();
+                TH1D hCounts("counters", "counters", N_COUNTERS, 0, N_COUNTERS);
+                TH1D hTimes("timers", "seconds per stage (summed over threads)", N_TIMERS, 0, N_TIMERS);
+                TH1D hPairTime("pair_seconds_vs_mult", "pair-loop seconds (summed over events);multiplicity",
+                               PERF_MULT_BINS, 0, PERF_MULT_BINS * PERF_MULT_BIN_WIDTH);
+                TH1D hPairEvents("events_vs_mult", "events;multiplicity",
+                                 PERF_MULT_BINS, 0, PERF_MULT_BINS * PERF_MULT_BIN_WIDTH);
+                for (TH1D* h : {&hCounts, &hTimes, &hPairTime, &hPairEvents}) h->SetDirectory(nullptr);
+                for (int c = 0; c < N_COUNTERS; ++c) {
+                    hCounts.SetBinContent(c + 1, double(counts[c]));
+                    hCounts.GetXaxis()->SetBinLabel(c + 1, COUNTER_NAMES[c]);
+                }
+                for (int t = 0; t < N_TIMERS; ++t) {
+                    hTimes.SetBinContent(t + 1, seconds[t]);
+                    hTimes.GetXaxis()->SetBinLabel(t + 1, TIMER_NAMES[t]);
+                }
+                for (int b = 0; b <= PERF_MULT_BINS; ++b) {   // Last bin goes to the overflow
+                    if (pair_events[b] == 0) continue;
+                    hPairTime.SetBinContent(b + 1, pair_seconds[b]);
+                    hPairEvents.SetBinContent(b + 1, double(pair_events[b]));
+                }
+                hCounts.Write();
+                hTimes.Write();
+                hPairTime.Write();
+                hPairEvents.Write();
+                dir.cd();
+            }
+
+            /**
+             * @brief Writes the same content as a flat JSON object
+             * @return false if the file cannot be opened
+             */
+            bool WriteJson(const std::string& path) const {
+                std::ofstream out(path);
+                if (!out) return false;
+                out << "{\n  \"counters\": {";
+                for (int c = 0; c < N_COUNTERS; ++c) {
+                    out << (c ? ", " : "") << "\"" << COUNTER_NAMES[c] << "\": " << counts[c];
+                }
+                out << "},\n  \"seconds\": {";
+                for (int t = 0; t < N_TIMERS; ++t) {
+                    out << (t ? ", " : "") << "\"" << TIMER_NAMES[t] << "\": " << seconds[t];
+                }
+                out << "},\n  \"mult_bin_width\": " << PERF_MULT_BIN_WIDTH << ",\n  \"pair_seconds\": [";
+                for (int b = 0; b <= PERF_MULT_BINS; ++b) out << (b ? ", " : "") << pair_seconds[b];
+                out << "],\n  \"pair_events\": [";
+                for (int b = 0; b <= PERF_MULT_BINS; ++b) out << (b ? ", " : "") << pair_events[b];
+                out << "]\n}\n";
+                return bool(out);
+            }
+        };
+
+        /**
+         * @brief Mean pair-loop seconds per event vs multiplicity, from a perf/ directory
+         * Works on a single job output as well as on an hadd of several.
+         * @return New histogram owned by the caller, or nullptr if perf is not a perf/ directory
+         */
+        inline TH1D* MeanPairTime(TDirectory& perf) {
+            TH1D* seconds = dynamic_cast<TH1D*>(perf.Get("pair_seconds_vs_mult"));
+            TH1D* events = dynamic_cast<TH1D*>(perf.Get("events_vs_mult"));
+            if (!seconds || !events) return nullptr;
+            TH1D* mean = static_cast<TH1D*>(seconds->Clone("pair_time_vs_mult"));
+            mean->SetDirectory(nullptr);
+            mean->SetTitle("mean pair-loop seconds per event;multiplicity");
+            mean->Divide(events);   // Empty bins stay 0
+            return mean;
+        }
+
+    } // namespace Perf
+} // namespace HBT
+
+#endif // PERF_STATS_H
@@ -0,0 +1,199 @@
+#!/usr/bin/env python
+
+import json
+import optparse
+import os
+import sys
+from concurrent.futures import ProcessPoolExecutor
+
+import numpy as np
+
+''' Balanced work units for correlation_XeXe
+
+Scans every forest of the input list once (event count, vz, hiBin, filters
+and nTrk), estimates the cost of each entry as I/O plus same-event and
+mixed pairs, and cuts the chain into work units of similar cost. Unit
+boundaries fall on multiples of the event-loop chunk size (CHUNK_ENTRIES in
+hbt_event_loop.h), so each job sees the same chunks as a single job over
+the whole list. The same-event histograms of the merged units are those of a
+single job; the mixed ones differ slightly, because each job starts with an
+empty mixing pool and the first events of a unit get fewer partners. Each
+unit is written as a file list with an "#entries <first> <last>" line that correlation_XeXe reads;
+the plan (JSON) is what HTCondor_submit_data.py --plan and merge_outputs.py
+--plan take.
+'''
+
+CHUNK_ENTRIES = 2000       # hbt_event_loop.h
+EVENT_FILTERS = ["pprimaryVertexFilter", "phfCoincFilter3", "pclusterCompatibilityFilter"]  # read_tree.h
+
+
+def power_law_multiplicity(central, exponent):
+    ''' Mean accepted tracks per hiBin 0-199 as central x (1 - hiBin/200)^exponent (synthetic_events.h model) '''
+    x = 1.0 - np.arange(200) / 200.0
+    return np.maximum(5.0, central * x ** exponent)
+
+
+def measured_multiplicity(spec):
+    ''' Mean accepted tracks per hiBin 0-199 from a MultVSCent histogram, given as file.root[:name] '''
+    import ROOT
+    path, _, name = spec.partition(':')
+    f = ROOT.TFile.Open(path)
+    if not f or f.IsZombie():
+        raise RuntimeError(f"Could not open {path}")
+    h = f.Get(name or "MultVSCent")
+    if not h or h.GetEntries() == 0:
+        raise RuntimeError(f"No filled {name or 'MultVSCent'} (Ntrkoff vs hiBin) in {path}")
+    prof = h.ProfileY("_mult_vs_hibin")   # Mean Ntrkoff (x) per hiBin bin (y)
+    table = np.array([prof.GetBinContent(prof.FindBin(b + 0.5)) for b in range(200)])
+    f.Close()
+    return np.maximum(5.0, table)
+
+
+def scan_file(path, nmix, vzmax, acceptance, iocost, mult_table):
+    ''' Per-entry cost of one forest: I/O of its tracks plus, for accepted events, pairs '''
+    import ROOT
+    ROOT.gErrorIgnoreLevel = ROOT.kError
+    f = ROOT.TFile.Open(path)
+    if not f or f.IsZombie():
+        raise RuntimeError(f"Could not open {path}")
+    n = int(f.Get("hiEvtAnalyzer/HiTree").GetEntries())
+    has_skim = bool(f.Get("skimanalysis/HltTree"))
+    f.Close()
+    if n == 0:
+        return path, 0, np.zeros(0)
+
+    ev = ROOT.RDataFrame("hiEvtAnalyzer/HiTree", path).AsNumpy(["vz", "hiBin"])
+    vz = ev["vz"].astype(float)
+    hibin = ev["hiBin"].astype(float)
+    passed = (np.abs(vz) <= vzmax) & (hibin >= 0) & (hibin <= 199)
+
+    # correlation_XeXe refuses forests without the filter branches, so fail here already
+    skim = ROOT.RDataFrame("skimanalysis/HltTree", path) if has_skim else None
+    missing = [c for c in EVENT_FILTERS if skim is None or not skim.HasColumn(c)]
+    if missing:
+        raise RuntimeError(f"Missing event filters {', '.join(missing)} in {path}")
+    flags = skim.AsNumpy(EVENT_FILTERS)
+    for c in EVENT_FILTERS:
+        passed &= flags[c] != 0
+
+    if mult_table is not None:
+        mult = mult_table[np.clip(hibin, 0, 199).astype(int)]
+        raw = mult / acceptance
+    else:
+        raw = ROOT.RDataFrame("ppTrack/trackTree", path).AsNumpy(["nTrk"])["nTrk"].astype(float)
+        mult = raw * acceptance
+
+    # Rejected events cost only the event branches; accepted ones the tracks and n^2 (same + nmix partners)
+    cost = iocost * (1.0 + passed * raw) + passed * mult * mult * (0.5 + nmix)
+    return path, n, cost
+
+
+def balanced_cuts(chunk_cost, njobs):
+    ''' Contiguous chunk ranges of near-equal cost: cut where the running sum crosses k/njobs of the total '''
+    cum = np.cumsum(chunk_cost)
+    total = cum[-1]
+    cuts = [0]
+    for k in range(1, njobs):
+        target = total * k / njobs
+        c = int(np.searchsorted(cum, target))
+        # Cut before or after chunk c, whichever is closer to the target
+        if c > 0 and abs(cum[c - 1] - target) <= abs(cum[c] - target):
+            c -= 1
+        cuts.append(min(max(c + 1, cuts[-1] + 1), len(chunk_cost) - (njobs - k)))
+    cuts.append(len(chunk_cost))
+    return cuts
+
+
+def main():
+    usage = 'usage: %prog -i list -n njobs [options]'
+    parser = optparse.OptionParser(usage)
+    parser.add_option('-i', '--infiles', dest='infiles', help='input list of files (.txt, given without extension)', default='', type='string')
+    parser.add_option('-n', '--njobs', dest='numberofjobs', help='number of work units', default='1', type='int')
+    parser.add_option('-o', '--plan', dest='plan', help='output plan (.json); unit lists are written next to it', default='hbt_plan.json', type='string')
+    parser.add_option('-j', '--jobs', dest='nproc', help='files scanned in parallel', default=os.cpu_count() or 1, type='int')
+    parser.add_option('--nmix', dest='nmix', help='mixed events per event (n_mix_events)', default='10', type='int')
+    parser.add_option('--vzmax', dest='vzmax', help='|vz| cut (cm)', default='15.0', type='float')
+    parser.add_option('--acceptance', dest='acceptance', help='fraction of nTrk passing the track selection', default='0.6', type='float')
+    parser.add_option('--io-cost', dest='iocost', help='cost of reading one track, in pairs', default='20.0', type='float')
+    parser.add_option('--from-hibin', dest='fromhibin', help='estimate multiplicity from hiBin instead of reading nTrk', action='store_true', default=False)
+    parser.add_option('--mult-vs-cent', dest='multvscent', help='with --from-hibin: file.root[:name] of a MultVSCent histogram (Ntrkoff vs hiBin) from an earlier output', default='', type='string')
+    parser.add_option('--central-mult', dest='centralmult', help='with --from-hibin and no --mult-vs-cent: mean Ntrkoff at hiBin 0', default='2500.0', type='float')
+    parser.add_option('--mult-exponent', dest='multexponent', help='with --from-hibin and no --mult-vs-cent: Ntrkoff falls as (1 - hiBin/200)^exponent', default='2.8', type='float')
+
+    (opt, args) = parser.parse_args()
+
+    ''' Read list of files '''
+    if not os.path.exists(opt.infiles + '.txt'):
+        sys.exit(f"Error: Input file list {opt.infiles}.txt does not exist.")
+    with open(opt.infiles + '.txt') as listfile:
+        files = [l.strip() for l in listfile if l.strip() and not l.strip().startswith('#')]
+    print(f"Number of files: {len(files)}")
+
+    ''' Multiplicity vs hiBin for --from-hibin: measured if given, else the power law '''
+    mult_table = None
+    if opt.fromhibin:
+        if opt.multvscent:
+            mult_table = measured_multiplicity(opt.multvscent)
+            print(f"Multiplicity vs hiBin from {opt.multvscent}")
+        else:
+            mult_table = power_law_multiplicity(opt.centralmult, opt.multexponent)
+            print(f"Multiplicity vs hiBin: {opt.centralmult} x (1 - hiBin/200)^{opt.multexponent}")
+
+    ''' Scan the forests '''
+    with ProcessPoolExecutor(max_workers=max(1, opt.nproc)) as pool:
+        futures = [pool.submit(scan_file, path, opt.nmix, opt.vzmax, opt.acceptance, opt.iocost, mult_table) for path in files]
+        scans = [fut.result() for fut in futures]
+
+    entries = [n for (_, n, _) in scans]
+    offsets = np.concatenate([[0], np.cumsum(entries)]).astype(np.int64)
+    n_entries = int(offsets[-1])
+    if n_entries == 0:
+        sys.exit("Error: the input files have no entries.")
+    cost = np.concatenate([c for (_, _, c) in scans])
+    n_chunks = (n_entries + CHUNK_ENTRIES - 1) // CHUNK_ENTRIES
+    chunk_cost = np.add.reduceat(cost, np.arange(0, n_entries, CHUNK_ENTRIES))
+    njobs = max(1, min(opt.numberofjobs, n_chunks))
+    if njobs < opt.numberofjobs:
+        print(f"Only {n_chunks} chunks of {CHUNK_ENTRIES} entries: using {njobs} work units")
+    print(f"Number of entries: {n_entries} in {n_chunks} chunks")
+
+    ''' Cut the chain and write one list per unit '''
+    cuts = balanced_cuts(chunk_cost, njobs)
+    plan_dir = os.path.dirname(os.path.abspath(opt.plan))
+    plan_stem = os.path.splitext(os.path.basename(opt.plan))[0]
+    units = []
+    for u in range(njobs):
+        g_first = cuts[u] * CHUNK_ENTRIES
+        g_last = min(cuts[u + 1] * CHUNK_ENTRIES, n_entries)
+        first_file = int(np.searchsorted(offsets, g_first, side='right')) - 1
+        last_file = int(np.searchsorted(offsets, g_last, side='left'))
+        unit_files = files[first_file:last_file]
+        local_first = g_first - int(offsets[first_file])
+        local_last = g_last - int(offsets[first_file])
+        list_path = os.path.join(plan_dir, f"{plan_stem}_unit{u}.txt")
+        with open(list_path, 'w') as out:
+            out.write(f"#entries {local_first} {local_last}\n")
+            for path in unit_files:
+                out.write(path + "\n")
+        units.append({"unit": u, "list": list_path, "first": local_first, "last": local_last,
+                      "global_first": g_first, "global_last": g_last, "entries": g_last - g_first,
+                      "cost": float(chunk_cost[cuts[u]:cuts[u + 1]].sum())})
+
+    plan = {"input": opt.infiles + '.txt', "chunk_entries": CHUNK_ENTRIES, "n_entries": n_entries,
+            "n_mix_events": opt.nmix, "total_cost": float(chunk_cost.sum()),
+            "files": [{"path": p, "entries": n} for (p, n) in zip(files, entries)], "units": units}
+    with open(opt.plan, 'w') as out:
+        json.dump(plan, out, indent=1)
+
+    ''' Balance compared to the split by line count of HTCondor_submit_data.py --split '''
+    unit_cost = np.array([u["cost"] for u in units])
+    file_cost = np.array([c.sum() for (_, _, c) in scans])
+    ratioint = max(1, len(files) // njobs)
+    line_cost = [file_cost[i * ratioint:(i + 1) * ratioint if i < njobs - 1 else len(files)].sum() for i in range(min(njobs, len(files)))]
+    print(f"Work units: {njobs}, max/mean cost {unit_cost.max() / unit_cost.mean():.2f} "
+          f"(split by line count: {max(line_cost) / np.mean(line_cost):.2f})")
+    print(f"Plan written to {opt.plan}")
+
+
+if __name__ == '__main__':
+    main()
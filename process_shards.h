@@ -0,0 +1,265 @@
+#ifndef HBT_PROCESS_SHARDS_H
+#define HBT_PROCESS_SHARDS_H
+
+#include "hbt_event_loop.h"
+#include "checkpoint.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * @file process_shards.h
+ * @brief Event loop split over forked worker processes on one node
+ *
+ * The parent cuts the entry range into contiguous runs of whole chunks and
+ * forks one worker per run. Each worker is a copy of the parent (ROOT state,
+ * efficiency tables, event index) and runs RunEventLoop on its own range,
+ * so no ROOT object is shared between processes. When it is done, the
+ * worker writes its LoopOutput with LoopOutput::Save into its own POSIX
+ * shared-memory slab (/dev/shm) and exits. The parent adds the slabs in
+ * worker order, which is chunk order. Each worker starts with an empty
+ * mixing pool, so only the mixed pairs at the start of each run differ
+ * from a threaded run.
+ *
+ * Slab layout (native endianness):
+ *   SlabHeader
+ *   body, as written by LoopOutput::Save
+ */
+
+namespace HBT {
+    namespace Processes {
+
+        // Format ==============================================================
+        constexpr char MAGIC[8] = {'H', 'B', 'T', 'S', 'L', 'A', 'B', '1'};
+
+        struct SlabHeader {
+            char magic[8];
+            std::uint64_t body_bytes = 0;
+            std::int64_t first_entry = 0;    // Entry range of the worker
+            std::int64_t last_entry = 0;
+        };
+
+        /**
+         * @brief Shared-memory name of worker w's slab, unique per parent process
+         */
+        inline std::string SlabName(int w) {
+            return "/hbt_slab_" + std::to_string(::getpid()) + "_" + std::to_string(w);
+        }
+
+        // Slabs ===============================================================
+
+        /**
+         * @brief Writes out into a new shared-memory object of exactly the size it needs
+         * @throws std::runtime_error if the object cannot be created, reserved in /dev/shm or written
+         */
+        inline void PublishSlab(const std::string& name, std::int64_t first, std::int64_t last,
+                                const EventLoop::LoopOutput& out) {
+            Checkpoint::ByteCounter counter;
+            out.Save(counter);
+            SlabHeader header;
+            std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.body_bytes = counter.Bytes();
+            header.first_entry = first;
+            header.last_entry = last;
+            const std::size_t bytes = sizeof(SlabHeader) + header.body_bytes;
+
+            int fd = ::shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd < 0) throw std::runtime_error("Could not create shared memory " + name + ": " + std::strerror(errno));
+            // Reserve the pages now: a slab that only fits on paper raises SIGBUS on the first write
+            const int err = ::posix_fallocate(fd, 0, static_cast<off_t>(bytes));
+            if (err != 0) {
+                ::close(fd);
+                if (err == ENOSPC) {
+                    throw std::runtime_error("No room in /dev/shm for the " + std::to_string(bytes) +
+                                             "-byte slab " + name);
+                }
+                throw std::runtime_error("Could not size shared memory " + name + " to " + std::to_string(bytes) +
+                                         " bytes: " + std::strerror(err));
+            }
+            void* map = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (map == MAP_FAILED) throw std::runtime_error("Could not map shared memory " + name);
+
+            std::FILE* stream = ::fmemopen(map, bytes, "w");
+            bool ok = stream != nullptr;
+            if (ok) {
+                Checkpoint::BinaryWriter writer(stream);
+                writer.Write(header);
+                out.Save(writer);
+                ok = writer.Ok();
+                ok = (std::fclose(stream) == 0) && ok;
+            }
+            ::munmap(map, bytes);
+            if (!ok) throw std::runtime_error("Could not write shared memory " + name);
+        }
+
+        /**
+         * @brief Adds the slab of a finished worker to total and removes it
+         * @throws std::runtime_error if the slab is missing, truncated or of another binning
+         */
+        inline void CollectSlab(const std::string& name, EventLoop::LoopOutput& total, EventLoop::LoopOutput& scratch) {
+            int fd = ::shm_open(name.c_str(), O_RDONLY, 0);
+            if (fd < 0) throw std::runtime_error("Worker left no shared memory " + name);
+            ::shm_unlink(name.c_str());
+            struct stat st;
+            if (::fstat(fd, &st) != 0 || st.st_size < off_t(sizeof(SlabHeader))) {
+                ::close(fd);
+                throw std::runtime_error("Shared memory " + name + " is truncated");
+            }
+            const std::size_t bytes = st.st_size;
+            void* map = ::mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (map == MAP_FAILED) throw std::runtime_error("Could not map shared memory " + name);
+
+            std::FILE* stream = ::fmemopen(map, bytes, "r");
+            try {
+                if (!stream) throw std::runtime_error("Could not read shared memory " + name);
+                Checkpoint::BinaryReader reader(stream);
+                SlabHeader header;
+                reader.Read(header);
+                if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 ||
+                    sizeof(SlabHeader) + header.body_bytes != bytes) {
+                    throw std::runtime_error("Shared memory " + name + " is not a complete worker slab");
+                }
+                scratch.Load(reader);
+                total.Add(scratch);
+            } catch (...) {
+                if (stream) std::fclose(stream);
+                ::munmap(map, bytes);
+                throw;
+            }
+            std::fclose(stream);
+            ::munmap(map, bytes);
+        }
+
+        // Driver ==============================================================
+
+        /**
+         * @brief Runs the event loop in n_processes forked workers of cfg.n_threads threads each
+         * Worker w takes chunks [w n / N, (w + 1) n / N) of the n chunks of the
+         * range, so chunk boundaries are those of a single process; the mixing
+         * pool starts empty in every worker.
+         * @param n_entries Total entries of the input chains
+         * @param quick_test Restrict to the first QUICK_TEST_ENTRIES entries
+         * @return Run total, merged in worker (chunk) order
+         * @throws std::runtime_error for skim run modes, checkpoints or a pair cache,
+         *         and if a worker fails
+         */
+        inline std::unique_ptr<EventLoop::LoopOutput> RunEventLoopProcesses(const EventLoop::RunConfig& config,
+                                                                            Long64_t n_entries, int n_processes,
+                                                                            bool quick_test = false) {
+            using namespace EventLoop;
+            if (config.run_mode != RUN_FULL) throw std::runtime_error("Worker processes need run_mode 0");
+            if (!config.checkpoint_path.empty() || config.cache_qmax > 0) {
+                throw std::runtime_error("Worker processes do not write checkpoints or a pair cache");
+            }
+            RunConfig cfg = config;
+            const Long64_t first = cfg.first_entry;
+            Long64_t last = (cfg.last_entry < 0) ? n_entries : std::min(cfg.last_entry, n_entries);
+            if (quick_test) last = std::min(last, first + QUICK_TEST_ENTRIES);
+            const Long64_t n_chunks = (last > first) ? (last - first + CHUNK_ENTRIES - 1) / CHUNK_ENTRIES : 0;
+            const int n_workers = int(std::max<Long64_t>(1, std::min<Long64_t>(n_processes, n_chunks)));
+
+            // Shared read-only inputs are built once; the workers get copy-on-write pages
+            if (!cfg.corrections) cfg.corrections = MakeCorrectionTable(cfg.eff_hists);
+            if (cfg.use_index && !cfg.event_index) cfg.event_index = LoadEventIndex(cfg, n_entries);
+            if (cfg.prune_qmax > 0 && !cfg.pruning) {
+                cfg.pruning = std::make_shared<const Kernel::CellGrid>(cfg.prune_qmax, PI_MASS);
+            }
+
+            // Buffered output would otherwise be printed once more by every worker
+            std::cout.flush();
+            std::fflush(nullptr);
+            const pid_t parent = ::getpid();
+            std::vector<pid_t> pids;
+            std::vector<std::string> names;
+            for (int w = 0; w < n_workers; ++w) {
+                const Long64_t begin = std::min(last, first + (w * n_chunks / n_workers) * CHUNK_ENTRIES);
+                const Long64_t end = std::min(last, first + ((w + 1) * n_chunks / n_workers) * CHUNK_ENTRIES);
+                names.push_back(SlabName(w));
+                const pid_t pid = ::fork();
+                if (pid < 0) {
+                    for (pid_t p : pids) ::kill(p, SIGTERM);
+                    for (pid_t p : pids) ::waitpid(p, nullptr, 0);
+                    for (const std::string& name : names) ::shm_unlink(name.c_str());
+                    throw std::runtime_error("Could not fork worker process " + std::to_string(w));
+                }
+                if (pid == 0) {
+                    // Worker: _exit skips the atexit handlers, so the parent's open TFile is left alone
+                    ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+                    if (::getppid() != parent) ::_exit(1);
+                    int status = 0;
+                    try {
+                        RunConfig shard = cfg;
+                        shard.first_entry = begin;
+                        shard.last_entry = end;
+                        std::unique_ptr<LoopOutput> out = RunEventLoop(shard, n_entries, false);
+                        PublishSlab(names.back(), begin, end, *out);
+                    } catch (const std::exception& e) {
+                        std::cout << "Worker " << w << " [" << begin << ", " << end << "): " << e.what() << std::endl;
+                        status = 1;
+                    }
+                    std::cout.flush();
+                    std::fflush(nullptr);
+                    ::_exit(status);
+                }
+                pids.push_back(pid);
+                std::cout << "Worker " << w << " (pid " << pid << "): entries [" << begin << ", " << end << ")"
+                          << std::endl;
+            }
+
+            // Every worker is waited for before any slab is read, so none is left behind
+            std::vector<int> failed;
+            std::string first_failure;
+            for (int w = 0; w < n_workers; ++w) {
+                int status = 0;
+                while (::waitpid(pids[w], &status, 0) < 0 && errno == EINTR) {}
+                if (WIFEXITED(status) && WEXITSTATUS(status) == 0) continue;
+                std::string what = "worker " + std::to_string(w) + " (pid " + std::to_string(pids[w]) + ") ";
+                if (WIFSIGNALED(status)) {
+                    what += "killed by signal " + std::to_string(WTERMSIG(status)) + " (" +
+                            ::strsignal(WTERMSIG(status)) + ")";
+                } else {
+                    what += "exited with status " + std::to_string(WEXITSTATUS(status));
+                }
+                std::cout << "Failed " << what << std::endl;
+                if (failed.empty()) first_failure = what;
+                failed.push_back(w);
+            }
+            if (!failed.empty()) {
+                for (const std::string& name : names) ::shm_unlink(name.c_str());
+                throw std::runtime_error(std::to_string(failed.size()) + " of " + std::to_string(n_workers) +
+                                         " worker processes failed, first: " + first_failure);
+            }
+
+            std::unique_ptr<LoopOutput> total(new LoopOutput(cfg.do_3d, WithMC(cfg)));
+            LoopOutput scratch(cfg.do_3d, WithMC(cfg));
+            for (int w = 0; w < n_workers; ++w) {
+                try {
+                    CollectSlab(names[w], *total, scratch);
+                } catch (...) {
+                    for (const std::string& name : names) ::shm_unlink(name.c_str());
+                    throw;
+                }
+            }
+            std::cout << "Merged " << n_workers << " worker processes (" << total->n_processed << " events)" << std::endl;
+            PrintMemoryReport(total->MemoryBytes());
+            return total;
+        }
+
+    } // namespace Processes
+} // namespace HBT
+
+#endif // HBT_PROCESS_SHARDS_H
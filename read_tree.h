@@ -3,12 +3,20 @@
 
 #include "call_libraries.h"
 #include <vector>
+#include <string>
+#include <memory>
 #include <stdexcept>
 
 // Configuration ===============================================================
 constexpr int MAX_HBT_TRACKS = 30000;  // Safe upper limit for PbPb HBT
 constexpr float MIN_HBT_PT = 0.15;     // GeV/c
 constexpr float MAX_HBT_ETA = 2.4;     // Pseudorapidity cut
+constexpr Long64_t HBT_TREE_CACHE_BYTES = 32LL << 20;  // TTreeCache per chain (EnableCache)
+
+// Event filters required in skimanalysis/HltTree
+const std::vector<std::string> HBT_EVENT_FILTERS = {
+    "pprimaryVertexFilter", "phfCoincFilter3", "pclusterCompatibilityFilter"
+};
 
 // HBT Quality Flags ===========================================================
 struct HBTQualityCuts {
@@ -20,12 +28,41 @@ struct HBTQualityCuts {
     float maxChi2 = 5.0;     // χ²/ndof
 };
 
+/**
+ * Track quality cuts for a systematic variation (see GetSystematicTag)
+ * @note The cut values of the track variations are not part of this code;
+ *       every systematic uses the nominal cuts, and trktight/trkloose (3, 4)
+ *       differ by their efficiency table (OpenEfficiencyFile) only
+ */
+inline HBTQualityCuts QualityCutsForSystematic(int /*syst*/) {
+    return HBTQualityCuts();
+}
+
+// Event Selection =============================================================
+struct HBTEventCuts {
+    float maxAbsVz = 15.0;   // cm
+    int minHiBin = 0;        // 0.5% hiBin units
+    int maxHiBin = 199;
+    int hiBinShift = 0;      // Centrality calibration variation
+    bool requireFilters = true;
+};
+
+/**
+ * Event cuts for a systematic variation (see GetSystematicTag)
+ * @note As for QualityCutsForSystematic, every systematic uses the nominal
+ *       event selection; vznarrow/vzwide (1, 2) differ by their efficiency table
+ */
+inline HBTEventCuts EventCutsForSystematic(int /*syst*/) {
+    return HBTEventCuts();
+}
+
 // Main Data Structure =========================================================
 struct HBTEvent {
     // Event Info
     float vz = 0;            // Vertex z-position (cm)
     int hiBin = -1;          // Centrality (PbPb only)
     float weight = 1.0;      // MC weight
+    bool passFilters = true; // All HBT_EVENT_FILTERS fired
     
     // Track Arrays (optimized for HBT)
     int nTracks = 0;
@@ -37,22 +74,85 @@ struct HBTEvent {
     short charge[MAX_HBT_TRACKS];   // ±1
     bool goodTrack[MAX_HBT_TRACKS]; // Passed quality cuts
     
+    // Track quality (filled by HBTTreeReader when the branch is read)
+    bool highPurity[MAX_HBT_TRACKS];
+    UChar_t nHits[MAX_HBT_TRACKS];
+    UChar_t nPixelHits[MAX_HBT_TRACKS];
+    float chi2[MAX_HBT_TRACKS];
+    
     // MC Truth (if available)
     bool isMC = false;
     std::vector<float> genPt;       // For efficiency corrections
     std::vector<float> genEta;
     std::vector<float> genPhi;
+    std::vector<int> genCharge;     // Empty if the forest has no gen charge branch
     
     void clear() {
         nTracks = 0;
+        passFilters = true;
         if (isMC) {
             genPt.clear();
             genEta.clear();
             genPhi.clear();
+            genCharge.clear();
         }
     }
 };
 
+/**
+ * Checks the event-level selection without modifying the event
+ * @param hiBin Output: hiBin after the centrality variation shift
+ * @return true if the event is accepted
+ */
+inline bool EventPassesCuts(const HBTEvent& event, const HBTEventCuts& cuts, int& hiBin) {
+    hiBin = event.hiBin + cuts.hiBinShift;
+    if (cuts.requireFilters && !event.passFilters) return false;
+    if (std::abs(event.vz) > cuts.maxAbsVz) return false;
+    return (hiBin >= cuts.minHiBin && hiBin <= cuts.maxHiBin);
+}
+
+/**
+ * Applies the event-level selection, shifting hiBin for centrality variations
+ * @return true if the event is accepted
+ */
+inline bool PassEventCuts(HBTEvent& event, const HBTEventCuts& cuts) {
+    int hiBin = event.hiBin;
+    bool pass = EventPassesCuts(event, cuts, hiBin);
+    event.hiBin = hiBin;
+    return pass;
+}
+
+/**
+ * Re-applies track quality cuts to an already selected track
+ * Used to evaluate tighter variations on tracks read with looser cuts.
+ * @param t Index into the event's accepted tracks
+ */
+inline bool PassTrackCuts(const HBTEvent& event, int t, const HBTQualityCuts& cuts) {
+    if (cuts.requireHighPurity && !event.highPurity[t]) return false;
+    if (event.nPixelHits[t] < cuts.minPixelHits) return false;
+    if (event.nHits[t] < cuts.minTotalHits) return false;
+    if (fabs(event.dcaXY[t]) > cuts.maxDcaXY) return false;
+    if (fabs(event.dcaZ[t]) > cuts.maxDcaZ) return false;
+    if (event.chi2[t] > cuts.maxChi2) return false;
+    return true;
+}
+
+/**
+ * Loosest combination of several track cuts (a track passing any of them passes this)
+ */
+inline HBTQualityCuts LoosestQualityCuts(const std::vector<HBTQualityCuts>& all) {
+    HBTQualityCuts loose = all.empty() ? HBTQualityCuts() : all.front();
+    for (const HBTQualityCuts& c : all) {
+        loose.requireHighPurity = loose.requireHighPurity && c.requireHighPurity;
+        loose.minPixelHits = std::min(loose.minPixelHits, c.minPixelHits);
+        loose.minTotalHits = std::min(loose.minTotalHits, c.minTotalHits);
+        loose.maxDcaXY = std::max(loose.maxDcaXY, c.maxDcaXY);
+        loose.maxDcaZ = std::max(loose.maxDcaZ, c.maxDcaZ);
+        loose.maxChi2 = std::max(loose.maxChi2, c.maxChi2);
+    }
+    return loose;
+}
+
 // Core Function ===============================================================
 /**
  * Reads an event with HBT-optimized branch loading and track selection
@@ -61,11 +161,14 @@ struct HBTEvent {
  * @param event Output event structure
  * @param cuts Track quality cuts for HBT analysis
  * @param isMC Whether to read MC truth branches
+ * @param entry Chain entry to load
  * @throws std::runtime_error if critical branches are missing
+ * @note Rebinds every branch on each call; event loops should use HBTTreeReader
  */
 void read_tree(TChain* tree, HBTEvent& event, 
                const HBTQualityCuts& cuts = HBTQualityCuts(),
-               bool isMC = false) 
+               bool isMC = false,
+               Long64_t entry = 0) 
 {
     // Validate input
     if (!tree) throw std::runtime_error("Null TChain provided");
@@ -145,7 +248,7 @@ void read_tree(TChain* tree, HBTEvent& event,
     }
     
     // 4. Load the entry -----------------------------------------------------
-    tree->GetEntry(0);
+    tree->GetEntry(entry);
     
     // 5. Apply HBT Track Selection ------------------------------------------
     event.nTracks = 0;
@@ -179,4 +282,315 @@ void read_tree(TChain* tree, HBTEvent& event,
     }
 }
 
+// Persistent Reader ===========================================================
+
+/**
+ * Growable heap buffer bound to one branch
+ */
+template<typename T>
+struct HBTBranchBuffer {
+    std::unique_ptr<T[]> data;
+    int capacity = 0;
+    TBranch* branch = nullptr;
+    
+    /**
+     * Ensures room for n elements
+     * @return true if the buffer moved (the branch address must be reset)
+     */
+    bool Reserve(int n) {
+        if (n <= capacity) return false;
+        capacity = std::max(n, 2 * capacity);
+        data.reset(new T[capacity]);
+        return true;
+    }
+    
+    void Bind() { if (branch) branch->SetAddress(data.get()); }
+    void Read(Long64_t local) { if (branch) branch->GetEntry(local); }
+};
+
+/**
+ * Bind-once reader for the event, track and skim chains
+ * 
+ * Branch addresses are set only when a chain moves to a new file
+ * (TChain::GetTreeNumber changes). Event-level branches are read by
+ * ReadEvent; track branches only by ReadTracks, so rejected events cost
+ * no track I/O. Track buffers live on the heap and grow to the largest
+ * nTrk seen, and only the branches required by the active HBTQualityCuts
+ * are read.
+ */
+class HBTTreeReader {
+public:
+    /**
+     * @param eventChain hiEvtAnalyzer/HiTree (vz, hiBin)
+     * @param trackChain ppTrack/trackTree
+     * @param skimChain skimanalysis/HltTree, nullptr to skip the event filters
+     * @throws std::runtime_error if a chain is null; reading throws if a
+     *         branch is missing, including an HBT_EVENT_FILTERS branch of skimChain
+     */
+    HBTTreeReader(TChain* eventChain, TChain* trackChain, TChain* skimChain = nullptr,
+                  const HBTQualityCuts& cuts = HBTQualityCuts(), bool isMC = false)
+        : event_{eventChain}, track_{trackChain}, skim_{skimChain}, cuts_(cuts), isMC_(isMC),
+          filterValues_(HBT_EVENT_FILTERS.size(), 1), filterBranches_(HBT_EVENT_FILTERS.size(), nullptr)
+    {
+        if (!eventChain || !trackChain) throw std::runtime_error("Null TChain provided");
+        // Which optional track branches the active cuts need
+        readHighPurity_ = cuts_.requireHighPurity;
+        readPixHits_ = cuts_.minPixelHits > 0;
+        readNhits_ = cuts_.minTotalHits > 0;
+        readChi2_ = std::isfinite(cuts_.maxChi2);
+    }
+    
+    /**
+     * Reads the event-level quantities of a chain entry
+     * @return false if the entry does not exist
+     */
+    bool ReadEvent(Long64_t entry, HBTEvent& event) {
+        event.clear();
+        event.isMC = isMC_;
+        entry_ = entry;
+        
+        if (!Load(event_, entry)) return false;
+        if (event_.changed) BindEvent();
+        b_vz_->GetEntry(event_.local);
+        b_hiBin_->GetEntry(event_.local);
+        event.vz = vz_;
+        event.hiBin = hiBin_;
+        
+        if (skim_.chain) {
+            if (!Load(skim_, entry)) return false;
+            if (skim_.changed) BindSkim();
+            for (std::size_t f = 0; f < filterBranches_.size(); ++f) {
+                filterBranches_[f]->GetEntry(skim_.local);
+                if (!filterValues_[f]) event.passFilters = false;
+            }
+        }
+        return true;
+    }
+    
+    /**
+     * Reads and selects the tracks of the entry given to the last ReadEvent
+     */
+    void ReadTracks(HBTEvent& event) {
+        if (!Load(track_, entry_)) return;
+        if (track_.changed) BindTracks();
+        
+        // Size first, then grow buffers before the arrays are read
+        b_nTrk_->GetEntry(track_.local);
+        if (nTrk_ > maxTracksSeen_) maxTracksSeen_ = nTrk_;
+        ReserveTracks(nTrk_);
+        
+        pt_.Read(track_.local);
+        eta_.Read(track_.local);
+        phi_.Read(track_.local);
+        dcaXY_.Read(track_.local);
+        dcaZ_.Read(track_.local);
+        charge_.Read(track_.local);
+        if (readHighPurity_) highPurity_.Read(track_.local);
+        if (readNhits_) nhits_.Read(track_.local);
+        if (readPixHits_) pixHits_.Read(track_.local);
+        if (readChi2_) chi2_.Read(track_.local);
+        
+        event.nTracks = 0;
+        for (int i = 0; i < nTrk_ && event.nTracks < MAX_HBT_TRACKS; ++i) {
+            if (pt_.data[i] < MIN_HBT_PT) continue;
+            if (fabs(eta_.data[i]) > MAX_HBT_ETA) continue;
+            if (readHighPurity_ && !highPurity_.data[i]) continue;
+            if (readPixHits_ && pixHits_.data[i] < cuts_.minPixelHits) continue;
+            if (readNhits_ && nhits_.data[i] < cuts_.minTotalHits) continue;
+            if (fabs(dcaXY_.data[i]) > cuts_.maxDcaXY) continue;
+            if (fabs(dcaZ_.data[i]) > cuts_.maxDcaZ) continue;
+            if (readChi2_ && chi2_.data[i] > cuts_.maxChi2) continue;
+            
+            event.pt[event.nTracks] = pt_.data[i];
+            event.eta[event.nTracks] = eta_.data[i];
+            event.phi[event.nTracks] = phi_.data[i];
+            event.dcaXY[event.nTracks] = dcaXY_.data[i];
+            event.dcaZ[event.nTracks] = dcaZ_.data[i];
+            event.charge[event.nTracks] = charge_.data[i];
+            event.goodTrack[event.nTracks] = true;
+            event.highPurity[event.nTracks] = readHighPurity_ ? highPurity_.data[i] : true;
+            event.nHits[event.nTracks] = readNhits_ ? nhits_.data[i] : 255;
+            event.nPixelHits[event.nTracks] = readPixHits_ ? pixHits_.data[i] : 255;
+            event.chi2[event.nTracks] = readChi2_ ? chi2_.data[i] : 0.0f;
+            event.nTracks++;
+        }
+        
+        if (isMC_) {
+            if (b_weight_) b_weight_->GetEntry(track_.local);
+            event.weight = weight_;
+            for (TBranch* b : {b_genPt_, b_genEta_, b_genPhi_, b_genChg_}) if (b) b->GetEntry(track_.local);
+            if (genPt_) event.genPt = *genPt_;
+            if (genEta_) event.genEta = *genEta_;
+            if (genPhi_) event.genPhi = *genPhi_;
+            if (genChg_) event.genCharge = *genChg_;
+        }
+    }
+    
+    int MaxTracksSeen() const { return maxTracksSeen_; }
+    
+    /** Tracks in the track tree for the last ReadTracks, before selection */
+    int RawTrackCount() const { return nTrk_; }
+    
+    /**
+     * Also reads the quality branches another set of cuts needs, so that
+     * PassTrackCuts can be evaluated for it. Call before the first ReadTracks.
+     */
+    void AlsoReadBranchesFor(const HBTQualityCuts& cuts) {
+        readHighPurity_ = readHighPurity_ || cuts.requireHighPurity;
+        readPixHits_ = readPixHits_ || cuts.minPixelHits > 0;
+        readNhits_ = readNhits_ || cuts.minTotalHits > 0;
+        readChi2_ = readChi2_ || std::isfinite(cuts.maxChi2);
+    }
+    
+    /**
+     * Sets up a TTreeCache on each chain for entries [first, last), filled
+     * with the branches this reader reads (registered up front)
+     * @param bytes Cache size per chain
+     */
+    void EnableCache(Long64_t first, Long64_t last, Long64_t bytes = HBT_TREE_CACHE_BYTES) {
+        std::vector<const char*> event_branches = {"vz", "hiBin"};
+        std::vector<const char*> track_branches = {"nTrk", "trkPt", "trkEta", "trkPhi",
+                                                   "trkDxy1", "trkDz1", "trkCharge"};
+        if (readHighPurity_) track_branches.push_back("highPurity");
+        if (readNhits_) track_branches.push_back("trkNHit");
+        if (readPixHits_) track_branches.push_back("trkNPixelHit");
+        if (readChi2_) track_branches.push_back("trkChi2");
+        if (isMC_) track_branches.insert(track_branches.end(), {"weight", "pt", "eta", "phi", "chg"});
+        std::vector<const char*> skim_branches;
+        for (const std::string& f : HBT_EVENT_FILTERS) skim_branches.push_back(f.c_str());
+        
+        SetupCache(event_.chain, event_branches, first, last, bytes);
+        SetupCache(track_.chain, track_branches, first, last, bytes);
+        if (skim_.chain) SetupCache(skim_.chain, skim_branches, first, last, bytes);
+    }
+    
+private:
+    struct ChainState {
+        TChain* chain = nullptr;
+        int treeNumber = -1;
+        Long64_t local = -1;
+        bool changed = false;
+    };
+    
+    static bool Load(ChainState& state, Long64_t entry) {
+        state.local = state.chain->LoadTree(entry);
+        if (state.local < 0) return false;
+        state.changed = (state.chain->GetTreeNumber() != state.treeNumber);
+        state.treeNumber = state.chain->GetTreeNumber();
+        return true;
+    }
+    
+    static void SetupCache(TChain* chain, const std::vector<const char*>& branches,
+                           Long64_t first, Long64_t last, Long64_t bytes) {
+        chain->SetCacheSize(bytes);
+        chain->SetCacheLearnEntries(1);
+        for (const char* name : branches) chain->AddBranchToCache(name, true);
+        chain->SetCacheEntryRange(first, last);
+    }
+    
+    static TBranch* Require(TTree* tree, const char* name) {
+        TBranch* b = tree->GetBranch(name);
+        if (!b) throw std::runtime_error(std::string("Missing branch: ") + name);
+        return b;
+    }
+    
+    void BindEvent() {
+        TTree* tree = event_.chain->GetTree();
+        b_vz_ = Require(tree, "vz");
+        b_hiBin_ = Require(tree, "hiBin");
+        b_vz_->SetAddress(&vz_);
+        b_hiBin_->SetAddress(&hiBin_);
+    }
+    
+    void BindSkim() {
+        TTree* tree = skim_.chain->GetTree();
+        for (std::size_t f = 0; f < HBT_EVENT_FILTERS.size(); ++f) {
+            filterBranches_[f] = Require(tree, HBT_EVENT_FILTERS[f].c_str());
+            filterBranches_[f]->SetAddress(&filterValues_[f]);
+        }
+    }
+    
+    void BindTracks() {
+        TTree* tree = track_.chain->GetTree();
+        b_nTrk_ = Require(tree, "nTrk");
+        b_nTrk_->SetAddress(&nTrk_);
+        pt_.branch = Require(tree, "trkPt");
+        eta_.branch = Require(tree, "trkEta");
+        phi_.branch = Require(tree, "trkPhi");
+        dcaXY_.branch = Require(tree, "trkDxy1");
+        dcaZ_.branch = Require(tree, "trkDz1");
+        charge_.branch = Require(tree, "trkCharge");
+        if (readHighPurity_) highPurity_.branch = Require(tree, "highPurity");
+        if (readNhits_) nhits_.branch = Require(tree, "trkNHit");
+        if (readPixHits_) pixHits_.branch = Require(tree, "trkNPixelHit");
+        if (readChi2_) chi2_.branch = Require(tree, "trkChi2");
+        ReserveTracks(1);
+        BindTrackBuffers();
+        
+        if (isMC_) {
+            b_weight_ = tree->GetBranch("weight");
+            b_genPt_ = tree->GetBranch("pt");
+            b_genEta_ = tree->GetBranch("eta");
+            b_genPhi_ = tree->GetBranch("phi");
+            b_genChg_ = Require(tree, "chg");   // Gen-level pairs need the charge of every gen particle
+            if (b_weight_) b_weight_->SetAddress(&weight_);
+            if (b_genPt_) b_genPt_->SetAddress(&genPt_);
+            if (b_genEta_) b_genEta_->SetAddress(&genEta_);
+            if (b_genPhi_) b_genPhi_->SetAddress(&genPhi_);
+            b_genChg_->SetAddress(&genChg_);
+        }
+    }
+    
+    void ReserveTracks(int n) {
+        bool moved = false;
+        moved |= pt_.Reserve(n);
+        moved |= eta_.Reserve(n);
+        moved |= phi_.Reserve(n);
+        moved |= dcaXY_.Reserve(n);
+        moved |= dcaZ_.Reserve(n);
+        moved |= charge_.Reserve(n);
+        moved |= highPurity_.Reserve(n);
+        moved |= nhits_.Reserve(n);
+        moved |= pixHits_.Reserve(n);
+        moved |= chi2_.Reserve(n);
+        if (moved) BindTrackBuffers();
+    }
+    
+    void BindTrackBuffers() {
+        pt_.Bind(); eta_.Bind(); phi_.Bind();
+        dcaXY_.Bind(); dcaZ_.Bind(); charge_.Bind();
+        highPurity_.Bind(); nhits_.Bind(); pixHits_.Bind(); chi2_.Bind();
+    }
+    
+    ChainState event_, track_, skim_;
+    HBTQualityCuts cuts_;
+    bool isMC_;
+    bool readHighPurity_, readPixHits_, readNhits_, readChi2_;
+    Long64_t entry_ = -1;
+    int maxTracksSeen_ = 0;
+    
+    // Event-level buffers
+    TBranch* b_vz_ = nullptr;
+    TBranch* b_hiBin_ = nullptr;
+    float vz_ = 0;
+    int hiBin_ = -1;
+    std::vector<int> filterValues_;
+    std::vector<TBranch*> filterBranches_;
+    
+    // Track buffers
+    TBranch* b_nTrk_ = nullptr;
+    int nTrk_ = 0;
+    HBTBranchBuffer<float> pt_, eta_, phi_, dcaXY_, dcaZ_, chi2_;
+    HBTBranchBuffer<Short_t> charge_;
+    HBTBranchBuffer<bool> highPurity_;
+    HBTBranchBuffer<UChar_t> nhits_, pixHits_;
+    
+    // MC buffers
+    TBranch *b_weight_ = nullptr, *b_genPt_ = nullptr, *b_genEta_ = nullptr, *b_genPhi_ = nullptr;
+    TBranch *b_genChg_ = nullptr;
+    float weight_ = 1.0;
+    std::vector<float> *genPt_ = nullptr, *genEta_ = nullptr, *genPhi_ = nullptr;
+    std::vector<int> *genChg_ = nullptr;
+};
+
 #endif // READ_TREE_H
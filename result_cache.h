@@ -0,0 +1,169 @@
+#ifndef HBT_RESULT_CACHE_H
+#define HBT_RESULT_CACHE_H
+
+#include "hbt_event_loop.h"
+#include "checkpoint.h"
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+/**
+ * @file result_cache.h
+ * @brief Incremental runs: one cached partial result per input file
+ *
+ * Every forest of the input list is processed as its own entry segment
+ * (chunks and mixing never cross a file boundary), and its LoopOutput is
+ * saved as <dir>/<basename>.<hash of path>.<hash of configuration>.hbtpart,
+ * in the checkpoint format (checkpoint.h). The checkpoint fingerprint of a
+ * part covers the configuration and the file stamp: entries, size and the
+ * ROOT file UUID, which changes whenever a file is rewritten. A rerun only
+ * processes files whose part is missing or stale, then adds all parts in
+ * list order, so the output does not depend on which parts were cached.
+ */
+
+namespace HBT {
+    namespace ResultCache {
+
+        constexpr std::uint32_t VERSION = 2;   // 2: tiered 3D q axes
+
+        using Index::FileStamp;
+        using Index::ReadFileStamp;
+
+        /**
+         * @brief Hash of everything but the input list that changes a file's result
+         * Covers the run switches, the correction table content (not the efficiency
+         * file name), the histogram binning of define_histograms.h and the cuts, so
+         * a rebuild with other bins or cut values does not reuse old parts.
+         * @param cfg Needs cfg.corrections
+         */
+        inline std::uint64_t ConfigFingerprint(const EventLoop::RunConfig& cfg) {
+            Checkpoint::Fingerprint fp;
+            fp.Add(VERSION);
+            fp.Add(EventLoop::CHUNK_ENTRIES);
+            for (int v : {cfg.run_mode, cfg.systematic, cfg.n_mix_events, cfg.cent_mult_window, cfg.mixing_mode,
+                          int(cfg.is_mc), int(cfg.do_mixing), int(cfg.do_3d), int(cfg.do_coulomb), int(cfg.use_cent)}) {
+                fp.Add(v);
+            }
+            fp.Add(double(cfg.vz_window));
+            fp.Add(cfg.prune_qmax);
+            EventLoop::AddCorrections(fp, *cfg.corrections);
+            EventLoop::AddBinning(fp);
+            EventLoop::AddCuts(fp, cfg.systematic);
+            return fp.Value();
+        }
+
+        inline std::uint64_t FileFingerprint(std::uint64_t config, const std::string& path, const FileStamp& stamp) {
+            Checkpoint::Fingerprint fp;
+            fp.Add(config);
+            fp.AddString(path);
+            fp.Add(stamp.entries);
+            fp.Add(stamp.bytes);
+            fp.AddString(stamp.uuid);
+            return fp.Value();
+        }
+
+        /**
+         * @brief Part file of a forest: <dir>/<basename>.<hash of path>.<config hash>.hbtpart
+         */
+        inline std::string PartPath(const std::string& dir, const std::string& path, std::uint64_t config) {
+            Checkpoint::Fingerprint fp;
+            fp.AddString(path);
+            char hash[34];
+            std::snprintf(hash, sizeof(hash), "%08llx.%016llx", static_cast<unsigned long long>(fp.Value() >> 32),
+                          static_cast<unsigned long long>(config));
+            return dir + "/" + path.substr(path.find_last_of('/') + 1) + "." + hash + ".hbtpart";
+        }
+
+        /**
+         * @brief Whether path holds a complete part with this fingerprint (the body is not read)
+         */
+        inline bool PartIsCurrent(const std::string& path, std::uint64_t fingerprint) {
+            Checkpoint::CheckpointHeader header;
+            try {
+                return Checkpoint::ReadCheckpoint(path, fingerprint, header, [](Checkpoint::BinaryReader&) {});
+            } catch (const std::exception&) {
+                return false;  // Stale or unreadable: processed again and overwritten
+            }
+        }
+
+        // Driver ==============================================================
+
+        /**
+         * @brief Runs the event loop on the files without a current part, then adds all parts
+         * @param n_entries Total entries of the input chains
+         * @param dir Directory of the parts, created if needed
+         * @return Sum of the parts of all files, in list order
+         * @throws std::runtime_error for skim run modes, an entry range, a pair cache,
+         *         checkpoints, or if a part cannot be written or read back
+         */
+        inline std::unique_ptr<EventLoop::LoopOutput> RunIncremental(const EventLoop::RunConfig& config,
+                                                                     Long64_t n_entries, const std::string& dir) {
+            using namespace EventLoop;
+            if (config.run_mode != RUN_FULL || config.first_entry != 0 || config.last_entry >= 0 ||
+                config.cache_qmax > 0 || !config.checkpoint_path.empty()) {
+                throw std::runtime_error("The result cache needs run_mode 0, the whole input list, "
+                                         "no pair cache and no checkpoints");
+            }
+            RunConfig cfg = config;
+            if (!cfg.corrections) cfg.corrections = MakeCorrectionTable(cfg.eff_hists);
+            const std::uint64_t config_fp = ConfigFingerprint(cfg);
+            gSystem->mkdir(dir.c_str(), kTRUE);
+
+            // Stamp every file; a part is reused only if written for this configuration and stamp
+            const std::vector<std::string> files = ReadFileList(cfg.input_file);
+            std::vector<std::string> parts(files.size());
+            std::vector<std::uint64_t> fingerprints(files.size());
+            std::vector<std::size_t> stale;
+            Long64_t offset = 0;
+            for (std::size_t f = 0; f < files.size(); ++f) {
+                const FileStamp stamp = ReadFileStamp(files[f]);
+                parts[f] = PartPath(dir, files[f], config_fp);
+                fingerprints[f] = FileFingerprint(config_fp, files[f], stamp);
+                if (stamp.entries > 0 && !PartIsCurrent(parts[f], fingerprints[f])) {
+                    cfg.segments.emplace_back(offset, offset + stamp.entries);
+                    stale.push_back(f);
+                }
+                if (stamp.entries == 0) parts[f].clear();
+                offset += stamp.entries;
+            }
+            if (offset != n_entries) {
+                throw std::runtime_error("Input files have " + std::to_string(offset) + " entries, the chain " +
+                                         std::to_string(n_entries));
+            }
+            std::cout << "Result cache " << dir << ": " << files.size() - stale.size() << " of " << files.size()
+                      << " files up to date, processing " << stale.size() << std::endl;
+
+            if (!stale.empty()) {
+                RunEventLoop(cfg, n_entries, false, [&](std::size_t s, const LoopOutput& part) {
+                    const std::size_t f = stale[s];
+                    Checkpoint::CheckpointHeader header;
+                    header.fingerprint = fingerprints[f];
+                    header.next_entry = cfg.segments[s].second;
+                    Checkpoint::WriteCheckpoint(parts[f], header,
+                                                [&](Checkpoint::BinaryWriter& out) { part.Save(out); });
+                });
+            }
+
+            // Parts are added in list order whether they were cached or just written
+            std::unique_ptr<LoopOutput> total(new LoopOutput(cfg.do_3d, WithMC(cfg)));
+            LoopOutput part(cfg.do_3d, WithMC(cfg));
+            for (std::size_t f = 0; f < files.size(); ++f) {
+                if (parts[f].empty()) continue;
+                Checkpoint::CheckpointHeader header;
+                if (!Checkpoint::ReadCheckpoint(parts[f], fingerprints[f], header,
+                                                [&](Checkpoint::BinaryReader& in) { part.Load(in); })) {
+                    throw std::runtime_error("Result cache part disappeared: " + parts[f]);
+                }
+                total->Add(part);
+            }
+            return total;
+        }
+
+    } // namespace ResultCache
+} // namespace HBT
+
+#endif // HBT_RESULT_CACHE_H
@@ -0,0 +1,340 @@
+#ifndef SYNTHETIC_EVENTS_H
+#define SYNTHETIC_EVENTS_H
+
+#include "call_libraries.h"
+#include "read_tree.h"
+#include "pair_kernel.h"
+#include <vector>
+#include <string>
+#include <random>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+/**
+ * @file synthetic_events.h
+ * @brief Deterministic synthetic XeXe events in the forest layout
+ *
+ * Events are drawn from a seeded std::mt19937_64: hiBin flat over 0-199
+ * (minimum bias), Ntrkoff from a power law in (1 - hiBin/200) with
+ * event-by-event fluctuations, and tracks with a thermal pT spectrum plus a
+ * power-law tail, flat η/φ, ±1 charges, Gaussian vz and track-quality
+ * values that mostly pass the nominal cuts. The centrality and multiplicity
+ * shapes can instead be taken from the 'centrality' and 'MultVSCent'
+ * histograms of a previous output, so timings follow the real event mix.
+ * WriteForest stores the events as hiEvtAnalyzer/HiTree, ppTrack/trackTree
+ * and skimanalysis/HltTree with the branches HBTTreeReader reads, which
+ * makes the whole chain runnable without the 2017 forests.
+ */
+
+namespace HBT {
+    namespace Synthetic {
+
+        /**
+         * @brief Shape of the generated sample
+         */
+        struct SyntheticConfig {
+            std::uint64_t seed = 20171012;
+            double central_mult = 2500;         // Mean accepted tracks (Ntrkoff) at hiBin 0
+            double mult_exponent = 2.8;         // Mean Ntrkoff ∝ (1 - hiBin/200)^mult_exponent
+            double min_mult = 5;                // Mean Ntrkoff floor for peripheral events
+            double mult_spread = 0.08;          // Relative event-by-event width on top of Poisson
+            double pt_min = 0.1;                // GeV/c, below the analysis cut on purpose
+            double pt_temperature = 0.25;       // GeV/c, soft part ∝ pT exp(-pT/T)
+            double hard_fraction = 0.02;        // Tracks from the power-law tail
+            double hard_power = 6;              // Tail ∝ pT^-hard_power above 1 GeV/c
+            double eta_max = 2.5;               // Generated |η|, wider than MAX_HBT_ETA
+            double vz_mean = 0.3;               // cm
+            double vz_sigma = 5.0;              // cm
+            double high_purity_fraction = 0.95;
+            double secondary_fraction = 0.03;   // Tracks with wide DCA distributions
+            double filter_pass_fraction = 0.99; // Per event filter
+            const TH1* centrality_shape = nullptr;  // hiBin distribution, flat if null
+            const TH2* mult_vs_cent = nullptr;      // Ntrkoff (x) per hiBin (y), replaces the power law
+        };
+
+        /**
+         * @brief One generated event, raw tracks as stored in the forest
+         */
+        struct SyntheticEvent {
+            int hiBin = 0;
+            float vz = 0;
+            std::vector<int> filters;   // One value per HBT_EVENT_FILTERS entry
+            int nTrk = 0;
+            std::vector<float> pt, eta, phi, dcaXY, dcaZ, chi2;
+            std::vector<Short_t> charge;
+            std::vector<char> highPurity;
+            std::vector<UChar_t> nHits, nPixelHits;
+
+            void Resize(int n) {
+                nTrk = n;
+                pt.resize(n); eta.resize(n); phi.resize(n);
+                dcaXY.resize(n); dcaZ.resize(n); chi2.resize(n);
+                charge.resize(n); highPurity.resize(n);
+                nHits.resize(n); nPixelHits.resize(n);
+            }
+        };
+
+        /**
+         * @brief Same track selection as HBTTreeReader::ReadTracks
+         */
+        inline bool PassesReadSelection(const SyntheticEvent& ev, int i, const HBTQualityCuts& cuts) {
+            if (ev.pt[i] < MIN_HBT_PT) return false;
+            if (std::fabs(ev.eta[i]) > MAX_HBT_ETA) return false;
+            if (cuts.requireHighPurity && !ev.highPurity[i]) return false;
+            if (ev.nPixelHits[i] < cuts.minPixelHits) return false;
+            if (ev.nHits[i] < cuts.minTotalHits) return false;
+            if (std::fabs(ev.dcaXY[i]) > cuts.maxDcaXY) return false;
+            if (std::fabs(ev.dcaZ[i]) > cuts.maxDcaZ) return false;
+            return !(ev.chi2[i] > cuts.maxChi2);
+        }
+
+        /**
+         * @brief Selected tracks of an event as SoA, unit weights
+         * @return Number of selected tracks (Ntrkoff)
+         */
+        inline int FillTrackSoA(const SyntheticEvent& ev, const HBTQualityCuts& cuts, double mass,
+                                Kernel::TrackSoA& tracks) {
+            tracks.clear();
+            tracks.reserve(ev.nTrk);
+            for (int i = 0; i < ev.nTrk; ++i) {
+                if (!PassesReadSelection(ev, i, cuts)) continue;
+                tracks.push_back_ptetaphi(ev.pt[i], ev.eta[i], ev.phi[i], mass, ev.charge[i], 1.0);
+            }
+            return tracks.size();
+        }
+
+        // Generator ===========================================================
+
+        class SyntheticEventGenerator {
+        public:
+            explicit SyntheticEventGenerator(const SyntheticConfig& cfg = SyntheticConfig())
+                : cfg_(cfg), rng_(cfg.seed) {
+                if (cfg_.centrality_shape) BuildCentralityCdf(cfg_.centrality_shape);
+                if (cfg_.mult_vs_cent) BuildMultiplicityCdfs(cfg_.mult_vs_cent);
+                acceptance_ = EstimateAcceptance();
+            }
+
+            /**
+             * @brief Mean Ntrkoff of the power-law model at a hiBin
+             */
+            double MeanMultiplicity(int hiBin) const {
+                double x = 1.0 - std::min(std::max(hiBin, 0), 199) / 200.0;
+                return std::max(cfg_.min_mult, cfg_.central_mult * std::pow(x, cfg_.mult_exponent));
+            }
+
+            /**
+             * @brief Fraction of raw tracks passing the nominal read selection
+             */
+            double Acceptance() const { return acceptance_; }
+
+            /**
+             * @brief Draws the next event
+             */
+            void Next(SyntheticEvent& ev) {
+                ev.hiBin = DrawHiBin();
+                ev.vz = static_cast<float>(std::normal_distribution<double>(cfg_.vz_mean, cfg_.vz_sigma)(rng_));
+                ev.filters.assign(HBT_EVENT_FILTERS.size(), 1);
+                for (int& f : ev.filters) f = Uniform() < cfg_.filter_pass_fraction ? 1 : 0;
+
+                // Raw nTrk so that the selected tracks follow the Ntrkoff model
+                double accepted = DrawMultiplicity(ev.hiBin);
+                double raw_mean = accepted / std::max(acceptance_, 1e-3);
+                int n = std::poisson_distribution<int>(std::max(raw_mean, 0.0))(rng_);
+                ev.Resize(std::min(n, MAX_HBT_TRACKS));
+                for (int i = 0; i < ev.nTrk; ++i) DrawTrack(ev, i);
+            }
+
+        private:
+            double Uniform() { return std::uniform_real_distribution<double>(0.0, 1.0)(rng_); }
+
+            void DrawTrack(SyntheticEvent& ev, int i) {
+                if (Uniform() < cfg_.hard_fraction) {
+                    ev.pt[i] = static_cast<float>(std::pow(1.0 - Uniform(), -1.0 / (cfg_.hard_power - 1.0)));
+                } else {
+                    ev.pt[i] = static_cast<float>(cfg_.pt_min +
+                        std::gamma_distribution<double>(2.0, cfg_.pt_temperature)(rng_));
+                }
+                ev.eta[i] = static_cast<float>(cfg_.eta_max * (2.0 * Uniform() - 1.0));
+                ev.phi[i] = static_cast<float>(M_PI * (2.0 * Uniform() - 1.0));
+                ev.charge[i] = Uniform() < 0.5 ? 1 : -1;
+
+                // DCA significances: primaries ~N(0,1), secondaries much wider
+                double dca_width = Uniform() < cfg_.secondary_fraction ? 5.0 : 1.0;
+                std::normal_distribution<double> dca(0.0, dca_width);
+                ev.dcaXY[i] = static_cast<float>(dca(rng_));
+                ev.dcaZ[i] = static_cast<float>(dca(rng_));
+                ev.chi2[i] = static_cast<float>(std::gamma_distribution<double>(4.0, 0.25)(rng_));
+                ev.highPurity[i] = Uniform() < cfg_.high_purity_fraction;
+                ev.nHits[i] = static_cast<UChar_t>(8 + std::binomial_distribution<int>(22, 0.6)(rng_));
+                ev.nPixelHits[i] = static_cast<UChar_t>(std::binomial_distribution<int>(4, 0.85)(rng_));
+            }
+
+            int DrawHiBin() {
+                if (cent_cdf_.empty()) return std::uniform_int_distribution<int>(0, 199)(rng_);
+                std::size_t b = DrawBin(cent_cdf_);
+                return std::min(199, std::max(0, static_cast<int>(cent_low_[b] + Uniform() * cent_width_[b])));
+            }
+
+            double DrawMultiplicity(int hiBin) {
+                if (!mult_cdf_.empty()) {
+                    const int y = std::min(static_cast<int>(mult_cdf_.size()) - 1,
+                                           std::max(0, mult_row_[std::min(hiBin, 199)]));
+                    if (!mult_cdf_[y].empty() && mult_cdf_[y].back() > 0) {
+                        std::size_t b = DrawBin(mult_cdf_[y]);
+                        return mult_low_[b] + Uniform() * mult_width_[b];
+                    }
+                }
+                double mean = MeanMultiplicity(hiBin);
+                double fluct = std::normal_distribution<double>(1.0, cfg_.mult_spread)(rng_);
+                return std::max(0.0, mean * fluct);
+            }
+
+            std::size_t DrawBin(const std::vector<double>& cdf) {
+                double u = Uniform() * cdf.back();
+                return std::min(cdf.size() - 1,
+                                std::size_t(std::upper_bound(cdf.begin(), cdf.end(), u) - cdf.begin()));
+            }
+
+            void BuildCentralityCdf(const TH1* h) {
+                const TAxis* axis = h->GetXaxis();
+                double sum = 0;
+                for (int b = 1; b <= h->GetNbinsX(); ++b) {
+                    if (axis->GetBinUpEdge(b) <= 0 || axis->GetBinLowEdge(b) >= 200) continue;
+                    sum += std::max(0.0, h->GetBinContent(b));
+                    cent_cdf_.push_back(sum);
+                    cent_low_.push_back(axis->GetBinLowEdge(b));
+                    cent_width_.push_back(axis->GetBinWidth(b));
+                }
+                if (sum <= 0) cent_cdf_.clear();
+            }
+
+            /**
+             * One multiplicity CDF per hiBin row of the histogram
+             */
+            void BuildMultiplicityCdfs(const TH2* h) {
+                const TAxis* xaxis = h->GetXaxis();
+                const TAxis* yaxis = h->GetYaxis();
+                for (int bx = 1; bx <= h->GetNbinsX(); ++bx) {
+                    mult_low_.push_back(xaxis->GetBinLowEdge(bx));
+                    mult_width_.push_back(xaxis->GetBinWidth(bx));
+                }
+                for (int by = 1; by <= h->GetNbinsY(); ++by) {
+                    std::vector<double> cdf;
+                    double sum = 0;
+                    for (int bx = 1; bx <= h->GetNbinsX(); ++bx) {
+                        sum += std::max(0.0, h->GetBinContent(bx, by));
+                        cdf.push_back(sum);
+                    }
+                    mult_cdf_.push_back(std::move(cdf));
+                }
+                mult_row_.resize(200);
+                for (int hiBin = 0; hiBin < 200; ++hiBin) mult_row_[hiBin] = yaxis->FindBin(hiBin + 0.5) - 1;
+            }
+
+            /**
+             * Selected fraction of a large sample of generated tracks
+             */
+            double EstimateAcceptance() {
+                std::mt19937_64 saved = rng_;
+                SyntheticEvent probe;
+                probe.Resize(20000);
+                for (int i = 0; i < probe.nTrk; ++i) DrawTrack(probe, i);
+                int n_pass = 0;
+                const HBTQualityCuts cuts;
+                for (int i = 0; i < probe.nTrk; ++i) n_pass += PassesReadSelection(probe, i, cuts);
+                rng_ = saved;
+                return double(n_pass) / probe.nTrk;
+            }
+
+            SyntheticConfig cfg_;
+            std::mt19937_64 rng_;
+            double acceptance_ = 1;
+            std::vector<double> cent_cdf_, cent_low_, cent_width_;
+            std::vector<std::vector<double>> mult_cdf_;   // [hiBin row][multiplicity bin]
+            std::vector<double> mult_low_, mult_width_;
+            std::vector<int> mult_row_;                   // hiBin -> row of mult_cdf_
+        };
+
+        // Forest Writer =======================================================
+
+        /**
+         * @brief Writes n_events synthetic events as a forest-like file
+         * @param path Output ROOT file
+         * @return Number of events written
+         * @throws std::runtime_error if the file cannot be created
+         */
+        inline Long64_t WriteForest(const std::string& path, Long64_t n_events,
+                                    const SyntheticConfig& cfg = SyntheticConfig()) {
+            TFile file(path.c_str(), "RECREATE");
+            if (file.IsZombie()) throw std::runtime_error("Could not create synthetic forest: " + path);
+
+            // Branch buffers, fixed addresses for the whole file
+            float vz = 0;
+            int hiBin = 0;
+            int nTrk = 0;
+            std::vector<int> filters(HBT_EVENT_FILTERS.size(), 1);
+            std::vector<float> pt(MAX_HBT_TRACKS), eta(MAX_HBT_TRACKS), phi(MAX_HBT_TRACKS);
+            std::vector<float> dcaXY(MAX_HBT_TRACKS), dcaZ(MAX_HBT_TRACKS), chi2(MAX_HBT_TRACKS);
+            std::vector<Short_t> charge(MAX_HBT_TRACKS);
+            std::unique_ptr<bool[]> highPurity(new bool[MAX_HBT_TRACKS]);
+            std::vector<UChar_t> nHits(MAX_HBT_TRACKS), nPixelHits(MAX_HBT_TRACKS);
+
+            file.mkdir("hiEvtAnalyzer")->cd();
+            TTree* hiTree = new TTree("HiTree", "synthetic event info");
+            hiTree->Branch("vz", &vz, "vz/F");
+            hiTree->Branch("hiBin", &hiBin, "hiBin/I");
+
+            file.mkdir("ppTrack")->cd();
+            TTree* trackTree = new TTree("trackTree", "synthetic tracks");
+            trackTree->Branch("nTrk", &nTrk, "nTrk/I");
+            trackTree->Branch("trkPt", pt.data(), "trkPt[nTrk]/F");
+            trackTree->Branch("trkEta", eta.data(), "trkEta[nTrk]/F");
+            trackTree->Branch("trkPhi", phi.data(), "trkPhi[nTrk]/F");
+            trackTree->Branch("trkDxy1", dcaXY.data(), "trkDxy1[nTrk]/F");
+            trackTree->Branch("trkDz1", dcaZ.data(), "trkDz1[nTrk]/F");
+            trackTree->Branch("trkCharge", charge.data(), "trkCharge[nTrk]/S");
+            trackTree->Branch("highPurity", highPurity.get(), "highPurity[nTrk]/O");
+            trackTree->Branch("trkNHit", nHits.data(), "trkNHit[nTrk]/b");
+            trackTree->Branch("trkNPixelHit", nPixelHits.data(), "trkNPixelHit[nTrk]/b");
+            trackTree->Branch("trkChi2", chi2.data(), "trkChi2[nTrk]/F");
+
+            file.mkdir("skimanalysis")->cd();
+            TTree* hltTree = new TTree("HltTree", "synthetic event filters");
+            for (std::size_t f = 0; f < HBT_EVENT_FILTERS.size(); ++f) {
+                hltTree->Branch(HBT_EVENT_FILTERS[f].c_str(), &filters[f], (HBT_EVENT_FILTERS[f] + "/I").c_str());
+            }
+
+            SyntheticEventGenerator gen(cfg);
+            SyntheticEvent ev;
+            for (Long64_t e = 0; e < n_events; ++e) {
+                gen.Next(ev);
+                vz = ev.vz;
+                hiBin = ev.hiBin;
+                std::copy(ev.filters.begin(), ev.filters.end(), filters.begin());
+                nTrk = ev.nTrk;
+                std::copy(ev.pt.begin(), ev.pt.end(), pt.begin());
+                std::copy(ev.eta.begin(), ev.eta.end(), eta.begin());
+                std::copy(ev.phi.begin(), ev.phi.end(), phi.begin());
+                std::copy(ev.dcaXY.begin(), ev.dcaXY.end(), dcaXY.begin());
+                std::copy(ev.dcaZ.begin(), ev.dcaZ.end(), dcaZ.begin());
+                std::copy(ev.chi2.begin(), ev.chi2.end(), chi2.begin());
+                std::copy(ev.charge.begin(), ev.charge.end(), charge.begin());
+                std::copy(ev.highPurity.begin(), ev.highPurity.end(), highPurity.get());
+                std::copy(ev.nHits.begin(), ev.nHits.end(), nHits.begin());
+                std::copy(ev.nPixelHits.begin(), ev.nPixelHits.end(), nPixelHits.begin());
+                hiTree->Fill();
+                trackTree->Fill();
+                hltTree->Fill();
+            }
+
+            file.Write();
+            file.Close();
+            return n_events;
+        }
+
+    } // namespace Synthetic
+} // namespace HBT
+
+#endif // SYNTHETIC_EVENTS_H
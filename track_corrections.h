@@ -3,6 +3,10 @@
 
 #include "call_libraries.h"
 #include <stdexcept>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
 
 /**
  * @file track_corrections.h
@@ -41,6 +45,7 @@ namespace HBT {
          */
         inline double SafeGetBinContent(const TH2* hist, double eta, double pt, 
                                        double fallback = 1.0) {
+            if (!hist) return fallback;
             int xbin = hist->GetXaxis()->FindBin(eta);
             int ybin = hist->GetYaxis()->FindBin(pt);
             
@@ -65,6 +70,29 @@ namespace HBT {
             return 1.0 / eff;
         }
 
+        /**
+         * @brief Combination of the correction maps at (pt, eta), without range check
+         * @see FullTrackCorrection for the modes
+         */
+        inline double CombinedCorrection(
+            const TH2* eff_map, const TH2* fake_map, const TH2* sec_map, const TH2* mul_map,
+            double pt, double eta, int mode)
+        {
+            // Get all components
+            double eff = SafeGetBinContent(eff_map, eta, pt);
+            double fake = SafeGetBinContent(fake_map, eta, pt, 0.0);
+            
+            // Early return for simplified modes
+            if (mode == 2) return 1.0 / eff;          // Efficiency only
+            if (mode == 1) return (1.0 - fake) / eff; // Efficiency + fakes
+            
+            // Full correction
+            double sec = sec_map ? SafeGetBinContent(sec_map, eta, pt, 0.0) : 0.0;
+            double mul = mul_map ? SafeGetBinContent(mul_map, eta, pt, 0.0) : 0.0;
+            
+            return (1.0 - fake) * (1.0 - sec) / eff / (1.0 + mul);
+        }
+
         /**
          * @brief Complete track correction including fakes/seconadries/multiples
          * @param eff_map Efficiency map
@@ -82,22 +110,189 @@ namespace HBT {
             double pt = 0, double eta = 0, int mode = 0) 
         {
             ValidateTrack(pt, eta);
-            
-            // Get all components
-            double eff = SafeGetBinContent(eff_map, eta, pt);
-            double fake = SafeGetBinContent(fake_map, eta, pt, 0.0);
-            
-            // Early return for simplified modes
-            if (mode == 2) return 1.0 / eff;          // Efficiency only
-            if (mode == 1) return (1.0 - fake) / eff; // Efficiency + fakes
-            
-            // Full correction
-            double sec = sec_map ? SafeGetBinContent(sec_map, eta, pt, 0.0) : 0.0;
-            double mul = mul_map ? SafeGetBinContent(mul_map, eta, pt, 0.0) : 0.0;
-            
-            return (1.0 - fake) * (1.0 - sec) / eff / (1.0 + mul);
+            return CombinedCorrection(eff_map, fake_map, sec_map, mul_map, pt, eta, mode);
         }
 
+        /**
+         * @brief Correction maps of an efficiency file, in the order eff, fake, secondary, multiple
+         * @param names Comma-separated histogram names in that order; an empty or
+         *        missing entry leaves that map out (nullptr)
+         * @return Histograms owned by file
+         * @throws std::runtime_error if a named histogram is missing or not a TH2D
+         */
+        inline std::vector<TH2D*> LoadCorrectionMaps(TFile& file, const std::string& names) {
+            std::vector<TH2D*> maps;
+            std::size_t begin = 0;
+            while (maps.size() < 4) {
+                const std::size_t end = std::min(names.find(',', begin), names.size());
+                const std::string name = (begin < names.size()) ? names.substr(begin, end - begin) : "";
+                TH2D* map = nullptr;
+                if (!name.empty()) {
+                    map = dynamic_cast<TH2D*>(file.Get(name.c_str()));
+                    if (!map) throw std::runtime_error("No TH2D " + name + " in " + file.GetName());
+                }
+                maps.push_back(map);
+                begin = end + 1;
+            }
+            return maps;
+        }
+
+        // Flat Lookup Table ===================================================
+
+        // Range flags returned by CorrectionTable (0 = in range)
+        constexpr std::uint8_t CORR_ETA_OUT_OF_RANGE = 1;
+        constexpr std::uint8_t CORR_PT_OUT_OF_RANGE = 2;
+
+        /**
+         * @brief Range check of ValidateTrack as flags instead of exceptions
+         */
+        inline std::uint8_t TrackRangeFlags(double pt, double eta) {
+            std::uint8_t flags = 0;
+            if (std::abs(eta) > MAX_ETA) flags |= CORR_ETA_OUT_OF_RANGE;
+            if (pt < MIN_PT || pt > MAX_PT) flags |= CORR_PT_OUT_OF_RANGE;
+            return flags;
+        }
+
+        /**
+         * @brief Bin edges with TAxis::FindBin lookup (0 = underflow, n+1 = overflow)
+         * Uniform edges use the TAxis arithmetic formula, others a binary search.
+         */
+        class TableAxis {
+        public:
+            TableAxis() : edges_{0.0, 1.0} {}
+
+            explicit TableAxis(std::vector<double> edges) : edges_(std::move(edges)) {
+                if (edges_.size() < 2) edges_ = {0.0, 1.0};
+                const int n = NBins();
+                lo_ = edges_.front();
+                hi_ = edges_.back();
+                const double width = (hi_ - lo_) / n;
+                uniform_ = true;
+                for (int i = 0; i <= n && uniform_; ++i) {
+                    uniform_ = std::abs(edges_[i] - (lo_ + i * width)) <= 1e-9 * std::max(1.0, std::abs(hi_ - lo_));
+                }
+            }
+
+            int NBins() const { return static_cast<int>(edges_.size()) - 1; }
+            bool Uniform() const { return uniform_; }
+            double Edge(int i) const { return edges_[i]; }
+
+            int FindBin(double x) const {
+                if (x < lo_) return 0;
+                if (!(x < hi_)) return NBins() + 1;
+                if (uniform_) return std::min(NBins(), 1 + int(NBins() * (x - lo_) / (hi_ - lo_)));
+                return int(std::upper_bound(edges_.begin(), edges_.end(), x) - edges_.begin());
+            }
+
+            /**
+             * @brief A point inside bin b (0..n+1), used to sample the source maps
+             */
+            double Center(int b) const {
+                if (b <= 0) return lo_ - 1.0;
+                if (b > NBins()) return hi_ + 1.0;
+                return 0.5 * (edges_[b - 1] + edges_[b]);
+            }
+
+        private:
+            std::vector<double> edges_;
+            double lo_ = 0, hi_ = 1;
+            bool uniform_ = true;
+        };
+
+        /**
+         * @brief All correction maps and the combination mode folded into one float grid
+         *
+         * The grid axes are the union of the bin edges of all maps, so every
+         * cell lies inside one bin of each map and the folded value is
+         * CombinedCorrection at any point of the cell, including the fallbacks
+         * of SafeGetBinContent, rounded to float (relative error below 1e-7,
+         * checked in validate_hbt.C). Build once per efficiency table set;
+         * lookups are two axis searches and one load, and never throw.
+         */
+        class CorrectionTable {
+        public:
+            /**
+             * @brief Identity table (every weight is 1)
+             */
+            CorrectionTable() : values_((1 + 2) * (1 + 2), 1.0f) {}
+
+            /**
+             * @param mode As in FullTrackCorrection (0 full, 1 eff+fakes, 2 eff only)
+             */
+            CorrectionTable(const TH2* eff_map, const TH2* fake_map,
+                            const TH2* sec_map = nullptr, const TH2* mul_map = nullptr, int mode = 0) {
+                const TH2* maps[4] = {eff_map, fake_map, sec_map, mul_map};
+                eta_ = TableAxis(UnionEdges(maps, true));
+                pt_ = TableAxis(UnionEdges(maps, false));
+                const int nEta = eta_.NBins() + 2;
+                const int nPt = pt_.NBins() + 2;
+                values_.resize(std::size_t(nEta) * nPt);
+                for (int e = 0; e < nEta; ++e) {
+                    for (int p = 0; p < nPt; ++p) {
+                        values_[std::size_t(e) * nPt + p] = static_cast<float>(CombinedCorrection(
+                            eff_map, fake_map, sec_map, mul_map, pt_.Center(p), eta_.Center(e), mode));
+                    }
+                }
+            }
+
+            /**
+             * @brief Correction weight without range check
+             */
+            float Lookup(double pt, double eta) const {
+                return values_[std::size_t(eta_.FindBin(eta)) * (pt_.NBins() + 2) + pt_.FindBin(pt)];
+            }
+
+            /**
+             * @brief Correction weight and range flags of one track
+             * @return 0 if in range, else CORR_*_OUT_OF_RANGE bits (weight is still set)
+             */
+            std::uint8_t Correct(double pt, double eta, double& weight) const {
+                weight = Lookup(pt, eta);
+                return TrackRangeFlags(pt, eta);
+            }
+
+            /**
+             * @brief Corrects a whole event's track arrays
+             * @param weights Output, n weights
+             * @param flags Output, n range flags (may be nullptr)
+             * @return Number of out-of-range tracks
+             */
+            int CorrectEvent(int n, const float* pt, const float* eta,
+                             double* weights, std::uint8_t* flags = nullptr) const {
+                int n_bad = 0;
+                for (int t = 0; t < n; ++t) {
+                    std::uint8_t f = Correct(pt[t], eta[t], weights[t]);
+                    if (flags) flags[t] = f;
+                    n_bad += (f != 0);
+                }
+                return n_bad;
+            }
+
+            const TableAxis& EtaAxis() const { return eta_; }
+            const TableAxis& PtAxis() const { return pt_; }
+            const std::vector<float>& Values() const { return values_; }
+            std::size_t MemoryBytes() const { return values_.capacity() * sizeof(float); }
+
+        private:
+            static std::vector<double> UnionEdges(const TH2* const* maps, bool etaAxis) {
+                std::vector<double> edges;
+                for (int m = 0; m < 4; ++m) {
+                    if (!maps[m]) continue;
+                    const TAxis* axis = etaAxis ? maps[m]->GetXaxis() : maps[m]->GetYaxis();
+                    for (int b = 1; b <= axis->GetNbins(); ++b) edges.push_back(axis->GetBinLowEdge(b));
+                    edges.push_back(axis->GetBinUpEdge(axis->GetNbins()));
+                }
+                std::sort(edges.begin(), edges.end());
+                edges.erase(std::unique(edges.begin(), edges.end(),
+                                        [](double a, double b) { return std::abs(a - b) < 1e-12; }),
+                            edges.end());
+                return edges;
+            }
+
+            TableAxis eta_, pt_;
+            std::vector<float> values_;  // [eta bin][pt bin], under/overflow included
+        };
+
     } // namespace Corrections
 } // namespace HBT
 